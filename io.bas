@@ -1,6 +1,7 @@
-function printStr(str, chn)
+function printStr(chn, str)
  asm
   lref 1
+  lref 0
   trap 2
  end asm
 end function
@@ -8,18 +9,70 @@ end function
 function printInt(chn, n)
  asm
   lref 1
+  lref 0
   trap 3
  end asm
 end function
 
 function printTab(chn)
  asm
+  lref 0
   trap 4
  end asm
 end function
 
 function printNL(chn)
  asm
+  lref 0
   trap 5
  end asm
 end function
+
+function fileOpen(chn, mode, name)
+ asm
+  lref 2
+  lref 1
+  lref 0
+  trap 7
+ end asm
+end function
+
+function fileClose(chn)
+ asm
+  lref 0
+  trap 8
+ end asm
+end function
+
+function inputInt(chn)
+ asm
+  lref 0
+  trap 9
+  returnx
+ end asm
+end function
+
+function inputEnd(chn)
+ asm
+  lref 0
+  trap 12
+ end asm
+end function
+
+function lineInput(chn, size, buf)
+ asm
+  lref 2
+  lref 1
+  lref 0
+  trap 10
+  returnx
+ end asm
+end function
+
+function eof(chn)
+ asm
+  lref 0
+  trap 11
+  returnx
+ end asm
+end function
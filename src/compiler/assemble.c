@@ -90,6 +90,28 @@ static void Assemble(ParseContext_t *c, char *name) {
                 case FMT_NATIVE:
                     putcword(g, ParseIntegerConstant(c));
                     break;
+                case FMT_REG:
+                    putcbyte(g, ParseIntegerConstant(c));
+                    break;
+                case FMT_REG2:
+                case FMT_REGS:
+                    putcbyte(g, ParseIntegerConstant(c));
+                    FRequire(c, ',');
+                    putcbyte(g, ParseIntegerConstant(c));
+                    break;
+                case FMT_REG3:
+                case FMT_REGI:
+                    putcbyte(g, ParseIntegerConstant(c));
+                    FRequire(c, ',');
+                    putcbyte(g, ParseIntegerConstant(c));
+                    FRequire(c, ',');
+                    putcbyte(g, ParseIntegerConstant(c));
+                    break;
+                case FMT_REGW:
+                    putcbyte(g, ParseIntegerConstant(c));
+                    FRequire(c, ',');
+                    putcword(g, ParseIntegerConstant(c));
+                    break;
                 default:
                     ParseError(c, "instruction not currently supported");
                     break;
@@ -22,6 +22,11 @@
 #include "compile.h"
 #include "vm.h"
 
+// local function prototypes
+static void MarkFunction(ParseContext_t *c, ParseTreeNode_t *function);
+static void MarkNode(ParseContext_t *c, ParseTreeNode_t *node);
+static void MarkNodeList(ParseContext_t *c, NodeListEntry_t *list);
+
 // InitCompileContext - initialize the compile (parse) context
 ParseContext_t* InitCompileContext(vm_context_t *sys) {
     ParseContext_t *c;
@@ -32,22 +37,33 @@ ParseContext_t* InitCompileContext(vm_context_t *sys) {
     return c;
 }
 
-// Compile - parse a program
-void Compile(ParseContext_t *c, bool debug) {
+// Compile - parse a program, false after an error
+int Compile(ParseContext_t *c, bool debug) {
+    NodeListEntry_t *entry;
     Symbol_t *symbol;
     
     uint8_t *init_mem = c->sys->nextLow;
 
     // setup an error target
     if (setjmp(c->sys->errorTarget) != 0)
-        return;
+        return VMFALSE;
+
+    // the image starts with its header, the export table offset is filled in at the end
+    memset(vm_allocate_low_memory(c->sys, sizeof(vm_image_t)), 0, sizeof(vm_image_t));
 
     // initialize the string table
     c->strings = NULL;
 
+    // initialize the function definition list
+    c->functions = NULL;
+    c->pNextFunction = &c->functions;
+
+    c->g->debug = debug;
+
     // initialize block nesting table
-    c->btop = (Block_t*) ((char*) c->blockBuf + sizeof(c->blockBuf));
-    c->bptr = &c->blockBuf[0] - 1;
+    c->blockBuf = (Block_t*) system_arena_allocate(c->sys, MAXBLOCKS * sizeof(Block_t));
+    c->btop = c->blockBuf + MAXBLOCKS;
+    c->bptr = c->blockBuf - 1;
 
     // create the main function
     c->mainFunction = StartFunction(c, NULL);
@@ -67,10 +83,66 @@ void Compile(ParseContext_t *c, bool debug) {
     
     if (debug)
         PrintNode(c->mainFunction, 0);
-    
+
+    // keep the functions reached from main and from the functions of the program itself
+    c->usedFunctions = NULL;
+    c->pNextUsed = &c->usedFunctions;
+    c->usedCnt = 0;
+    MarkFunction(c, c->mainFunction);
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (!entry->node->u.functionDefinition.included)
+            MarkFunction(c, entry->node);
+
+    // functions that are unchanged since the previous compile keep their code
+    if (c->cache)
+        CheckCachedFunctions(c);
+
+    // the constant assignments that start main also initialize their variables
+    InitGlobals(c);
+
+    // global variables that never change are replaced by their values
+    if (c->g->optLevel > 0)
+        ConstantGlobals(c);
+
+    // calls of functions without side effects on literals are replaced by their results, which can leave functions unused
+    if (c->g->optLevel > 0) {
+        EvaluateCalls(c);
+        c->mainFunction->u.functionDefinition.used = VMFALSE;
+        for (entry = c->functions; entry != NULL; entry = entry->next)
+            entry->node->u.functionDefinition.used = VMFALSE;
+        c->usedFunctions = NULL;
+        c->pNextUsed = &c->usedFunctions;
+        c->usedCnt = 0;
+        MarkFunction(c, c->mainFunction);
+        for (entry = c->functions; entry != NULL; entry = entry->next)
+            if (!entry->node->u.functionDefinition.included)
+                MarkFunction(c, entry->node);
+    }
+
+    // a function only inlines the functions generated before it, main comes last
+    c->mainFunction->u.functionDefinition.order = c->usedCnt;
+
+    // worker threads generate the functions into private buffers, the debug dumps keep the sequential order
+    if (c->g->threads > 1 && !debug)
+        GenerateParallel(c);
+
+    // generate or link the code of the used functions with the functions they call first, library functions nothing calls are dropped
+    for (entry = c->usedFunctions; entry != NULL; entry = entry->next) {
+        ParseTreeNode_t *node = entry->node;
+        GeneratedCode_t *gen = node->u.functionDefinition.generated;
+        VMVALUE code;
+        if (c->cache && GenerateCached(c, node))
+            continue;
+        if (gen)
+            code = GenerateCopy(c->g, node, gen->code, gen->codeLen, gen->refs, gen->refCnt);
+        else
+            code = Generate(c->g, node);
+        if (c->cache)
+            CacheFunction(c, node, code);
+    }
+
     // generate code for the main function
     c->g->mainCode = Generate(c->g, c->mainFunction);
-    c->g->code_len = c->sys->nextLow - init_mem;
 
     // store all implicitly declared global variables
     for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
@@ -81,11 +153,117 @@ void Compile(ParseContext_t *c, bool debug) {
         }
     }
 
+    // store the exported function table
+    c->g->exports = StoreExports(c->g);
+    ((vm_image_t*) init_mem)->exports = c->g->exports;
+
+    // the image includes the globals and the export table
+    c->g->code_len = c->sys->nextLow - init_mem;
+
+    if (c->cache)
+        UpdateFunctionCache(c);
+
     if (debug) {
         DumpFunctions(c->g);
         DumpSymbols(&c->globals, "Globals");
         DumpStrings(c);
     }
+
+    return VMTRUE;
+}
+
+// MarkFunction - mark a function as used along with the functions it references
+//                the functions it calls are added to the used functions before it, except for the ones of a recursion cycle
+static void MarkFunction(ParseContext_t *c, ParseTreeNode_t *function) {
+    NodeListEntry_t *entry;
+
+    if (function->u.functionDefinition.used)
+        return;
+    function->u.functionDefinition.used = VMTRUE;
+    MarkNodeList(c, function->u.functionDefinition.bodyStatements);
+
+    if (function == c->mainFunction)
+        return;
+    if (!(entry = (NodeListEntry_t*) system_arena_allocate(c->sys, sizeof(NodeListEntry_t))))
+        vm_system_abort(c->sys, "insufficient memory");
+    entry->node = function;
+    entry->next = NULL;
+    *c->pNextUsed = entry;
+    c->pNextUsed = &entry->next;
+    function->u.functionDefinition.order = c->usedCnt++;
+}
+
+// MarkNode - mark the functions referenced by a parse tree node
+static void MarkNode(ParseContext_t *c, ParseTreeNode_t *node) {
+    ParseTreeNode_t *function;
+
+    if (node == NULL)
+        return;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            MarkNode(c, node->u.letStatement.lvalue);
+            MarkNode(c, node->u.letStatement.rvalue);
+            break;
+        case NodeTypeIfStatement:
+            MarkNode(c, node->u.ifStatement.test);
+            MarkNodeList(c, node->u.ifStatement.thenStatements);
+            MarkNodeList(c, node->u.ifStatement.elseStatements);
+            break;
+        case NodeTypeForStatement:
+            MarkNode(c, node->u.forStatement.var);
+            MarkNode(c, node->u.forStatement.startExpr);
+            MarkNode(c, node->u.forStatement.endExpr);
+            MarkNode(c, node->u.forStatement.stepExpr);
+            MarkNodeList(c, node->u.forStatement.bodyStatements);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            MarkNode(c, node->u.loopStatement.test);
+            MarkNodeList(c, node->u.loopStatement.bodyStatements);
+            break;
+        case NodeTypeReturnStatement:
+            MarkNode(c, node->u.returnStatement.expr);
+            break;
+        case NodeTypeCallStatement:
+            MarkNode(c, node->u.callStatement.expr);
+            break;
+        case NodeTypeGlobalRef:
+            if (node->u.symbolRef.symbol->storageClass == SC_FUNCTION
+                    && (function = FindFunction(c, node->u.symbolRef.symbol)) != NULL)
+                MarkFunction(c, function);
+            break;
+        case NodeTypeUnaryOp:
+            MarkNode(c, node->u.unaryOp.expr);
+            break;
+        case NodeTypeBinaryOp:
+            MarkNode(c, node->u.binaryOp.left);
+            MarkNode(c, node->u.binaryOp.right);
+            break;
+        case NodeTypeArrayRef:
+            MarkNode(c, node->u.arrayRef.array);
+            MarkNode(c, node->u.arrayRef.index);
+            break;
+        case NodeTypeFunctionCall:
+            MarkNode(c, node->u.functionCall.fcn);
+            MarkNodeList(c, node->u.functionCall.args);
+            break;
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            MarkNodeList(c, node->u.exprList.exprs);
+            break;
+        default:
+            break;
+    }
+}
+
+// MarkNodeList - mark the functions referenced by a list of parse tree nodes
+static void MarkNodeList(ParseContext_t *c, NodeListEntry_t *list) {
+    for (; list != NULL; list = list->next)
+        MarkNode(c, list->node);
 }
 
 // PushFile - push a file onto the input file stack
@@ -93,7 +271,8 @@ int PushFile(ParseContext_t *c, const char *name) {
     vm_context_t *sys = c->sys;
     IncludedFile_t *inc;
     ParseFile_t *f;
-    void *fp;
+    SourceMap_t map;
+    void *fp = NULL;
     
     // check to see if the file has already been included
     for (inc = c->includedFiles; inc != NULL; inc = inc->next)
@@ -101,22 +280,31 @@ int PushFile(ParseContext_t *c, const char *name) {
             return VMTRUE;
     
     // add this file to the list of already included files
-    if (!(inc = (IncludedFile_t*) system_allocate_high_memory(sys, sizeof(IncludedFile_t) + strlen(name))))
+    if (!(inc = (IncludedFile_t*) system_arena_allocate(sys, sizeof(IncludedFile_t) + strlen(name))))
         vm_system_abort(sys, "insufficient memory");
     strcpy(inc->name, name);
+    inc->hashed = false;
     inc->next = c->includedFiles;
     c->includedFiles = inc;
 
-    // open the input file
-    if (!(fp = system_fs_open(sys, name, "r")))
+    // map the input file, or open it when it can't be mapped
+    if (!system_fs_map(name, &map) && !(fp = system_fs_open(sys, name, "r")))
         return VMFALSE;
+
+    // a stored image is checked against the contents compiled now, not the ones found when it is stored
+    if (!fp) {
+        inc->hash = map.base ? HashSource(SOURCE_HASH_INIT, map.base, map.end - map.base) : SOURCE_HASH_INIT;
+        inc->hashed = true;
+    }
     
     // allocate a parse file structure
-    if (!(f = (ParseFile_t*) system_allocate_high_memory(sys, sizeof(ParseFile_t))))
+    if (!(f = (ParseFile_t*) system_arena_allocate(sys, sizeof(ParseFile_t))))
         vm_system_abort(sys, "insufficient memory");
     
     // initialize the parse file structure
     f->fp = fp;
+    if (!fp)
+        f->map = map;
     f->file = inc;
     f->lineNumber = 0;
     
@@ -132,7 +320,7 @@ int PushFile(ParseContext_t *c, const char *name) {
 int ParseGetLine(ParseContext_t *c) {
     System_line_t *sys = c->sys_line;
     ParseFile_t *f;
-    int len;
+    int size;
 
     // get the next input line
     for (;;) {
@@ -147,23 +335,35 @@ int ParseGetLine(ParseContext_t *c) {
 
         // get a line from the current include file
         else {
-            if (system_fs_getline(sys->lineBuf, sizeof(sys->lineBuf) - 1, f->fp)) {
+            if (f->fp ? system_fs_get_line(sys, f->fp) : system_map_get_line(sys, &f->map)) {
                 c->lineNumber = ++f->lineNumber;
-                sys->linePtr = sys->lineBuf;
                 break;
             }
             else {
                 c->currentFile = f->next;
-                system_fs_close(f->fp);
+                if (f->fp)
+                    system_fs_close(f->fp);
+                else
+                    system_fs_unmap(&f->map);
             }
         }
     }
     
-    // make sure the line is correctly terminated
-    len = strlen(sys->lineBuf);
-    if (len == 0 || sys->lineBuf[len - 1] != '\n') {
-        sys->lineBuf[len++] = '\n';
-        sys->lineBuf[len] = '\0';
+    // the lines of a function decide whether its code can be kept from the previous compile
+    if (c->currentFunction != c->mainFunction)
+        c->currentFunction->u.functionDefinition.source = HashSource(c->currentFunction->u.functionDefinition.source, sys->line, sys->lineLen);
+
+    // a token is never longer than the line it comes from
+    if (c->tokenMax <= sys->lineLen) {
+        char *token;
+        size = sys->lineLen < MAXLINE ? MAXLINE : sys->lineLen * 2;
+        token = (char*) system_arena_allocate(c->sys, size);
+        if (c->token)
+            strcpy(token, c->token);
+        else
+            token[0] = '\0';
+        c->token = token;
+        c->tokenMax = size;
     }
 
     // return successfully
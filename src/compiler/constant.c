@@ -0,0 +1,320 @@
+/*
+ * @constant.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+
+// what is known about a global variable
+typedef struct {
+    Symbol_t *symbol;
+         int stores; // assignments in the functions that are generated
+         int known;  // every read sees value
+     VMVALUE value;
+} GlobalInfo_t;
+
+// the global variables of the program
+typedef struct {
+    GlobalInfo_t *info;
+             int cnt;
+} GlobalTable_t;
+
+// local function prototypes
+static int CompareInfo(const void *a, const void *b);
+static GlobalInfo_t* FindInfo(GlobalTable_t *t, Symbol_t *symbol);
+static void CountNode(GlobalTable_t *t, ParseTreeNode_t *node);
+static void CountNodeList(GlobalTable_t *t, NodeListEntry_t *list);
+static void ReplaceNode(ParseContext_t *c, GlobalTable_t *t, ParseTreeNode_t *node);
+static void ReplaceNodeList(ParseContext_t *c, GlobalTable_t *t, NodeListEntry_t *list);
+static GlobalInfo_t* ConstantStore(GlobalTable_t *t, ParseTreeNode_t *node);
+
+// InitGlobals - store the literals main starts by assigning to global variables in their cells
+//               a function the host calls before main sees the same values at every optimization level
+void InitGlobals(ParseContext_t *c) {
+    NodeListEntry_t *first = c->mainFunction->u.functionDefinition.bodyStatements, *entry, *prev;
+
+    for (entry = first; entry != NULL; entry = entry->next) {
+        ParseTreeNode_t *node = entry->node;
+        Symbol_t *symbol;
+        VMVALUE value;
+
+        if (node->nodeType != NodeTypeLetStatement
+                || node->u.letStatement.lvalue->nodeType != NodeTypeGlobalRef
+                || node->u.letStatement.rvalue->nodeType != NodeTypeIntegerLit
+                || (symbol = node->u.letStatement.lvalue->u.symbolRef.symbol)->storageClass != SC_VARIABLE)
+            break;
+
+        // a second store is a later state of the variable, the image keeps the first one
+        for (prev = first; prev != entry && prev->node->u.letStatement.lvalue->u.symbolRef.symbol != symbol; prev = prev->next)
+            ;
+        if (prev != entry)
+            break;
+
+        // an implicit variable gets its cell now instead of after main
+        value = node->u.letStatement.rvalue->u.integerLit.value;
+        if (symbol->placed)
+            memcpy(c->g->codeBuf + symbol->value, &value, sizeof(VMVALUE));
+        else
+            PlaceSymbol(c->g, symbol, StoreVector(c->g, &value, 1));
+    }
+}
+
+// ConstantGlobals - replace the reads of global variables that never change by their values
+void ConstantGlobals(ParseContext_t *c) {
+    NodeListEntry_t *entry, **pEntry;
+    GlobalTable_t t;
+    GlobalInfo_t *info;
+    Symbol_t *symbol;
+    int i;
+
+    // collect the global variables
+    t.cnt = 0;
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next)
+        if (symbol->storageClass == SC_VARIABLE)
+            ++t.cnt;
+    if (t.cnt == 0 || !(t.info = (GlobalInfo_t*) calloc(t.cnt, sizeof(GlobalInfo_t))))
+        return;
+    for (i = 0, symbol = c->globals.head; symbol != NULL; symbol = symbol->next)
+        if (symbol->storageClass == SC_VARIABLE)
+            t.info[i++].symbol = symbol;
+    qsort(t.info, t.cnt, sizeof(GlobalInfo_t), CompareInfo);
+
+    // count the assignments in main and in the functions that are generated, inline assembly can't name a variable
+    CountNodeList(&t, c->mainFunction->u.functionDefinition.bodyStatements);
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (entry->node->u.functionDefinition.used)
+            CountNodeList(&t, entry->node->u.functionDefinition.bodyStatements);
+
+    // a variable that is never assigned keeps its DIM initializer, or zero
+    for (i = 0; i < t.cnt; ++i) {
+        if (t.info[i].stores == 0) {
+            t.info[i].known = VMTRUE;
+            if (t.info[i].symbol->placed)
+                memcpy(&t.info[i].value, c->g->codeBuf + t.info[i].symbol->value, sizeof(VMVALUE));
+        }
+    }
+
+    // a variable assigned once by the constant assignments that start main never reads another value
+    for (entry = c->mainFunction->u.functionDefinition.bodyStatements; entry != NULL; entry = entry->next) {
+        ParseTreeNode_t *node = entry->node;
+        if ((info = ConstantStore(&t, node)) == NULL)
+            break;
+        if (info->stores == 1) {
+            info->known = VMTRUE;
+            info->value = node->u.letStatement.rvalue->u.integerLit.value;
+        }
+    }
+
+    // those assignments are dead once the reads are replaced
+    pEntry = &c->mainFunction->u.functionDefinition.bodyStatements;
+    while ((entry = *pEntry) != NULL && (info = ConstantStore(&t, entry->node)) != NULL) {
+        if (info->known)
+            *pEntry = entry->next;
+        else
+            pEntry = &entry->next;
+    }
+
+    // the code kept for a function is only valid for the same known values
+    c->knownGlobals = SOURCE_HASH_INIT;
+    for (i = 0; i < t.cnt; ++i) {
+        if (t.info[i].known) {
+            c->knownGlobals = HashSource(c->knownGlobals, t.info[i].symbol->name, strlen(t.info[i].symbol->name) + 1);
+            c->knownGlobals = HashSource(c->knownGlobals, &t.info[i].value, sizeof(VMVALUE));
+        }
+    }
+
+    ReplaceNodeList(c, &t, c->mainFunction->u.functionDefinition.bodyStatements);
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (entry->node->u.functionDefinition.used)
+            ReplaceNodeList(c, &t, entry->node->u.functionDefinition.bodyStatements);
+
+    free(t.info);
+}
+
+// CompareInfo - order the global variables by the address of their symbols
+static int CompareInfo(const void *a, const void *b) {
+    uintptr_t sa = (uintptr_t) ((const GlobalInfo_t*) a)->symbol, sb = (uintptr_t) ((const GlobalInfo_t*) b)->symbol;
+    return sa < sb ? -1 : sa > sb;
+}
+
+// FindInfo - find what is known about a global variable, NULL for other symbols
+static GlobalInfo_t* FindInfo(GlobalTable_t *t, Symbol_t *symbol) {
+    GlobalInfo_t key;
+    key.symbol = symbol;
+    return (GlobalInfo_t*) bsearch(&key, t->info, t->cnt, sizeof(GlobalInfo_t), CompareInfo);
+}
+
+// ConstantStore - get the variable of an assignment of a literal to a global variable, NULL for other statements
+static GlobalInfo_t* ConstantStore(GlobalTable_t *t, ParseTreeNode_t *node) {
+    if (node->nodeType != NodeTypeLetStatement
+            || node->u.letStatement.lvalue->nodeType != NodeTypeGlobalRef
+            || node->u.letStatement.rvalue->nodeType != NodeTypeIntegerLit)
+        return NULL;
+    return FindInfo(t, node->u.letStatement.lvalue->u.symbolRef.symbol);
+}
+
+// CountNode - count the assignments to global variables in a parse tree node
+static void CountNode(GlobalTable_t *t, ParseTreeNode_t *node) {
+    GlobalInfo_t *info;
+
+    if (node == NULL)
+        return;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            if (node->u.letStatement.lvalue->nodeType == NodeTypeGlobalRef) {
+                if ((info = FindInfo(t, node->u.letStatement.lvalue->u.symbolRef.symbol)) != NULL)
+                    ++info->stores;
+            } else
+                CountNode(t, node->u.letStatement.lvalue);
+            CountNode(t, node->u.letStatement.rvalue);
+            break;
+        case NodeTypeIfStatement:
+            CountNode(t, node->u.ifStatement.test);
+            CountNodeList(t, node->u.ifStatement.thenStatements);
+            CountNodeList(t, node->u.ifStatement.elseStatements);
+            break;
+        case NodeTypeForStatement:
+            // the counter is assigned on every iteration
+            if (node->u.forStatement.var->nodeType == NodeTypeGlobalRef
+                    && (info = FindInfo(t, node->u.forStatement.var->u.symbolRef.symbol)) != NULL)
+                info->stores += 2;
+            CountNode(t, node->u.forStatement.startExpr);
+            CountNode(t, node->u.forStatement.endExpr);
+            CountNode(t, node->u.forStatement.stepExpr);
+            CountNodeList(t, node->u.forStatement.bodyStatements);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            CountNode(t, node->u.loopStatement.test);
+            CountNodeList(t, node->u.loopStatement.bodyStatements);
+            break;
+        case NodeTypeReturnStatement:
+            CountNode(t, node->u.returnStatement.expr);
+            break;
+        case NodeTypeCallStatement:
+            CountNode(t, node->u.callStatement.expr);
+            break;
+        case NodeTypeUnaryOp:
+            CountNode(t, node->u.unaryOp.expr);
+            break;
+        case NodeTypeBinaryOp:
+            CountNode(t, node->u.binaryOp.left);
+            CountNode(t, node->u.binaryOp.right);
+            break;
+        case NodeTypeArrayRef:
+            CountNode(t, node->u.arrayRef.array);
+            CountNode(t, node->u.arrayRef.index);
+            break;
+        case NodeTypeFunctionCall:
+            CountNode(t, node->u.functionCall.fcn);
+            CountNodeList(t, node->u.functionCall.args);
+            break;
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            CountNodeList(t, node->u.exprList.exprs);
+            break;
+        default:
+            break;
+    }
+}
+
+// CountNodeList - count the assignments to global variables in a list of parse tree nodes
+static void CountNodeList(GlobalTable_t *t, NodeListEntry_t *list) {
+    for (; list != NULL; list = list->next)
+        CountNode(t, list->node);
+}
+
+// ReplaceNode - turn the reads of known global variables in a parse tree node into literals
+static void ReplaceNode(ParseContext_t *c, GlobalTable_t *t, ParseTreeNode_t *node) {
+    GlobalInfo_t *info;
+
+    if (node == NULL)
+        return;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            if (node->u.letStatement.lvalue->nodeType != NodeTypeGlobalRef)
+                ReplaceNode(c, t, node->u.letStatement.lvalue);
+            ReplaceNode(c, t, node->u.letStatement.rvalue);
+            break;
+        case NodeTypeIfStatement:
+            ReplaceNode(c, t, node->u.ifStatement.test);
+            ReplaceNodeList(c, t, node->u.ifStatement.thenStatements);
+            ReplaceNodeList(c, t, node->u.ifStatement.elseStatements);
+            break;
+        case NodeTypeForStatement:
+            ReplaceNode(c, t, node->u.forStatement.startExpr);
+            ReplaceNode(c, t, node->u.forStatement.endExpr);
+            ReplaceNode(c, t, node->u.forStatement.stepExpr);
+            ReplaceNodeList(c, t, node->u.forStatement.bodyStatements);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            ReplaceNode(c, t, node->u.loopStatement.test);
+            ReplaceNodeList(c, t, node->u.loopStatement.bodyStatements);
+            break;
+        case NodeTypeReturnStatement:
+            ReplaceNode(c, t, node->u.returnStatement.expr);
+            break;
+        case NodeTypeCallStatement:
+            ReplaceNode(c, t, node->u.callStatement.expr);
+            break;
+        case NodeTypeGlobalRef:
+            if ((info = FindInfo(t, node->u.symbolRef.symbol)) != NULL && info->known) {
+                node->nodeType = NodeTypeIntegerLit;
+                node->type = &c->integerType;
+                node->u.integerLit.value = info->value;
+            }
+            break;
+        case NodeTypeUnaryOp:
+            ReplaceNode(c, t, node->u.unaryOp.expr);
+            break;
+        case NodeTypeBinaryOp:
+            ReplaceNode(c, t, node->u.binaryOp.left);
+            ReplaceNode(c, t, node->u.binaryOp.right);
+            break;
+        case NodeTypeArrayRef:
+            ReplaceNode(c, t, node->u.arrayRef.array);
+            ReplaceNode(c, t, node->u.arrayRef.index);
+            break;
+        case NodeTypeFunctionCall:
+            ReplaceNode(c, t, node->u.functionCall.fcn);
+            ReplaceNodeList(c, t, node->u.functionCall.args);
+            break;
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            ReplaceNodeList(c, t, node->u.exprList.exprs);
+            break;
+        default:
+            break;
+    }
+}
+
+// ReplaceNodeList - turn the reads of known global variables in a list of parse tree nodes into literals
+static void ReplaceNodeList(ParseContext_t *c, GlobalTable_t *t, NodeListEntry_t *list) {
+    for (; list != NULL; list = list->next)
+        ReplaceNode(c, t, list->node);
+}
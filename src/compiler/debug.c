@@ -31,6 +31,8 @@ static char *storageClassNames[] = {
 static char *typeNames[] = {
         "unknown",
         "integer",
+        "uinteger",
+        "float",
         "byte",
         "string",
         "array",
@@ -0,0 +1,316 @@
+/*
+ * @evaluate.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+#define EVAL_MAXSTEPS 100000 // statements and calls one evaluation may run
+#define EVAL_MAXDEPTH 32     // nested calls one evaluation may make
+
+// result of running a statement
+typedef enum {
+    EVAL_NEXT,   // go on with the next statement
+    EVAL_RETURN, // the function returned
+    EVAL_FAIL    // the statement can't run at compile time
+} EvalStatus_t;
+
+// state of an evaluation
+typedef struct {
+    ParseContext_t *c;
+               int steps;
+               int depth;
+} Eval_t;
+
+// frame of a function being evaluated
+typedef struct {
+    VMVALUE *args;
+    VMVALUE *locals;
+    VMVALUE result;
+} EvalFrame_t;
+
+// local function prototypes
+static void FoldNode(ParseContext_t *c, ParseTreeNode_t *node);
+static void FoldNodeList(ParseContext_t *c, NodeListEntry_t *list);
+static int EvalCall(Eval_t *e, EvalFrame_t *caller, ParseTreeNode_t *call, VMVALUE *pValue);
+static EvalStatus_t EvalStatementList(Eval_t *e, EvalFrame_t *fr, NodeListEntry_t *list);
+static EvalStatus_t EvalStatement(Eval_t *e, EvalFrame_t *fr, ParseTreeNode_t *node);
+static int EvalExpr(Eval_t *e, EvalFrame_t *fr, ParseTreeNode_t *expr, VMVALUE *pValue);
+static VMVALUE* EvalVariable(EvalFrame_t *fr, ParseTreeNode_t *node);
+
+// EvaluateCalls - replace the calls with literal arguments to functions without side effects by their results
+void EvaluateCalls(ParseContext_t *c) {
+    NodeListEntry_t *entry;
+
+    FoldNodeList(c, c->mainFunction->u.functionDefinition.bodyStatements);
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (entry->node->u.functionDefinition.used)
+            FoldNodeList(c, entry->node->u.functionDefinition.bodyStatements);
+}
+
+// FoldNode - evaluate the calls in a parse tree node, the arguments first
+static void FoldNode(ParseContext_t *c, ParseTreeNode_t *node) {
+    NodeListEntry_t *arg;
+    VMVALUE value;
+    Eval_t e;
+
+    if (node == NULL)
+        return;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            FoldNode(c, node->u.letStatement.lvalue);
+            FoldNode(c, node->u.letStatement.rvalue);
+            break;
+        case NodeTypeIfStatement:
+            FoldNode(c, node->u.ifStatement.test);
+            FoldNodeList(c, node->u.ifStatement.thenStatements);
+            FoldNodeList(c, node->u.ifStatement.elseStatements);
+            break;
+        case NodeTypeForStatement:
+            FoldNode(c, node->u.forStatement.startExpr);
+            FoldNode(c, node->u.forStatement.endExpr);
+            FoldNode(c, node->u.forStatement.stepExpr);
+            FoldNodeList(c, node->u.forStatement.bodyStatements);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            FoldNode(c, node->u.loopStatement.test);
+            FoldNodeList(c, node->u.loopStatement.bodyStatements);
+            break;
+        case NodeTypeReturnStatement:
+            FoldNode(c, node->u.returnStatement.expr);
+            break;
+        case NodeTypeCallStatement:
+            FoldNode(c, node->u.callStatement.expr);
+            break;
+        case NodeTypeUnaryOp:
+            FoldNode(c, node->u.unaryOp.expr);
+            break;
+        case NodeTypeBinaryOp:
+            FoldNode(c, node->u.binaryOp.left);
+            FoldNode(c, node->u.binaryOp.right);
+            break;
+        case NodeTypeArrayRef:
+            FoldNode(c, node->u.arrayRef.array);
+            FoldNode(c, node->u.arrayRef.index);
+            break;
+        case NodeTypeFunctionCall:
+            FoldNodeList(c, node->u.functionCall.args);
+            for (arg = node->u.functionCall.args; arg != NULL; arg = arg->next)
+                if (arg->node->nodeType != NodeTypeIntegerLit)
+                    return;
+            e.c = c;
+            e.steps = 0;
+            e.depth = 0;
+            if (EvalCall(&e, NULL, node, &value)) {
+                node->nodeType = NodeTypeIntegerLit;
+                node->type = &c->integerType;
+                node->u.integerLit.value = value;
+            }
+            break;
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            FoldNodeList(c, node->u.exprList.exprs);
+            break;
+        default:
+            break;
+    }
+}
+
+// FoldNodeList - evaluate the calls in a list of parse tree nodes
+static void FoldNodeList(ParseContext_t *c, NodeListEntry_t *list) {
+    for (; list != NULL; list = list->next)
+        FoldNode(c, list->node);
+}
+
+// EvalCall - run a call to a BASIC function, false if it would need the running program
+static int EvalCall(Eval_t *e, EvalFrame_t *caller, ParseTreeNode_t *call, VMVALUE *pValue) {
+    ParseTreeNode_t *fcn = call->u.functionCall.fcn, *function;
+    NodeListEntry_t *arg;
+    EvalFrame_t fr;
+    int k, ok = VMFALSE;
+
+    if (fcn->nodeType != NodeTypeGlobalRef || fcn->u.symbolRef.symbol->storageClass != SC_FUNCTION
+            || !(function = FindFunction(e->c, fcn->u.symbolRef.symbol))
+            || function->u.functionDefinition.argumentOffset != call->u.functionCall.argc
+            || ++e->depth > EVAL_MAXDEPTH)
+        return VMFALSE;
+
+    fr.args = (VMVALUE*) calloc(call->u.functionCall.argc + 1, sizeof(VMVALUE));
+    fr.locals = (VMVALUE*) calloc(function->u.functionDefinition.localOffset + 1, sizeof(VMVALUE));
+    fr.result = 0;
+
+    // the argument list is in push order, the last argument comes first
+    for (arg = call->u.functionCall.args, k = call->u.functionCall.argc; arg != NULL; arg = arg->next)
+        if (!EvalExpr(e, caller, arg->node, &fr.args[--k]))
+            break;
+
+    if (arg == NULL && EvalStatementList(e, &fr, function->u.functionDefinition.bodyStatements) != EVAL_FAIL) {
+        *pValue = fr.result;
+        ok = VMTRUE;
+    }
+
+    free(fr.locals);
+    free(fr.args);
+    --e->depth;
+    return ok;
+}
+
+// EvalStatementList - run a list of statements
+static EvalStatus_t EvalStatementList(Eval_t *e, EvalFrame_t *fr, NodeListEntry_t *list) {
+    EvalStatus_t status;
+
+    for (; list != NULL; list = list->next)
+        if ((status = EvalStatement(e, fr, list->node)) != EVAL_NEXT)
+            return status;
+
+    return EVAL_NEXT;
+}
+
+// EvalStatement - run a statement the way the generated code does
+static EvalStatus_t EvalStatement(Eval_t *e, EvalFrame_t *fr, ParseTreeNode_t *node) {
+    VMVALUE value, limit, step, *var;
+    EvalStatus_t status;
+
+    if (++e->steps > EVAL_MAXSTEPS)
+        return EVAL_FAIL;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            if (!(var = EvalVariable(fr, node->u.letStatement.lvalue)) || !EvalExpr(e, fr, node->u.letStatement.rvalue, &value))
+                return EVAL_FAIL;
+            *var = value;
+            return EVAL_NEXT;
+        case NodeTypeIfStatement:
+            if (!EvalExpr(e, fr, node->u.ifStatement.test, &value))
+                return EVAL_FAIL;
+            return EvalStatementList(e, fr, value ? node->u.ifStatement.thenStatements : node->u.ifStatement.elseStatements);
+        case NodeTypeForStatement:
+            // the limit and the step are evaluated once
+            if (!(var = EvalVariable(fr, node->u.forStatement.var)) || !EvalExpr(e, fr, node->u.forStatement.startExpr, &value)
+                    || !EvalExpr(e, fr, node->u.forStatement.endExpr, &limit))
+                return EVAL_FAIL;
+            step = 1;
+            if (node->u.forStatement.stepExpr && !EvalExpr(e, fr, node->u.forStatement.stepExpr, &step))
+                return EVAL_FAIL;
+            *var = value;
+            while (step < 0 ? *var >= limit : *var <= limit) {
+                if ((status = EvalStatementList(e, fr, node->u.forStatement.bodyStatements)) != EVAL_NEXT)
+                    return status;
+                if (++e->steps > EVAL_MAXSTEPS)
+                    return EVAL_FAIL;
+                *var = (VMVALUE) ((VMUVALUE) *var + (VMUVALUE) step);
+            }
+            return EVAL_NEXT;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            for (;;) {
+                // DO WHILE and DO UNTIL test before the body, LOOP WHILE and LOOP UNTIL after it
+                if (node->nodeType == NodeTypeDoWhileStatement || node->nodeType == NodeTypeDoUntilStatement) {
+                    if (!EvalExpr(e, fr, node->u.loopStatement.test, &value))
+                        return EVAL_FAIL;
+                    if ((value != 0) != (node->nodeType == NodeTypeDoWhileStatement))
+                        return EVAL_NEXT;
+                }
+                if ((status = EvalStatementList(e, fr, node->u.loopStatement.bodyStatements)) != EVAL_NEXT)
+                    return status;
+                if (++e->steps > EVAL_MAXSTEPS)
+                    return EVAL_FAIL;
+                if (node->nodeType == NodeTypeLoopWhileStatement || node->nodeType == NodeTypeLoopUntilStatement) {
+                    if (!EvalExpr(e, fr, node->u.loopStatement.test, &value))
+                        return EVAL_FAIL;
+                    if ((value != 0) != (node->nodeType == NodeTypeLoopWhileStatement))
+                        return EVAL_NEXT;
+                }
+            }
+        case NodeTypeReturnStatement:
+            fr->result = 0;
+            if (node->u.returnStatement.expr && !EvalExpr(e, fr, node->u.returnStatement.expr, &fr->result))
+                return EVAL_FAIL;
+            return EVAL_RETURN;
+        case NodeTypeCallStatement:
+            return EvalExpr(e, fr, node->u.callStatement.expr, &value) ? EVAL_NEXT : EVAL_FAIL;
+        case NodeTypeEndStatement:
+            // the generated code does nothing for END either
+            return EVAL_NEXT;
+        default:
+            // stores to globals and arrays and inline assembly need the running program
+            return EVAL_FAIL;
+    }
+}
+
+// EvalExpr - compute the value of an expression, false if it reads anything but arguments and locals
+static int EvalExpr(Eval_t *e, EvalFrame_t *fr, ParseTreeNode_t *expr, VMVALUE *pValue) {
+    NodeListEntry_t *entry;
+    VMVALUE left, right, *var;
+
+    switch (expr->nodeType) {
+        case NodeTypeIntegerLit:
+            *pValue = expr->u.integerLit.value;
+            return VMTRUE;
+        case NodeTypeArgumentRef:
+        case NodeTypeLocalRef:
+            if (!(var = EvalVariable(fr, expr)))
+                return VMFALSE;
+            *pValue = *var;
+            return VMTRUE;
+        case NodeTypeUnaryOp:
+            return EvalExpr(e, fr, expr->u.unaryOp.expr, &left) && mir_fold(expr->u.unaryOp.op, left, 0, pValue);
+        case NodeTypeBinaryOp:
+            return EvalExpr(e, fr, expr->u.binaryOp.left, &left) && EvalExpr(e, fr, expr->u.binaryOp.right, &right)
+                    && mir_fold(expr->u.binaryOp.op, left, right, pValue);
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            // the value that decides the result is the result
+            for (entry = expr->u.exprList.exprs; entry != NULL; entry = entry->next) {
+                if (!EvalExpr(e, fr, entry->node, pValue))
+                    return VMFALSE;
+                if ((*pValue != 0) == (expr->nodeType == NodeTypeDisjunction))
+                    break;
+            }
+            return VMTRUE;
+        case NodeTypeFunctionCall:
+            return EvalCall(e, fr, expr, pValue);
+        default:
+            // globals, arrays and strings are only known to the running program
+            return VMFALSE;
+    }
+}
+
+// EvalVariable - get the storage of an argument or a local, NULL for anything else
+static VMVALUE* EvalVariable(EvalFrame_t *fr, ParseTreeNode_t *node) {
+    if (fr == NULL)
+        return NULL;
+    switch (node->nodeType) {
+        case NodeTypeArgumentRef:
+            return &fr->args[node->u.symbolRef.symbol->value];
+        case NodeTypeLocalRef:
+            return &fr->locals[node->u.symbolRef.symbol->value];
+        default:
+            return NULL;
+    }
+}
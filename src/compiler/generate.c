@@ -16,13 +16,14 @@
  * @see https://github.com/hiperiondev/basic_lang
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include "compile.h"
+#include "mir.h"
 #include "vmdebug.h"
 
-bool lastReturn = false;
 
 // partial value
 typedef struct PVAL_s PVAL_t;
@@ -47,13 +48,16 @@ struct PVAL_s {
     } u;
 };
 
-functions_t generate_functions[100];
+functions_t *generate_functions = NULL;
 int generate_functionCount = 0;
+int generate_functionMax = 0;
 
 // local function prototypes
 static void code_lvalue(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv);
 static void code_rvalue(GenerateContext_t *c, ParseTreeNode_t *expr);
 static void code_function_definition(GenerateContext_t *c, ParseTreeNode_t *node);
+static bool code_mir_function(GenerateContext_t *c, ParseTreeNode_t *node);
+static int EndsWithReturn(NodeListEntry_t *entry);
 static void code_if_statement(GenerateContext_t *c, ParseTreeNode_t *node);
 static void code_for_statement(GenerateContext_t *c, ParseTreeNode_t *node);
 static void code_do_while_statement(GenerateContext_t *c, ParseTreeNode_t *node);
@@ -66,7 +70,6 @@ static void code_asm_statement(GenerateContext_t *c, ParseTreeNode_t *node);
 static void code_statement_list(GenerateContext_t *c, NodeListEntry_t *entry);
 static void code_shortcircuit(GenerateContext_t *c, int op, ParseTreeNode_t *expr);
 static void code_call(GenerateContext_t *c, ParseTreeNode_t *expr);
-static void code_symbolRef(GenerateContext_t *c, Symbol_t *sym);
 static void code_arrayref(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv);
 static void code_index(GenerateContext_t *c, PValOp_t fcn, PVAL_t *pv);
 static void code_expr(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv);
@@ -75,20 +78,29 @@ static void code_local(GenerateContext_t *c, PValOp_t fcn, PVAL_t *pv);
 static VMVALUE rd_cword(GenerateContext_t *c, VMUVALUE off);
 static void wr_cword(GenerateContext_t *c, VMUVALUE off, VMVALUE w);
 static void fixup(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val);
-static void fixupbranch(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val);
 static VMVALUE AddSymbolRef(GenerateContext_t *c, Symbol_t *sym, VMUVALUE offset);
-static VMVALUE AddStringRef(GenerateContext_t *c, String_t *str);
+static void AddCodeRef(GenerateContext_t *c, VMVALUE offset, Symbol_t *sym, String_t *str);
+static void AddFunction(GenerateContext_t *c, ParseTreeNode_t *node, VMVALUE code, size_t codeSize);
+static void GrowCode(GenerateContext_t *c, size_t size);
 static void GenerateError(GenerateContext_t *c, const char *fmt, ...);
 static void GenerateFatal(GenerateContext_t *c, const char *fmt, ...);
 
 // InitGenerateContext - initialize a generate context
 GenerateContext_t* InitGenerateContext(vm_context_t *sys) {
     GenerateContext_t *g;
-    if (!(g = (GenerateContext_t*) system_allocate_high_memory(sys, sizeof(GenerateContext_t))))
+    if (!(g = (GenerateContext_t*) system_arena_allocate(sys, sizeof(GenerateContext_t))))
         return NULL;
+    memset(g, 0, sizeof(GenerateContext_t));
     g->sys = sys;
     g->codeBuf = sys->nextLow;
+    g->optLevel = MIR_LEVEL_DEFAULT;
+    g->isa = VM_ISA_STACK;
+    g->debug = false;
+    g->threads = 1;
+    generate_functions = NULL;
     generate_functionCount = 0;
+    generate_functionMax = 0;
+    mir_inline_reset();
     return g;
 }
 
@@ -168,11 +180,11 @@ static void code_expr(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv) {
             break;
         case NodeTypeLocalRef:
             pv->fcn = code_local;
-            pv->u.val = -1 - expr->u.symbolRef.symbol->value;
+            pv->u.val = -F_SIZE - 1 - expr->u.symbolRef.symbol->value;
             break;
         case NodeTypeStringLit:
             putcbyte(c, OP_LIT);
-            putcword(c, AddStringRef(c, expr->u.stringLit.string));
+            code_stringWord(c, expr->u.stringLit.string);
             pv->fcn = GEN_NULL;
             break;
         case NodeTypeIntegerLit:
@@ -221,29 +233,104 @@ static void code_expr(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv) {
 
 // code_function_definition - generate code for a function definition
 static void code_function_definition(GenerateContext_t *c, ParseTreeNode_t *node) {
-    vm_context_t *sys = c->sys;
-    uint8_t *base = sys->nextLow;
-    size_t codeSize;
     VMVALUE code = codeaddr(c);
-    putcbyte(c, OP_FRAME);
-    putcbyte(c, F_SIZE + node->u.functionDefinition.localOffset);
-    code_statement_list(c, node->u.functionDefinition.bodyStatements);
-
-    if (node->u.functionDefinition.symbol) {
-        if (!lastReturn)
-            putcbyte(c, OP_RETURNZ);
-    } else
-        putcbyte(c, OP_HALT);
 
-    codeSize = sys->nextLow - base;
+    // collect the addresses coded in this function
+    c->refCnt = 0;
+
+    // code the parse tree directly when not optimizing or when the function can't be lowered
+    if (!code_mir_function(c, node)) {
+        putcbyte(c, OP_FRAME);
+        putcbyte(c, F_SIZE + node->u.functionDefinition.localOffset);
+        code_statement_list(c, node->u.functionDefinition.bodyStatements);
+
+        if (node->u.functionDefinition.symbol) {
+            if (!EndsWithReturn(node->u.functionDefinition.bodyStatements))
+                putcbyte(c, OP_RETURNZ);
+        } else
+            putcbyte(c, OP_HALT);
+    }
+
+    // code in a private buffer is added when it is linked
+    if (!c->privateCode)
+        AddFunction(c, node, code, codeaddr(c) - code);
+}
+
+// GenerateCopy - store the code of a function generated by an earlier compile or in a private buffer and link the addresses it codes
+VMVALUE GenerateCopy(GenerateContext_t *c, ParseTreeNode_t *node, const uint8_t *code, size_t codeSize, const CodeRef_t *refs, int refCnt) {
+    vm_context_t *sys = c->sys;
+    VMVALUE addr = codeaddr(c);
+    int i;
+
+    if (sys->nextLow + codeSize > sys->nextHigh)
+        GrowCode(c, codeSize);
+    memcpy(sys->nextLow, code, codeSize);
+    sys->nextLow += codeSize;
+
+    // the offsets of the references are relative to the start of the function, they are collected again like generated code
+    c->refCnt = 0;
+    for (i = 0; i < refCnt; ++i) {
+        VMUVALUE offset = addr + refs[i].offset;
+        AddCodeRef(c, offset, refs[i].sym, refs[i].str);
+        if (refs[i].sym)
+            wr_cword(c, offset, AddSymbolRef(c, refs[i].sym, offset));
+        else
+            wr_cword(c, offset, (VMVALUE) ((uint8_t*) refs[i].str->data - c->codeBuf));
+    }
+
+    AddFunction(c, node, addr, codeSize);
+    return addr;
+}
+
+// AddFunction - add a function to the function table and place its symbol
+static void AddFunction(GenerateContext_t *c, ParseTreeNode_t *node, VMVALUE code, size_t codeSize) {
     if (node->u.functionDefinition.symbol)
         PlaceSymbol(c, node->u.functionDefinition.symbol, code);
+    if (generate_functionCount >= generate_functionMax) {
+        functions_t *functions;
+        generate_functionMax = generate_functionMax ? generate_functionMax * 2 : 16;
+        functions = (functions_t*) system_arena_allocate(c->sys, generate_functionMax * sizeof(functions_t));
+        if (generate_functionCount > 0)
+            memcpy(functions, generate_functions, generate_functionCount * sizeof(functions_t));
+        generate_functions = functions;
+    }
     generate_functions[generate_functionCount].symbol = node->u.functionDefinition.symbol;
     generate_functions[generate_functionCount].code = code;
     generate_functions[generate_functionCount].codeLen = codeSize;
+    generate_functions[generate_functionCount].argc = node->u.functionDefinition.argumentOffset;
     ++generate_functionCount;
 }
 
+// code_mir_function - generate code for a function through the mid-level ir
+static bool code_mir_function(GenerateContext_t *c, ParseTreeNode_t *node) {
+    MirFunction_t *f;
+    bool ok;
+
+    // the register instructions are only generated from the ir
+    if ((c->optLevel <= MIR_LEVEL_NONE && c->isa != VM_ISA_REGISTER) || !(f = mir_build(c, node)))
+        return false;
+
+    mir_optimize(f, c->optLevel);
+    if (c->debug)
+        mir_print(f);
+    ok = c->isa == VM_ISA_REGISTER ? mir_generate_reg(c, f) : mir_generate(c, f);
+
+    // small functions are kept for inlining into the ones defined after them
+    if (!mir_inline_register(f))
+        mir_free(f);
+
+    return ok;
+}
+
+// EndsWithReturn - check for a statement list that ends with a RETURN statement
+static int EndsWithReturn(NodeListEntry_t *entry) {
+    if (!entry)
+        return VMFALSE;
+    while (entry->next)
+        entry = entry->next;
+    return entry->node->nodeType == NodeTypeReturnStatement;
+}
+
 // code_if_statement - generate code for an IF statement
 static void code_if_statement(GenerateContext_t *c, ParseTreeNode_t *node) {
     VMUVALUE nxt, end;
@@ -258,19 +345,54 @@ static void code_if_statement(GenerateContext_t *c, ParseTreeNode_t *node) {
     fixupbranch(c, end, codeaddr(c));
 }
 
-// code_for_statement - generate code for a FOR statement
+// code_for_statement - generate code for a FOR statement, the limit and step are evaluated once
 static void code_for_statement(GenerateContext_t *c, ParseTreeNode_t *node) {
-    VMUVALUE nxt, upd, inst;
+    ParseTreeNode_t *step = node->u.forStatement.stepExpr;
+    VMVALUE limit = -F_SIZE - 1 - node->u.forStatement.limitOffset;
+    VMVALUE stepSlot = -F_SIZE - 1 - node->u.forStatement.stepOffset;
+    VMVALUE inc = step && node->u.forStatement.stepOffset < 0 ? step->u.integerLit.value : 1;
+    VMUVALUE nxt, upd, down, end, inst;
     PVAL_t pv;
     code_rvalue(c, node->u.forStatement.startExpr);
+    code_rvalue(c, node->u.forStatement.endExpr);
+    putcbyte(c, OP_LSET);
+    putcbyte(c, limit);
+    if (node->u.forStatement.stepOffset >= 0) {
+        code_rvalue(c, step);
+        putcbyte(c, OP_LSET);
+        putcbyte(c, stepSlot);
+    }
     code_lvalue(c, node->u.forStatement.var, &pv);
+
+    // a local with a short literal step is counted by FORNEXT, entered one step before the start
+    if (pv.fcn == code_local && node->u.forStatement.stepOffset < 0 && inc >= -128 && inc <= 127) {
+        putcbyte(c, OP_SLIT);
+        putcbyte(c, inc);
+        putcbyte(c, OP_SUB);
+        (*pv.fcn)(c, PV_STORE, &pv);
+        putcbyte(c, OP_BR);
+        upd = putcword(c, 0);
+        nxt = codeaddr(c);
+        code_statement_list(c, node->u.forStatement.bodyStatements);
+        fixupbranch(c, upd, codeaddr(c));
+        inst = putcbyte(c, OP_FORNEXT);
+        putcbyte(c, pv.u.val);
+        putcbyte(c, limit);
+        putcbyte(c, inc);
+        putcword(c, nxt - inst - 4 - sizeof(VMVALUE));
+        return;
+    }
+
     putcbyte(c, OP_BR);
     upd = putcword(c, 0);
     nxt = codeaddr(c);
     code_statement_list(c, node->u.forStatement.bodyStatements);
     (*pv.fcn)(c, PV_LOAD, &pv);
-    if (node->u.forStatement.stepExpr)
-        code_rvalue(c, node->u.forStatement.stepExpr);
+    if (node->u.forStatement.stepOffset >= 0) {
+        putcbyte(c, OP_LREF);
+        putcbyte(c, stepSlot);
+    } else if (step)
+        code_rvalue(c, step);
     else {
         putcbyte(c, OP_SLIT);
         putcbyte(c, 1);
@@ -279,10 +401,33 @@ static void code_for_statement(GenerateContext_t *c, ParseTreeNode_t *node) {
     fixupbranch(c, upd, codeaddr(c));
     putcbyte(c, OP_DUP);
     (*pv.fcn)(c, PV_STORE, &pv);
-    code_rvalue(c, node->u.forStatement.endExpr);
-    putcbyte(c, OP_LE);
-    inst = putcbyte(c, OP_BRT);
-    putcword(c, nxt - inst - 1 - sizeof(VMVALUE));
+    putcbyte(c, OP_LREF);
+    putcbyte(c, limit);
+
+    // the sign of a computed step picks the test at run time
+    if (node->u.forStatement.stepOffset >= 0) {
+        putcbyte(c, OP_LREF);
+        putcbyte(c, stepSlot);
+        putcbyte(c, OP_SLIT);
+        putcbyte(c, 0);
+        putcbyte(c, OP_LT);
+        putcbyte(c, OP_BRT);
+        down = putcword(c, 0);
+        putcbyte(c, OP_LE);
+        inst = putcbyte(c, OP_BRT);
+        putcword(c, nxt - inst - 1 - sizeof(VMVALUE));
+        putcbyte(c, OP_BR);
+        end = putcword(c, 0);
+        fixupbranch(c, down, codeaddr(c));
+        putcbyte(c, OP_GE);
+        inst = putcbyte(c, OP_BRT);
+        putcword(c, nxt - inst - 1 - sizeof(VMVALUE));
+        fixupbranch(c, end, codeaddr(c));
+    } else {
+        putcbyte(c, inc < 0 ? OP_GE : OP_LE);
+        inst = putcbyte(c, OP_BRT);
+        putcword(c, nxt - inst - 1 - sizeof(VMVALUE));
+    }
 }
 
 // code_do_while_statement - generate code for a DO WHILE statement
@@ -355,7 +500,7 @@ static void code_asm_statement(GenerateContext_t *c, ParseTreeNode_t *node) {
     vm_context_t *sys = c->sys;
     int length = node->u.asmStatement.length;
     if (sys->nextLow + length > sys->nextHigh)
-        GenerateFatal(c, "insufficient memory");
+        GrowCode(c, length);
     memcpy(sys->nextLow, node->u.asmStatement.code, length);
     sys->nextLow += length;
 }
@@ -397,28 +542,53 @@ static void code_call(GenerateContext_t *c, ParseTreeNode_t *expr) {
     // get the value of the function
     code_rvalue(c, expr->u.functionCall.fcn);
 
-    // call the function
+    // call the function and remove the arguments from under the result
     putcbyte(c, OP_CALL);
     if (expr->u.functionCall.argc > 0) {
-        if (expr->u.functionCall.argc > 1) {
-            putcbyte(c, OP_CLEAN);
-            putcbyte(c, expr->u.functionCall.argc);
-        } else
-            putcbyte(c, OP_DROP);
+        putcbyte(c, OP_CLEAN);
+        putcbyte(c, expr->u.functionCall.argc);
     }
 }
 
 // code_symbolRef - code a global reference
-static void code_symbolRef(GenerateContext_t *c, Symbol_t *sym) {
-    VMUVALUE offset;
+void code_symbolRef(GenerateContext_t *c, Symbol_t *sym) {
     putcbyte(c, OP_LIT);
+    code_symbolWord(c, sym);
+}
+
+// code_symbolWord - code the address of a global as an instruction operand
+void code_symbolWord(GenerateContext_t *c, Symbol_t *sym) {
+    VMUVALUE offset;
     offset = codeaddr(c);
-    putcword(c, AddSymbolRef(c, sym, offset));
+    AddCodeRef(c, offset, sym, NULL);
+    putcword(c, c->privateCode ? 0 : AddSymbolRef(c, sym, offset));
+}
+
+// code_stringWord - code the address of a string as an instruction operand
+void code_stringWord(GenerateContext_t *c, String_t *str) {
+    AddCodeRef(c, codeaddr(c), NULL, str);
+    putcword(c, c->privateCode ? 0 : (VMVALUE) ((uint8_t*) str->data - c->codeBuf));
+}
+
+// AddCodeRef - remember an address coded in the current function
+static void AddCodeRef(GenerateContext_t *c, VMVALUE offset, Symbol_t *sym, String_t *str) {
+    if (c->refCnt >= c->refMax) {
+        CodeRef_t *refs;
+        c->refMax = c->refMax ? c->refMax * 2 : 64;
+        refs = (CodeRef_t*) system_arena_allocate(c->sys, c->refMax * sizeof(CodeRef_t));
+        if (c->refCnt > 0)
+            memcpy(refs, c->refs, c->refCnt * sizeof(CodeRef_t));
+        c->refs = refs;
+    }
+    c->refs[c->refCnt].offset = offset;
+    c->refs[c->refCnt].sym = sym;
+    c->refs[c->refCnt].str = str;
+    ++c->refCnt;
 }
 
 // code_arrayref - code an array reference
 static void code_arrayref(GenerateContext_t *c, ParseTreeNode_t *expr, PVAL_t *pv) {
-    code_lvalue(c, expr->u.arrayRef.array, pv);
+    code_rvalue(c, expr->u.arrayRef.array);
     code_rvalue(c, expr->u.arrayRef.index);
     putcbyte(c, OP_INDEX);
     pv->fcn = code_index;
@@ -478,14 +648,9 @@ VMVALUE putcbyte(GenerateContext_t *c, int b) {
     vm_context_t *sys = c->sys;
     VMVALUE addr = codeaddr(c);
     if (sys->nextLow >= sys->nextHigh)
-        GenerateFatal(c, "bytecode buffer overflow");
+        GrowCode(c, 1);
     *sys->nextLow++ = b;
 
-    if (b == OP_RETURN)
-        lastReturn = true;
-    else
-        lastReturn = false;
-
     return addr;
 }
 
@@ -496,7 +661,7 @@ VMVALUE putcword(GenerateContext_t *c, VMVALUE w) {
     uint8_t *p;
     int cnt = sizeof(VMVALUE);
     if (sys->nextLow + sizeof(VMVALUE) > sys->nextHigh)
-        GenerateFatal(c, "bytecode buffer overflow");
+        GrowCode(c, sizeof(VMVALUE));
     sys->nextLow += sizeof(VMVALUE);
     p = sys->nextLow;
     while (--cnt >= 0) {
@@ -511,12 +676,29 @@ VMVALUE putdword(GenerateContext_t *c, VMVALUE w) {
     vm_context_t *sys = c->sys;
     VMVALUE addr = codeaddr(c);
     if (sys->nextLow + sizeof(VMVALUE) > sys->nextHigh)
-        GenerateFatal(c, "bytecode buffer overflow");
+        GrowCode(c, sizeof(VMVALUE));
     *((VMVALUE*) sys->nextLow) = w;
     sys->nextLow += sizeof(VMVALUE);
     return addr;
 }
 
+// GrowCode - make room for more code, only a private buffer can grow
+static void GrowCode(GenerateContext_t *c, size_t size) {
+    vm_context_t *sys = c->sys;
+    size_t used = sys->nextLow - c->codeBuf, max = sys->nextHigh - c->codeBuf;
+    uint8_t *buf;
+
+    if (!c->privateCode)
+        GenerateFatal(c, "bytecode buffer overflow");
+    while (max < used + size)
+        max = max ? max * 2 : 1024;
+    if (!(buf = (uint8_t*) realloc(c->codeBuf, max)))
+        vm_system_abort(sys, "insufficient memory");
+    c->codeBuf = buf;
+    sys->nextLow = buf + used;
+    sys->nextHigh = buf + max;
+}
+
 // rd_cword - get a code word from the code buffer
 static VMVALUE rd_cword(GenerateContext_t *c, VMUVALUE off) {
     int cnt = sizeof(VMVALUE);
@@ -545,8 +727,8 @@ static void fixup(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val) {
     }
 }
 
-// fixupbranch - fixup a reference chain
-static void fixupbranch(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val) {
+// fixupbranch - fixup a branch chain
+void fixupbranch(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val) {
     while (chn != 0) {
         VMUVALUE nxt = rd_cword(c, chn);
         VMUVALUE off = val - (chn + sizeof(VMUVALUE));
@@ -580,11 +762,6 @@ void PlaceSymbol(GenerateContext_t *c, Symbol_t *sym, VMUVALUE offset) {
     }
 }
 
-// AddStringRef - add a reference to a string in the string table
-static VMVALUE AddStringRef(GenerateContext_t *c, String_t *str) {
-    return (VMVALUE) ((uint8_t*) str->data - c->codeBuf);
-}
-
 // StoreVector - store a VMVALUE vector
 VMVALUE StoreVector(GenerateContext_t *c, const VMVALUE *buf, int size) {
     return StoreByteVector(c, (uint8_t*) buf, size * sizeof(VMVALUE));
@@ -600,6 +777,41 @@ VMVALUE StoreByteVector(GenerateContext_t *c, const uint8_t *buf, int size) {
     return p - sys->freeSpace;
 }
 
+// StoreExports - store the table of exported functions followed by a halt stub for host calls
+VMVALUE StoreExports(GenerateContext_t *c) {
+    VMVALUE table;
+    int count = 0;
+    int i;
+
+    // store the function names
+    for (i = 0; i < generate_functionCount; ++i) {
+        Symbol_t *sym = generate_functions[i].symbol;
+        if (sym) {
+            generate_functions[i].name = StoreByteVector(c, (uint8_t*) sym->name, strlen(sym->name) + 1);
+            ++count;
+        }
+    }
+
+    // align the table
+    while (codeaddr(c) & ALIGN_MASK)
+        putcbyte(c, OP_HALT);
+
+    // store the table entries
+    table = putdword(c, count);
+    for (i = 0; i < generate_functionCount; ++i) {
+        if (generate_functions[i].symbol) {
+            putdword(c, generate_functions[i].code);
+            putdword(c, generate_functions[i].argc);
+            putdword(c, generate_functions[i].name);
+        }
+    }
+
+    // functions called from the host return here
+    putcbyte(c, OP_HALT);
+
+    return table;
+}
+
 // DumpFunctions - dump function definitions
 void DumpFunctions(GenerateContext_t *c) {
     int i;
@@ -615,7 +827,7 @@ static void GenerateError(GenerateContext_t *c, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     vm_printf("error: ");
-    vm_printf(fmt, ap);
+    vm_vprintf(fmt, ap);
     va_end(ap);
 }
 
@@ -624,7 +836,8 @@ static void GenerateFatal(GenerateContext_t *c, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     vm_printf("fatal: ");
-    vm_printf(fmt, ap);
+    vm_vprintf(fmt, ap);
     vm_putchar('\n');
     va_end(ap);
+    longjmp(c->sys->errorTarget, 1);
 }
@@ -0,0 +1,178 @@
+/*
+ * @image.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compile.h"
+
+#define IMAGE_MAGIC 0x47494d42 // "BMIG", start of a cached image file
+
+// header of a cached image file, followed by the included files and the code
+typedef struct {
+    uint32_t magic;
+    uint32_t includeCnt; // number of included files
+    uint64_t key;        // hash of the main source, the compiler and the options
+    uint32_t codeLen;
+    uint32_t mainCode;
+    uint32_t exports;
+    uint32_t reserved;
+} ImageHeader_t;
+
+// included file of a cached image, followed by its name
+typedef struct {
+    uint64_t hash;    // hash of the file contents
+    uint32_t nameLen; // length of the name without the terminator
+    uint32_t reserved;
+} ImageInclude_t;
+
+// local function prototypes
+static void ImagePath(char *path, size_t size, const char *dir, uint64_t key, const char *suffix);
+static bool HashFile(const char *name, uint64_t *pHash);
+
+// ImageKey - hash a mapped main source with everything else that decides its compiled image
+uint64_t ImageKey(const SourceMap_t *source, int optLevel, int isa) {
+    static const char build[] = COMPILER_VERSION " " __DATE__ " " __TIME__;
+    uint64_t key = SOURCE_HASH_INIT;
+    int32_t options[3];
+
+    // a rebuilt compiler may generate different code for the same source
+    options[0] = optLevel;
+    options[1] = isa;
+    options[2] = sizeof(VMVALUE);
+    key = HashSource(key, build, sizeof(build));
+    key = HashSource(key, options, sizeof(options));
+    if (source->base)
+        key = HashSource(key, source->base, source->end - source->base);
+    return key;
+}
+
+// LoadCachedImage - load the image stored for a key, false when there is none or an included file changed
+bool LoadCachedImage(const char *dir, uint64_t key, CachedImage_t *image) {
+    char path[FILENAME_MAX], name[FILENAME_MAX];
+    ImageInclude_t inc;
+    ImageHeader_t hdr;
+    uint64_t hash;
+    VMFILE *fp;
+    uint32_t i;
+
+    ImagePath(path, sizeof(path), dir, key, "");
+    if (!(fp = VM_fopen(path, "rb")))
+        return false;
+
+    if (VM_fread(&hdr, sizeof(hdr), 1, fp) != 1
+            || hdr.magic != IMAGE_MAGIC
+            || hdr.key != key
+            || hdr.mainCode >= hdr.codeLen
+            || hdr.exports >= hdr.codeLen) {
+        VM_fclose(fp);
+        return false;
+    }
+
+    // every file the program included must still hash the same
+    for (i = 0; i < hdr.includeCnt; ++i) {
+        if (VM_fread(&inc, sizeof(inc), 1, fp) != 1
+                || inc.nameLen >= sizeof(name)
+                || VM_fread(name, 1, inc.nameLen, fp) != inc.nameLen) {
+            VM_fclose(fp);
+            return false;
+        }
+        name[inc.nameLen] = '\0';
+        if (!HashFile(name, &hash) || hash != inc.hash) {
+            VM_fclose(fp);
+            return false;
+        }
+    }
+
+    if (!(image->code = (uint8_t*) malloc(hdr.codeLen))
+            || VM_fread(image->code, 1, hdr.codeLen, fp) != hdr.codeLen
+            || fgetc(fp) != EOF) {
+        free(image->code);
+        image->code = NULL;
+        VM_fclose(fp);
+        return false;
+    }
+    VM_fclose(fp);
+
+    image->codeLen = hdr.codeLen;
+    image->mainCode = hdr.mainCode;
+    image->exports = hdr.exports;
+    return true;
+}
+
+// StoreCachedImage - store the image of a compiled program under a key, a failure only costs the next compile
+//                    an included file that wasn't hashed when it was compiled keeps the image from being stored
+void StoreCachedImage(const char *dir, uint64_t key, ParseContext_t *c) {
+    char path[FILENAME_MAX], tmp[FILENAME_MAX], suffix[32];
+    IncludedFile_t *file;
+    ImageInclude_t inc;
+    ImageHeader_t hdr;
+    VMFILE *fp;
+    bool ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = IMAGE_MAGIC;
+    hdr.key = key;
+    hdr.codeLen = c->g->code_len;
+    hdr.mainCode = c->g->mainCode;
+    hdr.exports = c->g->exports;
+    for (file = c->includedFiles; file != NULL; file = file->next) {
+        if (!file->hashed)
+            return;
+        ++hdr.includeCnt;
+    }
+
+    // write a private file and rename it so a concurrent run never loads a partial image
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long) getpid());
+    ImagePath(tmp, sizeof(tmp), dir, key, suffix);
+    if (!(fp = VM_fopen(tmp, "wb")))
+        return;
+
+    ok = VM_fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (file = c->includedFiles; ok && file != NULL; file = file->next) {
+        memset(&inc, 0, sizeof(inc));
+        inc.nameLen = strlen(file->name);
+        inc.hash = file->hash;
+        ok = VM_fwrite(&inc, sizeof(inc), 1, fp) == 1
+                && VM_fwrite(file->name, 1, inc.nameLen, fp) == inc.nameLen;
+    }
+    ok = ok && VM_fwrite(c->g->codeBuf, 1, hdr.codeLen, fp) == hdr.codeLen;
+    ok = VM_fclose(fp) == 0 && ok;
+
+    ImagePath(path, sizeof(path), dir, key, "");
+    if (!ok || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+// ImagePath - build the name of the image file of a key
+static void ImagePath(char *path, size_t size, const char *dir, uint64_t key, const char *suffix) {
+    snprintf(path, size, "%s/%016llx.bim%s", dir, (unsigned long long) key, suffix);
+}
+
+// HashFile - hash the contents of a file, false if it can't be read
+static bool HashFile(const char *name, uint64_t *pHash) {
+    SourceMap_t map;
+
+    if (!system_fs_map(name, &map))
+        return false;
+    *pHash = map.base ? HashSource(SOURCE_HASH_INIT, map.base, map.end - map.base) : SOURCE_HASH_INIT;
+    system_fs_unmap(&map);
+    return true;
+}
@@ -0,0 +1,377 @@
+/*
+ * @ir.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "ir.h"
+#include "vmdebug.h"
+
+// operand format of each opcode, 0xff for undefined opcodes
+static uint8_t opFmt[256];
+static const char *opName[256];
+static bool opInit = false;
+
+// local function prototypes
+static void ir_init_tables(void);
+static int ir_size(int fmt);
+static VMVALUE rd_word(const uint8_t *p);
+static void wr_word(uint8_t *p, VMVALUE w);
+
+// build the instructions of a function from its bytecode, NULL if it can't be decoded
+IrFunction_t* ir_build(GenerateContext_t *g, functions_t *fcn) {
+    const uint8_t *code = g->codeBuf + fcn->code;
+    int32_t *index = NULL;
+    IrFunction_t *f;
+    size_t off;
+    int32_t k;
+
+    ir_init_tables();
+
+    if (!(f = (IrFunction_t*) calloc(1, sizeof(IrFunction_t))))
+        return NULL;
+    f->fcn = fcn;
+
+    // instruction index of every code offset for resolving branches
+    if (!(index = (int32_t*) malloc((fcn->codeLen + 1) * sizeof(int32_t))))
+        goto fail;
+    for (off = 0; off <= fcn->codeLen; ++off)
+        index[off] = -1;
+
+    for (off = 0; off < fcn->codeLen;) {
+        int fmt = opFmt[code[off]];
+        IrInst_t *inst;
+
+        // functions with register instructions are left as generated
+        if (fmt == 0xff || (fmt >= FMT_REG && fmt != FMT_FORNEXT) || off + ir_size(fmt) > fcn->codeLen)
+            goto fail;
+
+        if (f->cnt >= f->max) {
+            int32_t max = f->max ? f->max * 2 : 64;
+            IrInst_t *p;
+            if (!(p = (IrInst_t*) realloc(f->inst, max * sizeof(IrInst_t))))
+                goto fail;
+            f->inst = p;
+            f->max = max;
+        }
+
+        index[off] = f->cnt;
+        inst = &f->inst[f->cnt++];
+        inst->op = code[off];
+        inst->fmt = fmt;
+        inst->dead = false;
+        inst->addr = fcn->code + off;
+        inst->block = -1;
+        inst->regs = 0;
+        switch (fmt) {
+            case FMT_BYTE:
+                inst->arg = code[off + 1];
+                break;
+            case FMT_SBYTE:
+                inst->arg = (int8_t) code[off + 1];
+                break;
+            case FMT_WORD:
+            case FMT_NATIVE:
+                inst->arg = rd_word(code + off + 1);
+                break;
+            case FMT_BR:
+                // the target offset is replaced by an index below
+                inst->arg = off + 1 + sizeof(VMVALUE) + rd_word(code + off + 1);
+                break;
+            case FMT_FORNEXT:
+                inst->regs = (code[off + 1] << 16) | (code[off + 2] << 8) | code[off + 3];
+                inst->arg = off + 4 + sizeof(VMVALUE) + rd_word(code + off + 4);
+                break;
+            default:
+                inst->arg = 0;
+                break;
+        }
+        off += ir_size(fmt);
+    }
+
+    // branches must land on an instruction of the same function
+    for (k = 0; k < f->cnt; ++k) {
+        IrInst_t *inst = &f->inst[k];
+        if (ir_is_branch(inst)) {
+            if (inst->arg < 0 || (size_t) inst->arg >= fcn->codeLen || index[inst->arg] < 0)
+                goto fail;
+            inst->arg = index[inst->arg];
+        }
+    }
+
+    free(index);
+    return f;
+
+fail:
+    free(index);
+    ir_free(f);
+    return NULL;
+}
+
+// split the live instructions into basic blocks and find the reachable ones
+void ir_blocks(IrFunction_t *f) {
+    int32_t k, n, b, *stack;
+    bool leader;
+
+    free(f->blocks);
+    f->blocks = NULL;
+    f->blockCnt = 0;
+    if (f->cnt == 0)
+        return;
+
+    // mark the leaders, the first instruction, branch targets and instructions after a branch
+    for (k = 0; k < f->cnt; ++k)
+        f->inst[k].block = -1;
+    for (k = 0; k < f->cnt; ++k) {
+        IrInst_t *inst = &f->inst[k];
+        if (inst->dead)
+            continue;
+        if (ir_is_branch(inst)) {
+            // a branch to a removed instruction continues at the next live one
+            if (inst->arg < f->cnt && f->inst[inst->arg].dead)
+                inst->arg = ir_next(f, inst->arg);
+            if (inst->arg < f->cnt)
+                f->inst[inst->arg].block = 0;
+        }
+        if ((ir_is_branch(inst) || ir_is_jump(inst)) && (n = ir_next(f, k)) < f->cnt)
+            f->inst[n].block = 0;
+    }
+
+    f->blocks = (IrBlock_t*) malloc(f->cnt * sizeof(IrBlock_t));
+    leader = true;
+    for (k = 0; k < f->cnt; k = n) {
+        n = ir_next(f, k);
+        if (f->inst[k].dead) {
+            // only reached when the first instruction is dead
+            continue;
+        }
+        if (leader || f->inst[k].block == 0) {
+            if (f->blockCnt > 0)
+                f->blocks[f->blockCnt - 1].last = k;
+            f->blocks[f->blockCnt].first = k;
+            f->blocks[f->blockCnt].succ[0] = f->blocks[f->blockCnt].succ[1] = -1;
+            f->blocks[f->blockCnt].reachable = false;
+            ++f->blockCnt;
+            leader = false;
+        }
+        f->inst[k].block = f->blockCnt - 1;
+    }
+    if (f->blockCnt == 0)
+        return;
+    f->blocks[f->blockCnt - 1].last = f->cnt;
+
+    // connect the blocks, the last live instruction of a block decides its successors
+    for (b = 0; b < f->blockCnt; ++b) {
+        IrBlock_t *blk = &f->blocks[b];
+        IrInst_t *inst;
+        for (k = n = blk->first; (k = ir_next(f, k)) < blk->last;)
+            n = k;
+        inst = &f->inst[n];
+        if (ir_is_branch(inst) && inst->arg < f->cnt)
+            blk->succ[0] = f->inst[inst->arg].block;
+        if (!ir_is_jump(inst) && b + 1 < f->blockCnt)
+            blk->succ[1] = b + 1;
+    }
+
+    // reachability from the entry block
+    stack = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    n = 0;
+    f->blocks[0].reachable = true;
+    stack[n++] = 0;
+    while (n > 0) {
+        IrBlock_t *blk = &f->blocks[stack[--n]];
+        for (k = 0; k < 2; ++k) {
+            if ((b = blk->succ[k]) >= 0 && !f->blocks[b].reachable) {
+                f->blocks[b].reachable = true;
+                stack[n++] = b;
+            }
+        }
+    }
+    free(stack);
+}
+
+// get the index of the next live instruction after k
+int32_t ir_next(IrFunction_t *f, int32_t k) {
+    while (++k < f->cnt && f->inst[k].dead)
+        ;
+    return k;
+}
+
+// check for a branch instruction
+bool ir_is_branch(const IrInst_t *inst) {
+    return inst->fmt == FMT_BR || inst->fmt == FMT_FORNEXT;
+}
+
+// check for an instruction that never falls through
+bool ir_is_jump(const IrInst_t *inst) {
+    return inst->op == OP_BR || inst->op == OP_RETURN || inst->op == OP_RETURNZ || inst->op == OP_HALT;
+}
+
+// encode the live instructions back in place and record the new offset of every old one in remap
+void ir_encode(GenerateContext_t *g, IrFunction_t *f, VMVALUE *remap) {
+    functions_t *fcn = f->fcn;
+    VMVALUE naddr = fcn->code;
+    int32_t k, t;
+
+    // assign the new offsets, a dead instruction maps to -1
+    for (k = 0; k < f->cnt; ++k) {
+        IrInst_t *inst = &f->inst[k];
+        inst->naddr = naddr;
+        if (remap)
+            remap[inst->addr] = inst->dead ? -1 : naddr;
+        if (!inst->dead)
+            naddr += ir_size(inst->fmt);
+    }
+
+    for (k = 0; k < f->cnt; ++k) {
+        IrInst_t *inst = &f->inst[k];
+        uint8_t *p = g->codeBuf + inst->naddr;
+        if (inst->dead)
+            continue;
+        *p = inst->op;
+        switch (inst->fmt) {
+            case FMT_BYTE:
+            case FMT_SBYTE:
+                p[1] = inst->arg;
+                break;
+            case FMT_WORD:
+            case FMT_NATIVE:
+                wr_word(p + 1, inst->arg);
+                break;
+            case FMT_BR:
+                // a branch to a removed instruction continues at the next live one
+                t = (inst->arg < f->cnt && f->inst[inst->arg].dead) ? ir_next(f, inst->arg) : inst->arg;
+                wr_word(p + 1, (t < f->cnt ? f->inst[t].naddr : naddr) - (inst->naddr + 1 + sizeof(VMVALUE)));
+                break;
+            case FMT_FORNEXT:
+                p[1] = inst->regs >> 16;
+                p[2] = inst->regs >> 8;
+                p[3] = inst->regs;
+                t = (inst->arg < f->cnt && f->inst[inst->arg].dead) ? ir_next(f, inst->arg) : inst->arg;
+                wr_word(p + 4, (t < f->cnt ? f->inst[t].naddr : naddr) - (inst->naddr + 4 + sizeof(VMVALUE)));
+                break;
+        }
+    }
+
+    // the function start never moves, fill the freed tail with HALT
+    memset(g->codeBuf + naddr, OP_HALT, fcn->code + fcn->codeLen - naddr);
+    fcn->codeLen = naddr - fcn->code;
+}
+
+// print the live instructions of a function
+void ir_print(IrFunction_t *f) {
+    int32_t k;
+
+    for (k = 0; k < f->cnt; ++k) {
+        IrInst_t *inst = &f->inst[k];
+        if (inst->dead)
+            continue;
+        if (inst->block >= 0 && f->blocks && f->blocks[inst->block].first == k)
+            vm_printf("  B%d:\n", inst->block);
+        switch (inst->fmt) {
+            case FMT_BYTE:
+            case FMT_SBYTE:
+                vm_printf("    %-8s %d\n", opName[inst->op], inst->arg);
+                break;
+            case FMT_WORD:
+            case FMT_NATIVE:
+                vm_printf("    %-8s %08x\n", opName[inst->op], inst->arg);
+                break;
+            case FMT_BR:
+                if (f->blocks && inst->arg < f->cnt && f->inst[inst->arg].block >= 0)
+                    vm_printf("    %-8s B%d\n", opName[inst->op], f->inst[inst->arg].block);
+                else
+                    vm_printf("    %-8s @%d\n", opName[inst->op], inst->arg);
+                break;
+            case FMT_FORNEXT:
+                vm_printf("    %-8s %d, %d, %d, ", opName[inst->op], (int8_t) (inst->regs >> 16), (int8_t) (inst->regs >> 8), (int8_t) inst->regs);
+                if (f->blocks && inst->arg < f->cnt && f->inst[inst->arg].block >= 0)
+                    vm_printf("B%d\n", f->inst[inst->arg].block);
+                else
+                    vm_printf("@%d\n", inst->arg);
+                break;
+            default:
+                vm_printf("    %s\n", opName[inst->op]);
+                break;
+        }
+    }
+}
+
+// free a function
+void ir_free(IrFunction_t *f) {
+    if (f == NULL)
+        return;
+    free(f->inst);
+    free(f->blocks);
+    free(f);
+}
+
+// ir_init_tables - build the opcode lookup tables from the assembler table
+static void ir_init_tables(void) {
+    otdef_t *def;
+
+    if (opInit)
+        return;
+
+    memset(opFmt, 0xff, sizeof(opFmt));
+    for (def = opcode_table; def->name != NULL; ++def) {
+        // the first name wins, RETURNX is an alias of RETURN
+        if (opFmt[def->code] == 0xff) {
+            opFmt[def->code] = def->fmt;
+            opName[def->code] = def->name;
+        }
+    }
+    opInit = true;
+}
+
+// ir_size - get the size of an instruction from its format
+static int ir_size(int fmt) {
+    switch (fmt) {
+        case FMT_BYTE:
+        case FMT_SBYTE:
+            return 2;
+        case FMT_WORD:
+        case FMT_NATIVE:
+        case FMT_BR:
+            return 1 + sizeof(VMVALUE);
+        case FMT_FORNEXT:
+            return 4 + sizeof(VMVALUE);
+        default:
+            return 1;
+    }
+}
+
+// rd_word - read a big endian code word
+static VMVALUE rd_word(const uint8_t *p) {
+    VMUVALUE w = 0;
+    int cnt = sizeof(VMVALUE);
+    while (--cnt >= 0)
+        w = (w << 8) | *p++;
+    return w;
+}
+
+// wr_word - write a big endian code word
+static void wr_word(uint8_t *p, VMVALUE w) {
+    int cnt = sizeof(VMVALUE);
+    p += sizeof(VMVALUE);
+    while (--cnt >= 0) {
+        *--p = w;
+        w >>= 8;
+    }
+}
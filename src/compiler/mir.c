@@ -0,0 +1,745 @@
+/*
+ * @mir.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+#include "vmdebug.h"
+
+// local function prototypes
+static void* mir_alloc(MirFunction_t *f, void *p, size_t size);
+static void set_block(MirFunction_t *f, int32_t b);
+static bool is_terminated(MirFunction_t *f);
+static void lower_br(MirFunction_t *f, int32_t target);
+static void lower_cbr(MirFunction_t *f, MirOperand_t cond, int32_t t, int32_t e);
+static void lower_statements(MirFunction_t *f, NodeListEntry_t *entry);
+static void lower_statement(MirFunction_t *f, ParseTreeNode_t *node);
+static void lower_if(MirFunction_t *f, ParseTreeNode_t *node);
+static void lower_for(MirFunction_t *f, ParseTreeNode_t *node);
+static void lower_loop(MirFunction_t *f, ParseTreeNode_t *node);
+static void lower_store(MirFunction_t *f, ParseTreeNode_t *lvalue, MirOperand_t value);
+static void lower_mov(MirFunction_t *f, int32_t dst, MirOperand_t value);
+static void lower_cond(MirFunction_t *f, ParseTreeNode_t *expr, int32_t t, int32_t e);
+static MirOperand_t lower_expr(MirFunction_t *f, ParseTreeNode_t *expr);
+static MirOperand_t lower_call(MirFunction_t *f, ParseTreeNode_t *expr, bool value);
+static MirOperand_t lower_shortcircuit(MirFunction_t *f, ParseTreeNode_t *expr, bool isOr);
+static MirOperand_t lower_op(MirFunction_t *f, int op, int code, MirOperand_t a, MirOperand_t b);
+static MirOperand_t op_vreg(int32_t vreg);
+static MirOperand_t op_const(VMVALUE value);
+static void print_operand(MirOperand_t *op);
+static const char* op_name(int code);
+
+// mnemonics of the instruction opcodes
+static const char *mirNames[_MIR_MAX] = {
+    "mov",
+    "unary",
+    "binary",
+    "load",
+    "store",
+    "index",
+    "call",
+    "br",
+    "cbr",
+    "ret",
+    "retz",
+    "halt"
+};
+
+// lower a function definition, NULL if it has to be coded from the parse tree
+MirFunction_t* mir_build(GenerateContext_t *g, ParseTreeNode_t *node) {
+    MirFunction_t *f;
+
+    if (!(f = (MirFunction_t*) calloc(1, sizeof(MirFunction_t))))
+        vm_system_abort(g->sys, "insufficient memory");
+    f->sys = g->sys;
+    f->node = node;
+    f->argc = node->u.functionDefinition.argumentOffset;
+    f->varCnt = f->argc + node->u.functionDefinition.localOffset;
+    f->vregCnt = f->varCnt;
+
+    set_block(f, mir_new_block(f));
+    lower_statements(f, node->u.functionDefinition.bodyStatements);
+
+    // fall off the end of the body
+    if (!is_terminated(f))
+        mir_append(f, node->u.functionDefinition.symbol ? MIR_RETZ : MIR_HALT);
+
+    if (f->failed) {
+        mir_free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+// free a function
+void mir_free(MirFunction_t *f) {
+    int32_t b, k;
+
+    if (f == NULL)
+        return;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        for (k = 0; k < f->blocks[b].cnt; ++k)
+            free(f->blocks[b].inst[k].args);
+        free(f->blocks[b].inst);
+    }
+    free(f->blocks);
+    free(f->layout);
+    free(f);
+}
+
+// append an instruction to the current block, code after a terminator starts an unreachable block
+MirInst_t* mir_append(MirFunction_t *f, int op) {
+    MirInst_t *inst;
+
+    if (is_terminated(f))
+        set_block(f, mir_new_block(f));
+
+    inst = mir_insert(f, &f->blocks[f->cur]);
+    memset(inst, 0, sizeof(MirInst_t));
+    inst->op = op;
+    inst->dst = -1;
+    return inst;
+}
+
+// add an uninitialized instruction at the end of a block
+MirInst_t* mir_insert(MirFunction_t *f, MirBlock_t *blk) {
+    if (blk->cnt >= blk->max) {
+        blk->max = blk->max ? blk->max * 2 : 8;
+        blk->inst = (MirInst_t*) mir_alloc(f, blk->inst, blk->max * sizeof(MirInst_t));
+    }
+    return &blk->inst[blk->cnt++];
+}
+
+// create an empty block
+int32_t mir_new_block(MirFunction_t *f) {
+    MirBlock_t *blk;
+
+    if (f->blockCnt >= f->blockMax) {
+        f->blockMax = f->blockMax ? f->blockMax * 2 : 16;
+        f->blocks = (MirBlock_t*) mir_alloc(f, f->blocks, f->blockMax * sizeof(MirBlock_t));
+        f->layout = (int32_t*) mir_alloc(f, f->layout, f->blockMax * sizeof(int32_t));
+    }
+
+    blk = &f->blocks[f->blockCnt];
+    memset(blk, 0, sizeof(MirBlock_t));
+    blk->succ[0] = blk->succ[1] = -1;
+    return f->blockCnt++;
+}
+
+// create a temporary register
+int32_t mir_new_vreg(MirFunction_t *f) {
+    return f->vregCnt++;
+}
+
+// get the terminator of a block, NULL while the block is still open
+MirInst_t* mir_term(MirBlock_t *b) {
+    MirInst_t *inst;
+
+    if (b->cnt == 0)
+        return NULL;
+
+    inst = &b->inst[b->cnt - 1];
+    return inst->op >= MIR_BR ? inst : NULL;
+}
+
+// count the predecessors of every live block
+void mir_preds(MirFunction_t *f) {
+    int32_t b, k;
+
+    for (b = 0; b < f->blockCnt; ++b)
+        f->blocks[b].predCnt = 0;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        if (f->blocks[b].dead)
+            continue;
+        for (k = 0; k < 2; ++k)
+            if (f->blocks[b].succ[k] >= 0)
+                ++f->blocks[f->blocks[b].succ[k]].predCnt;
+    }
+}
+
+// get an operand of an instruction in push order, NULL past the last one
+MirOperand_t* mir_operand(MirInst_t *inst, int k) {
+    switch (inst->op) {
+        case MIR_CALL:
+            if (k < inst->argc)
+                return &inst->args[k];
+            return k == inst->argc ? &inst->a : NULL;
+        case MIR_BINARY:
+        case MIR_STORE:
+        case MIR_INDEX:
+            return k == 0 ? &inst->a : k == 1 ? &inst->b : NULL;
+        case MIR_MOV:
+        case MIR_UNARY:
+        case MIR_LOAD:
+        case MIR_CBR:
+        case MIR_RET:
+            return k == 0 ? &inst->a : NULL;
+        default:
+            return NULL;
+    }
+}
+
+// match the add, compare and branch that count a FOR loop with a short literal step, the compare result or -1
+int32_t mir_fornext(MirBlock_t *blk, int32_t *pVar, int32_t *pLimit, VMVALUE *pStep) {
+    MirInst_t *add, *cmp, *term;
+
+    if (blk->cnt < 3)
+        return -1;
+    add = &blk->inst[blk->cnt - 3];
+    cmp = &blk->inst[blk->cnt - 2];
+    term = &blk->inst[blk->cnt - 1];
+
+    if (term->op != MIR_CBR || term->a.kind != MIR_VREG || cmp->op != MIR_BINARY || cmp->dst != term->a.u.vreg)
+        return -1;
+    if ((cmp->code != OP_LE && cmp->code != OP_GE) || cmp->a.kind != MIR_VREG || cmp->b.kind != MIR_VREG)
+        return -1;
+    if (add->op != MIR_BINARY || add->code != OP_ADD || add->dst != cmp->a.u.vreg || !(add->a.kind == MIR_VREG && add->a.u.vreg == add->dst))
+        return -1;
+    if (add->b.kind != MIR_CONST || add->b.u.value < -128 || add->b.u.value > 127 || (add->b.u.value < 0) != (cmp->code == OP_GE))
+        return -1;
+    if (cmp->b.u.vreg == add->dst || cmp->dst == add->dst || cmp->dst == cmp->b.u.vreg)
+        return -1;
+
+    *pVar = add->dst;
+    *pLimit = cmp->b.u.vreg;
+    *pStep = add->b.u.value;
+    return cmp->dst;
+}
+
+// check whether two operands name the same value
+bool mir_same_operand(const MirOperand_t *a, const MirOperand_t *b) {
+    if (a->kind != b->kind)
+        return false;
+    switch (a->kind) {
+        case MIR_VREG:
+            return a->u.vreg == b->u.vreg;
+        case MIR_CONST:
+            return a->u.value == b->u.value;
+        case MIR_SYMBOL:
+            return a->u.sym == b->u.sym;
+        case MIR_STRING:
+            return a->u.str == b->u.str;
+        default:
+            return true;
+    }
+}
+
+// check for an instruction that must be kept even if its result is not used
+bool mir_has_side_effects(const MirInst_t *inst) {
+    return inst->op == MIR_CALL || inst->op == MIR_STORE || inst->op >= MIR_BR;
+}
+
+// print a function
+void mir_print(MirFunction_t *f) {
+    Symbol_t *sym = f->node->u.functionDefinition.symbol;
+    int32_t n, k;
+
+    vm_printf("mir '%s': args %d, locals %d, registers %d\n", sym ? sym->name : "<main>", f->argc, f->varCnt - f->argc, f->vregCnt);
+    for (n = 0; n < f->layoutCnt; ++n) {
+        int32_t b = f->layout[n];
+        MirBlock_t *blk = &f->blocks[b];
+
+        if (blk->dead)
+            continue;
+
+        vm_printf("  B%d:\n", b);
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+            int i;
+
+            vm_printf("    ");
+            if (inst->dst >= 0)
+                vm_printf("v%d = ", inst->dst);
+            if (inst->op == MIR_UNARY || inst->op == MIR_BINARY)
+                vm_printf("%s", op_name(inst->code));
+            else
+                vm_printf("%s", mirNames[inst->op]);
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i) {
+                vm_printf(i == 0 ? " " : ", ");
+                print_operand(op);
+            }
+            if (inst->op == MIR_BR)
+                vm_printf(" B%d", blk->succ[0]);
+            else if (inst->op == MIR_CBR)
+                vm_printf(", B%d, B%d", blk->succ[0], blk->succ[1]);
+            vm_printf("\n");
+        }
+    }
+}
+
+// mir_alloc - grow an allocation, running out of memory aborts the compile
+static void* mir_alloc(MirFunction_t *f, void *p, size_t size) {
+    if (!(p = realloc(p, size)))
+        vm_system_abort(f->sys, "insufficient memory");
+    return p;
+}
+
+// set_block - make a block the current one and place it after the previous one
+static void set_block(MirFunction_t *f, int32_t b) {
+    f->cur = b;
+    f->layout[f->layoutCnt++] = b;
+}
+
+// is_terminated - check whether the current block already ends with a terminator
+static bool is_terminated(MirFunction_t *f) {
+    return mir_term(&f->blocks[f->cur]) != NULL;
+}
+
+// lower_br - end the current block with a branch
+static void lower_br(MirFunction_t *f, int32_t target) {
+    mir_append(f, MIR_BR);
+    f->blocks[f->cur].succ[0] = target;
+}
+
+// lower_cbr - end the current block with a conditional branch
+static void lower_cbr(MirFunction_t *f, MirOperand_t cond, int32_t t, int32_t e) {
+    MirInst_t *inst = mir_append(f, MIR_CBR);
+    inst->a = cond;
+    f->blocks[f->cur].succ[0] = t;
+    f->blocks[f->cur].succ[1] = e;
+}
+
+// lower_statements - lower a list of statements
+static void lower_statements(MirFunction_t *f, NodeListEntry_t *entry) {
+    for (; entry != NULL && !f->failed; entry = entry->next)
+        lower_statement(f, entry->node);
+}
+
+// lower_statement - lower a statement
+static void lower_statement(MirFunction_t *f, ParseTreeNode_t *node) {
+    MirOperand_t value;
+    MirInst_t *inst;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            value = lower_expr(f, node->u.letStatement.rvalue);
+            lower_store(f, node->u.letStatement.lvalue, value);
+            break;
+        case NodeTypeIfStatement:
+            lower_if(f, node);
+            break;
+        case NodeTypeForStatement:
+            lower_for(f, node);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            lower_loop(f, node);
+            break;
+        case NodeTypeReturnStatement:
+            if (node->u.returnStatement.expr) {
+                value = lower_expr(f, node->u.returnStatement.expr);
+                inst = mir_append(f, MIR_RET);
+                inst->a = value;
+            } else
+                mir_append(f, MIR_RETZ);
+            break;
+        case NodeTypeCallStatement:
+            if (node->u.callStatement.expr->nodeType == NodeTypeFunctionCall)
+                lower_call(f, node->u.callStatement.expr, false);
+            else
+                lower_expr(f, node->u.callStatement.expr);
+            break;
+        case NodeTypeEndStatement:
+            // the parse tree generator emits nothing for END either
+            break;
+        default:
+            // inline assembly and anything unknown is left to the parse tree generator
+            f->failed = true;
+            break;
+    }
+}
+
+// lower_if - lower an IF statement
+static void lower_if(MirFunction_t *f, ParseTreeNode_t *node) {
+    int32_t thenBlock = mir_new_block(f);
+    int32_t endBlock = mir_new_block(f);
+    int32_t elseBlock = node->u.ifStatement.elseStatements ? mir_new_block(f) : endBlock;
+
+    lower_cond(f, node->u.ifStatement.test, thenBlock, elseBlock);
+
+    set_block(f, thenBlock);
+    lower_statements(f, node->u.ifStatement.thenStatements);
+    if (!is_terminated(f))
+        lower_br(f, endBlock);
+
+    if (elseBlock != endBlock) {
+        set_block(f, elseBlock);
+        lower_statements(f, node->u.ifStatement.elseStatements);
+        if (!is_terminated(f))
+            lower_br(f, endBlock);
+    }
+
+    set_block(f, endBlock);
+}
+
+// lower_for - lower a FOR statement, the loop is entered through a copy of its test
+static void lower_for(MirFunction_t *f, ParseTreeNode_t *node) {
+    ParseTreeNode_t *var = node->u.forStatement.var, *stepExpr = node->u.forStatement.stepExpr;
+    MirOperand_t limit = op_vreg(f->argc + node->u.forStatement.limitOffset);
+    int32_t bodyBlock = mir_new_block(f);
+    int32_t endBlock = mir_new_block(f);
+    int32_t testBlock, upBlock, downBlock;
+    MirOperand_t value, step;
+
+    // the limit and a computed step are evaluated once into their hidden locals
+    value = lower_expr(f, node->u.forStatement.startExpr);
+    lower_mov(f, limit.u.vreg, lower_expr(f, node->u.forStatement.endExpr));
+    if (node->u.forStatement.stepOffset >= 0) {
+        step = op_vreg(f->argc + node->u.forStatement.stepOffset);
+        lower_mov(f, step.u.vreg, lower_expr(f, stepExpr));
+    } else
+        step = op_const(stepExpr ? stepExpr->u.integerLit.value : 1);
+    lower_store(f, var, value);
+
+    // a literal step decides the direction now
+    if (step.kind == MIR_CONST) {
+        int code = step.u.value < 0 ? OP_GE : OP_LE;
+        lower_cbr(f, lower_op(f, MIR_BINARY, code, lower_expr(f, var), limit), bodyBlock, endBlock);
+
+        set_block(f, bodyBlock);
+        lower_statements(f, node->u.forStatement.bodyStatements);
+        lower_store(f, var, lower_op(f, MIR_BINARY, OP_ADD, lower_expr(f, var), step));
+        lower_cbr(f, lower_op(f, MIR_BINARY, code, lower_expr(f, var), limit), bodyBlock, endBlock);
+    }
+
+    // otherwise its sign picks the test on every pass
+    else {
+        testBlock = mir_new_block(f);
+        upBlock = mir_new_block(f);
+        downBlock = mir_new_block(f);
+        lower_br(f, testBlock);
+
+        set_block(f, bodyBlock);
+        lower_statements(f, node->u.forStatement.bodyStatements);
+        lower_store(f, var, lower_op(f, MIR_BINARY, OP_ADD, lower_expr(f, var), step));
+        lower_br(f, testBlock);
+
+        set_block(f, testBlock);
+        lower_cbr(f, lower_op(f, MIR_BINARY, OP_LT, step, op_const(0)), downBlock, upBlock);
+        set_block(f, upBlock);
+        lower_cbr(f, lower_op(f, MIR_BINARY, OP_LE, lower_expr(f, var), limit), bodyBlock, endBlock);
+        set_block(f, downBlock);
+        lower_cbr(f, lower_op(f, MIR_BINARY, OP_GE, lower_expr(f, var), limit), bodyBlock, endBlock);
+    }
+
+    set_block(f, endBlock);
+}
+
+// lower_loop - lower the DO and LOOP statements
+static void lower_loop(MirFunction_t *f, ParseTreeNode_t *node) {
+    int32_t bodyBlock = mir_new_block(f);
+    int32_t testBlock = -1;
+    int32_t endBlock = mir_new_block(f);
+
+    // DO WHILE and DO UNTIL test before the first pass through the body
+    if (node->nodeType == NodeTypeDoWhileStatement || node->nodeType == NodeTypeDoUntilStatement) {
+        testBlock = mir_new_block(f);
+        lower_br(f, testBlock);
+    } else
+        lower_br(f, bodyBlock);
+
+    set_block(f, bodyBlock);
+    lower_statements(f, node->u.loopStatement.bodyStatements);
+
+    if (testBlock >= 0) {
+        if (!is_terminated(f))
+            lower_br(f, testBlock);
+        set_block(f, testBlock);
+    }
+
+    switch (node->nodeType) {
+        case NodeTypeDoWhileStatement:
+        case NodeTypeLoopWhileStatement:
+            lower_cond(f, node->u.loopStatement.test, bodyBlock, endBlock);
+            break;
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopUntilStatement:
+            lower_cond(f, node->u.loopStatement.test, endBlock, bodyBlock);
+            break;
+        default:
+            if (!is_terminated(f))
+                lower_br(f, bodyBlock);
+            break;
+    }
+
+    set_block(f, endBlock);
+}
+
+// lower_store - store a value into an l-value
+static void lower_store(MirFunction_t *f, ParseTreeNode_t *lvalue, MirOperand_t value) {
+    Symbol_t *sym;
+    MirOperand_t addr;
+    MirInst_t *inst;
+
+    switch (lvalue->nodeType) {
+        case NodeTypeArgumentRef:
+            inst = mir_append(f, MIR_MOV);
+            inst->dst = lvalue->u.symbolRef.symbol->value;
+            inst->a = value;
+            break;
+        case NodeTypeLocalRef:
+            inst = mir_append(f, MIR_MOV);
+            inst->dst = f->argc + lvalue->u.symbolRef.symbol->value;
+            inst->a = value;
+            break;
+        case NodeTypeGlobalRef:
+            sym = lvalue->u.symbolRef.symbol;
+            if (sym->storageClass != SC_VARIABLE) {
+                // let the parse tree generator report it
+                f->failed = true;
+                break;
+            }
+            inst = mir_append(f, MIR_STORE);
+            inst->a = value;
+            inst->b.kind = MIR_SYMBOL;
+            inst->b.u.sym = sym;
+            break;
+        case NodeTypeArrayRef:
+            addr = lower_expr(f, lvalue->u.arrayRef.array);
+            addr = lower_op(f, MIR_INDEX, 0, addr, lower_expr(f, lvalue->u.arrayRef.index));
+            inst = mir_append(f, MIR_STORE);
+            inst->a = value;
+            inst->b = addr;
+            break;
+        default:
+            f->failed = true;
+            break;
+    }
+}
+
+// lower_mov - copy a value into a register
+static void lower_mov(MirFunction_t *f, int32_t dst, MirOperand_t value) {
+    MirInst_t *inst = mir_append(f, MIR_MOV);
+    inst->dst = dst;
+    inst->a = value;
+}
+
+// lower_cond - lower a condition as branches to a true and a false block
+static void lower_cond(MirFunction_t *f, ParseTreeNode_t *expr, int32_t t, int32_t e) {
+    NodeListEntry_t *entry;
+
+    switch (expr->nodeType) {
+        case NodeTypeConjunction:
+        case NodeTypeDisjunction:
+            for (entry = expr->u.exprList.exprs; entry->next != NULL; entry = entry->next) {
+                int32_t next = mir_new_block(f);
+                if (expr->nodeType == NodeTypeConjunction)
+                    lower_cond(f, entry->node, next, e);
+                else
+                    lower_cond(f, entry->node, t, next);
+                set_block(f, next);
+            }
+            lower_cond(f, entry->node, t, e);
+            break;
+        case NodeTypeUnaryOp:
+            if (expr->u.unaryOp.op == OP_NOT) {
+                lower_cond(f, expr->u.unaryOp.expr, e, t);
+                break;
+            }
+            lower_cbr(f, lower_expr(f, expr), t, e);
+            break;
+        case NodeTypeIntegerLit:
+            lower_br(f, expr->u.integerLit.value ? t : e);
+            break;
+        default:
+            lower_cbr(f, lower_expr(f, expr), t, e);
+            break;
+    }
+}
+
+// lower_expr - lower an r-value expression
+static MirOperand_t lower_expr(MirFunction_t *f, ParseTreeNode_t *expr) {
+    MirOperand_t op;
+    Symbol_t *sym;
+
+    memset(&op, 0, sizeof(op));
+    switch (expr->nodeType) {
+        case NodeTypeGlobalRef:
+            sym = expr->u.symbolRef.symbol;
+            op.kind = MIR_SYMBOL;
+            op.u.sym = sym;
+            if (sym->storageClass == SC_VARIABLE)
+                op = lower_op(f, MIR_LOAD, 0, op, op);
+            break;
+        case NodeTypeArgumentRef:
+            op = op_vreg(expr->u.symbolRef.symbol->value);
+            break;
+        case NodeTypeLocalRef:
+            op = op_vreg(f->argc + expr->u.symbolRef.symbol->value);
+            break;
+        case NodeTypeStringLit:
+            op.kind = MIR_STRING;
+            op.u.str = expr->u.stringLit.string;
+            break;
+        case NodeTypeIntegerLit:
+            op = op_const(expr->u.integerLit.value);
+            break;
+        case NodeTypeUnaryOp:
+            op = lower_expr(f, expr->u.unaryOp.expr);
+            op = lower_op(f, MIR_UNARY, expr->u.unaryOp.op, op, op);
+            break;
+        case NodeTypeBinaryOp:
+            op = lower_expr(f, expr->u.binaryOp.left);
+            op = lower_op(f, MIR_BINARY, expr->u.binaryOp.op, op, lower_expr(f, expr->u.binaryOp.right));
+            break;
+        case NodeTypeArrayRef:
+            op = lower_expr(f, expr->u.arrayRef.array);
+            op = lower_op(f, MIR_INDEX, 0, op, lower_expr(f, expr->u.arrayRef.index));
+            op = lower_op(f, MIR_LOAD, 0, op, op);
+            break;
+        case NodeTypeFunctionCall:
+            op = lower_call(f, expr, true);
+            break;
+        case NodeTypeDisjunction:
+            op = lower_shortcircuit(f, expr, true);
+            break;
+        case NodeTypeConjunction:
+            op = lower_shortcircuit(f, expr, false);
+            break;
+        default:
+            f->failed = true;
+            op = op_const(0);
+            break;
+    }
+
+    return op;
+}
+
+// lower_call - lower a function call, the arguments are pushed in list order
+static MirOperand_t lower_call(MirFunction_t *f, ParseTreeNode_t *expr, bool value) {
+    int32_t argc = expr->u.functionCall.argc;
+    MirOperand_t *args = NULL, fcn;
+    NodeListEntry_t *arg;
+    MirInst_t *inst;
+    int32_t k = 0;
+
+    if (argc > 0)
+        args = (MirOperand_t*) mir_alloc(f, NULL, argc * sizeof(MirOperand_t));
+    for (arg = expr->u.functionCall.args; arg != NULL && k < argc; arg = arg->next)
+        args[k++] = lower_expr(f, arg->node);
+    fcn = lower_expr(f, expr->u.functionCall.fcn);
+
+    inst = mir_append(f, MIR_CALL);
+    inst->a = fcn;
+    inst->args = args;
+    inst->argc = k;
+    if (value)
+        inst->dst = mir_new_vreg(f);
+
+    return op_vreg(inst->dst);
+}
+
+// lower_shortcircuit - lower the value of an AND or OR chain, the result is the last operand evaluated
+static MirOperand_t lower_shortcircuit(MirFunction_t *f, ParseTreeNode_t *expr, bool isOr) {
+    NodeListEntry_t *entry = expr->u.exprList.exprs;
+    int32_t endBlock = mir_new_block(f);
+    int32_t result = mir_new_vreg(f);
+    MirInst_t *inst;
+
+    for (;;) {
+        MirOperand_t value = lower_expr(f, entry->node);
+        int32_t next;
+
+        inst = mir_append(f, MIR_MOV);
+        inst->dst = result;
+        inst->a = value;
+        if ((entry = entry->next) == NULL)
+            break;
+
+        next = mir_new_block(f);
+        if (isOr)
+            lower_cbr(f, op_vreg(result), endBlock, next);
+        else
+            lower_cbr(f, op_vreg(result), next, endBlock);
+        set_block(f, next);
+    }
+
+    lower_br(f, endBlock);
+    set_block(f, endBlock);
+    return op_vreg(result);
+}
+
+// lower_op - append an operation with a new temporary as its destination
+static MirOperand_t lower_op(MirFunction_t *f, int op, int code, MirOperand_t a, MirOperand_t b) {
+    MirInst_t *inst = mir_append(f, op);
+    inst->code = code;
+    inst->a = a;
+    if (op == MIR_BINARY || op == MIR_INDEX)
+        inst->b = b;
+    inst->dst = mir_new_vreg(f);
+    return op_vreg(inst->dst);
+}
+
+// op_vreg - make a register operand
+static MirOperand_t op_vreg(int32_t vreg) {
+    MirOperand_t op;
+    memset(&op, 0, sizeof(op));
+    op.kind = MIR_VREG;
+    op.u.vreg = vreg;
+    return op;
+}
+
+// op_const - make a constant operand
+static MirOperand_t op_const(VMVALUE value) {
+    MirOperand_t op;
+    memset(&op, 0, sizeof(op));
+    op.kind = MIR_CONST;
+    op.u.value = value;
+    return op;
+}
+
+// print_operand - print an instruction operand
+static void print_operand(MirOperand_t *op) {
+    switch (op->kind) {
+        case MIR_VREG:
+            vm_printf("v%d", op->u.vreg);
+            break;
+        case MIR_CONST:
+            vm_printf("%d", op->u.value);
+            break;
+        case MIR_SYMBOL:
+            vm_printf("@%s", op->u.sym->name);
+            break;
+        case MIR_STRING:
+            vm_printf("\"%s\"", op->u.str->data);
+            break;
+        default:
+            vm_printf("?");
+            break;
+    }
+}
+
+// op_name - get the mnemonic of a vm opcode
+static const char* op_name(int code) {
+    otdef_t *def;
+
+    for (def = opcode_table; def->name != NULL; ++def)
+        if (def->code == code)
+            return def->name;
+
+    return "?";
+}
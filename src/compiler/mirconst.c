@@ -0,0 +1,355 @@
+/*
+ * @mirconst.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+// what is known about a register at a point of the function
+typedef enum {
+    CONST_UNDEF,   // no definition reaches it yet
+    CONST_VALUE,   // always holds value
+    CONST_VARYING  // may hold different values
+} ConstKind_t;
+
+typedef struct {
+    uint8_t kind;
+    VMVALUE value;
+} ConstValue_t;
+
+// local function prototypes
+static void const_meet(ConstValue_t *dst, const ConstValue_t *src, int32_t cnt, bool *pChanged);
+static ConstValue_t const_operand(const ConstValue_t *state, const MirOperand_t *op);
+static void const_eval(const ConstValue_t *state, const MirInst_t *inst, ConstValue_t *pValue);
+static bool const_stored(MirBlock_t *blk, int32_t k);
+static bool const_forward(MirBlock_t *blk, int32_t k);
+static void remove_inst(MirBlock_t *blk, int32_t k);
+
+// constprop - replace the registers that hold the same constant on every path by the constant
+bool mir_constprop(MirFunction_t *f) {
+    int32_t n = f->vregCnt, b, k, i, top = 0, *stack;
+    ConstValue_t *in, *state, value;
+    bool changed = false, *exec, *queued;
+
+    in = (ConstValue_t*) calloc((size_t) f->blockCnt * n, sizeof(ConstValue_t));
+    state = (ConstValue_t*) malloc(n * sizeof(ConstValue_t));
+    exec = (bool*) calloc(f->blockCnt, sizeof(bool));
+    queued = (bool*) calloc(f->blockCnt, sizeof(bool));
+    stack = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+
+    // a load of a global variable stored earlier in the block gets the stored value
+    for (b = 0; b < f->blockCnt; ++b)
+        if (!f->blocks[b].dead)
+            for (k = 0; k < f->blocks[b].cnt; ++k)
+                if (const_forward(&f->blocks[b], k))
+                    changed = true;
+
+    // the frame clears the locals, the arguments and the temporaries are unknown
+    b = f->layout[0];
+    for (i = 0; i < n; ++i) {
+        in[b * n + i].kind = i >= f->argc && i < f->varCnt ? CONST_VALUE : CONST_VARYING;
+        in[b * n + i].value = 0;
+    }
+    exec[b] = queued[b] = true;
+    stack[top++] = b;
+
+    // only the successors a branch can take are executed
+    while (top > 0) {
+        MirBlock_t *blk = &f->blocks[b = stack[--top]];
+        MirInst_t *term;
+
+        queued[b] = false;
+        memcpy(state, &in[b * n], n * sizeof(ConstValue_t));
+        for (k = 0; k < blk->cnt; ++k)
+            if (blk->inst[k].dst >= 0)
+                const_eval(state, &blk->inst[k], &state[blk->inst[k].dst]);
+
+        for (k = 0; k < 2; ++k) {
+            int32_t s = blk->succ[k];
+            bool grown = false;
+
+            if (s < 0)
+                continue;
+            if ((term = mir_term(blk)) != NULL && term->op == MIR_CBR) {
+                value = const_operand(state, &term->a);
+                if (value.kind == CONST_UNDEF || (value.kind == CONST_VALUE && (value.value != 0) != (k == 0)))
+                    continue;
+            }
+
+            if (!exec[s]) {
+                exec[s] = true;
+                memcpy(&in[s * n], state, n * sizeof(ConstValue_t));
+                grown = true;
+            } else
+                const_meet(&in[s * n], state, n, &grown);
+            if (grown && !queued[s]) {
+                queued[s] = true;
+                stack[top++] = s;
+            }
+        }
+    }
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        int32_t keep = -1;
+
+        if (blk->dead || !exec[b])
+            continue;
+
+        // a compare of a counter that ends a block keeps its limit in a register, FOR loops count with FORNEXT
+        if (blk->cnt >= 2 && blk->inst[blk->cnt - 1].op == MIR_CBR) {
+            MirInst_t *cmp = &blk->inst[blk->cnt - 2];
+            if (cmp->op == MIR_BINARY && (cmp->code == OP_LE || cmp->code == OP_GE) && cmp->a.kind == MIR_VREG
+                    && in[b * n + cmp->a.u.vreg].kind == CONST_VARYING && cmp->b.kind == MIR_VREG && cmp->b.u.vreg < f->varCnt)
+                keep = blk->cnt - 2;
+        }
+
+        memcpy(state, &in[b * n], n * sizeof(ConstValue_t));
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i) {
+                if (op->kind != MIR_VREG || state[op->u.vreg].kind != CONST_VALUE)
+                    continue;
+                if ((k == keep && op == &inst->b) || (inst->op == MIR_CALL && op == &inst->a))
+                    continue;
+                value = state[op->u.vreg];
+                memset(op, 0, sizeof(*op));
+                op->kind = MIR_CONST;
+                op->u.value = value.value;
+                changed = true;
+            }
+            if (inst->dst >= 0)
+                const_eval(state, inst, &state[inst->dst]);
+        }
+    }
+
+    free(stack);
+    free(queued);
+    free(exec);
+    free(state);
+    free(in);
+    return changed;
+}
+
+// dse - remove the assignments to registers that are not read before they are assigned again or the function returns
+bool mir_dse(MirFunction_t *f) {
+    int32_t n = f->vregCnt, b, k, i;
+    bool changed = false, grown, *in, *live;
+
+    in = (bool*) calloc((size_t) f->blockCnt * n, sizeof(bool));
+    live = (bool*) malloc(n * sizeof(bool));
+
+    // the registers live at the start of every block, nothing is live after a return
+    do {
+        grown = false;
+        for (b = f->blockCnt; --b >= 0; ) {
+            MirBlock_t *blk = &f->blocks[b];
+
+            if (blk->dead)
+                continue;
+
+            memset(live, 0, n * sizeof(bool));
+            for (k = 0; k < 2; ++k)
+                if (blk->succ[k] >= 0)
+                    for (i = 0; i < n; ++i)
+                        live[i] |= in[blk->succ[k] * n + i];
+            for (k = blk->cnt; --k >= 0; ) {
+                MirInst_t *inst = &blk->inst[k];
+                MirOperand_t *op;
+                if (inst->dst >= 0)
+                    live[inst->dst] = false;
+                for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                    if (op->kind == MIR_VREG)
+                        live[op->u.vreg] = true;
+            }
+            for (i = 0; i < n; ++i)
+                if (live[i] && !in[b * n + i])
+                    in[b * n + i] = grown = true;
+        }
+    } while (grown);
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+
+        if (blk->dead)
+            continue;
+
+        memset(live, 0, n * sizeof(bool));
+        for (k = 0; k < 2; ++k)
+            if (blk->succ[k] >= 0)
+                for (i = 0; i < n; ++i)
+                    live[i] |= in[blk->succ[k] * n + i];
+
+        for (k = blk->cnt; --k >= 0; ) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+
+            if (inst->dst >= 0 && !live[inst->dst]) {
+                // a call is still made for its side effects
+                if (inst->op == MIR_CALL)
+                    inst->dst = -1;
+                else {
+                    remove_inst(blk, k);
+                    changed = true;
+                    continue;
+                }
+                changed = true;
+            }
+
+            // a store to a global variable that is stored again before anything can read it
+            if (inst->op == MIR_STORE && const_stored(blk, k)) {
+                remove_inst(blk, k);
+                changed = true;
+                continue;
+            }
+
+            if (inst->dst >= 0)
+                live[inst->dst] = false;
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                if (op->kind == MIR_VREG)
+                    live[op->u.vreg] = true;
+        }
+    }
+
+    free(live);
+    free(in);
+    return changed;
+}
+
+// const_meet - merge the registers reaching a block from another predecessor
+static void const_meet(ConstValue_t *dst, const ConstValue_t *src, int32_t cnt, bool *pChanged) {
+    int32_t i;
+
+    for (i = 0; i < cnt; ++i) {
+        if (src[i].kind == CONST_UNDEF || dst[i].kind == CONST_VARYING)
+            continue;
+        if (dst[i].kind == CONST_UNDEF)
+            dst[i] = src[i];
+        else if (src[i].kind == CONST_VARYING || src[i].value != dst[i].value)
+            dst[i].kind = CONST_VARYING;
+        else
+            continue;
+        *pChanged = true;
+    }
+}
+
+// const_operand - get what is known about an operand
+static ConstValue_t const_operand(const ConstValue_t *state, const MirOperand_t *op) {
+    ConstValue_t value;
+
+    value.value = 0;
+    switch (op->kind) {
+        case MIR_CONST:
+            value.kind = CONST_VALUE;
+            value.value = op->u.value;
+            break;
+        case MIR_VREG:
+            value = state[op->u.vreg];
+            break;
+        default:
+            value.kind = CONST_VARYING;
+            break;
+    }
+
+    return value;
+}
+
+// const_eval - get what is known about the result of an instruction
+static void const_eval(const ConstValue_t *state, const MirInst_t *inst, ConstValue_t *pValue) {
+    ConstValue_t a, b;
+
+    pValue->kind = CONST_VARYING;
+    pValue->value = 0;
+
+    switch (inst->op) {
+        case MIR_MOV:
+            *pValue = const_operand(state, &inst->a);
+            break;
+        case MIR_UNARY:
+        case MIR_BINARY:
+            a = const_operand(state, &inst->a);
+            b = inst->op == MIR_BINARY ? const_operand(state, &inst->b) : a;
+            if (a.kind == CONST_UNDEF || b.kind == CONST_UNDEF)
+                pValue->kind = CONST_UNDEF;
+            else if (a.kind == CONST_VALUE && b.kind == CONST_VALUE && mir_fold(inst->code, a.value, b.value, &pValue->value))
+                pValue->kind = CONST_VALUE;
+            break;
+    }
+}
+
+// const_stored - check whether the global variable stored by the k-th instruction is stored again before it can be read
+static bool const_stored(MirBlock_t *blk, int32_t k) {
+    Symbol_t *sym;
+    int32_t n;
+
+    if (blk->inst[k].b.kind != MIR_SYMBOL)
+        return false;
+    sym = blk->inst[k].b.u.sym;
+
+    for (n = k + 1; n < blk->cnt; ++n) {
+        MirInst_t *inst = &blk->inst[n];
+        if (inst->op == MIR_STORE && inst->b.kind == MIR_SYMBOL && inst->b.u.sym == sym)
+            return true;
+        if (inst->op == MIR_LOAD || inst->op == MIR_CALL || inst->op >= MIR_BR)
+            return false;
+    }
+
+    return false;
+}
+
+// const_forward - turn the k-th instruction into a copy of the value stored by an earlier one when it loads it again
+static bool const_forward(MirBlock_t *blk, int32_t k) {
+    MirInst_t *load = &blk->inst[k];
+    int32_t n;
+
+    if (load->op != MIR_LOAD || load->a.kind != MIR_SYMBOL)
+        return false;
+
+    for (n = k - 1; n >= 0; --n) {
+        MirInst_t *inst = &blk->inst[n];
+        if (inst->op == MIR_STORE && inst->b.kind == MIR_SYMBOL && inst->b.u.sym == load->a.u.sym) {
+            MirOperand_t value = inst->a;
+            int32_t m;
+
+            // a register has to hold the same value at the load
+            if (value.kind == MIR_VREG)
+                for (m = n + 1; m < k; ++m)
+                    if (blk->inst[m].dst == value.u.vreg)
+                        return false;
+            load->op = MIR_MOV;
+            load->a = value;
+            memset(&load->b, 0, sizeof(load->b));
+            return true;
+        }
+        if (inst->op == MIR_CALL || (inst->op == MIR_STORE && inst->b.kind != MIR_SYMBOL))
+            return false;
+    }
+
+    return false;
+}
+
+// remove_inst - remove an instruction from a block
+static void remove_inst(MirBlock_t *blk, int32_t k) {
+    free(blk->inst[k].args);
+    memmove(&blk->inst[k], &blk->inst[k + 1], (blk->cnt - k - 1) * sizeof(MirInst_t));
+    --blk->cnt;
+}
@@ -0,0 +1,389 @@
+/*
+ * @mirgen.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+// register state while generating stack code
+typedef struct MirGen_s {
+    GenerateContext_t *g;
+        MirFunction_t *f;
+              int32_t *uses;   // number of uses of each register
+              int32_t *defs;   // number of definitions of each register
+              int32_t *block;  // block of the single definition and use, -1 if they differ
+                 bool *stack;  // the value stays on the vm stack between its definition and its use
+              int32_t *slot;   // frame offset of each register kept in the frame
+} MirGen_t;
+
+// local function prototypes
+static void stack_analyze(MirGen_t *gen);
+static bool is_commutative(int code);
+static bool stack_block(MirGen_t *gen, MirBlock_t *blk, int32_t *pending);
+static void gen_inst(MirGen_t *gen, MirInst_t *inst);
+static void gen_push(MirGen_t *gen, MirOperand_t *op);
+static void gen_result(MirGen_t *gen, int32_t dst);
+static void gen_branch(MirGen_t *gen, int op, int32_t target);
+static void gen_fornext(MirGen_t *gen, int32_t var, int32_t limit, VMVALUE step, int32_t target);
+static int32_t next_block(MirFunction_t *f, int32_t n);
+
+// generate stack code for a function, false if its frame doesn't fit the instruction formats
+bool mir_generate(GenerateContext_t *g, MirFunction_t *f) {
+    int32_t locals = f->varCnt - f->argc, n, v;
+    MirGen_t gen;
+    bool ok;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.g = g;
+    gen.f = f;
+    gen.uses = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.defs = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.block = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.stack = (bool*) calloc(f->vregCnt, sizeof(bool));
+    gen.slot = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+
+    stack_analyze(&gen);
+
+    // arguments are above the frame pointer, locals and the temporaries kept in the frame below it
+    for (v = 0; v < f->vregCnt; ++v) {
+        if (v < f->argc)
+            gen.slot[v] = v;
+        else if (v < f->varCnt || (!gen.stack[v] && gen.uses[v] > 0))
+            gen.slot[v] = -F_SIZE - 1 - locals++;
+    }
+
+    // LREF and LSET take a signed byte offset
+    if ((ok = f->argc <= 127 && F_SIZE + 1 + locals <= 128)) {
+        for (n = 0; n < f->blockCnt; ++n) {
+            f->blocks[n].addr = -1;
+            f->blocks[n].fixups = 0;
+        }
+
+        putcbyte(g, OP_FRAME);
+        putcbyte(g, F_SIZE + locals);
+
+        for (n = 0; n < f->layoutCnt; ++n) {
+            MirBlock_t *blk = &f->blocks[f->layout[n]];
+            int32_t next = next_block(f, n);
+            MirInst_t *term;
+            int32_t k, t, var, limit;
+            VMVALUE step;
+
+            if (blk->dead)
+                continue;
+
+            blk->addr = codeaddr(g);
+            fixupbranch(g, blk->fixups, blk->addr);
+
+            // the back edge of a counted FOR loop is a single FORNEXT
+            t = mir_fornext(blk, &var, &limit, &step);
+            if (t >= 0 && (gen.uses[t] != 1 || gen.stack[var] || gen.stack[limit]))
+                t = -1;
+
+            for (k = 0; k < blk->cnt - (t >= 0 ? 3 : 1); ++k)
+                gen_inst(&gen, &blk->inst[k]);
+
+            if (t >= 0) {
+                gen_fornext(&gen, var, limit, step, blk->succ[0]);
+                if (blk->succ[1] != next)
+                    gen_branch(&gen, OP_BR, blk->succ[1]);
+                continue;
+            }
+
+            term = &blk->inst[blk->cnt - 1];
+            switch (term->op) {
+                case MIR_BR:
+                    if (blk->succ[0] != next)
+                        gen_branch(&gen, OP_BR, blk->succ[0]);
+                    break;
+                case MIR_CBR:
+                    gen_push(&gen, &term->a);
+                    if (blk->succ[1] == next)
+                        gen_branch(&gen, OP_BRT, blk->succ[0]);
+                    else if (blk->succ[0] == next)
+                        gen_branch(&gen, OP_BRF, blk->succ[1]);
+                    else {
+                        gen_branch(&gen, OP_BRT, blk->succ[0]);
+                        gen_branch(&gen, OP_BR, blk->succ[1]);
+                    }
+                    break;
+                case MIR_RET:
+                    gen_push(&gen, &term->a);
+                    putcbyte(g, OP_RETURN);
+                    break;
+                case MIR_RETZ:
+                    putcbyte(g, OP_RETURNZ);
+                    break;
+                case MIR_HALT:
+                    putcbyte(g, OP_HALT);
+                    break;
+            }
+        }
+    }
+
+    free(gen.uses);
+    free(gen.defs);
+    free(gen.block);
+    free(gen.stack);
+    free(gen.slot);
+    return ok;
+}
+
+// stack_analyze - find the temporaries that can stay on the vm stack from their definition to their use
+static void stack_analyze(MirGen_t *gen) {
+    MirFunction_t *f = gen->f;
+    int32_t b, k, i, *pending;
+
+    for (b = 0; b < f->vregCnt; ++b)
+        gen->block[b] = -1;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i) {
+                if (op->kind == MIR_VREG) {
+                    ++gen->uses[op->u.vreg];
+                    gen->block[op->u.vreg] = gen->block[op->u.vreg] == -1 || gen->block[op->u.vreg] == b ? b : -2;
+                }
+            }
+            if (inst->dst >= 0) {
+                ++gen->defs[inst->dst];
+                gen->block[inst->dst] = gen->block[inst->dst] == -1 || gen->block[inst->dst] == b ? b : -2;
+            }
+        }
+    }
+
+    // candidates are temporaries defined and used once in the same block
+    for (b = 0; b < f->vregCnt; ++b)
+        gen->stack[b] = b >= f->varCnt && gen->defs[b] == 1 && gen->uses[b] == 1 && gen->block[b] >= 0;
+
+    // a candidate is only left on the stack when pushed first, swap the operands of commutative operations
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            if (inst->op == MIR_BINARY && is_commutative(inst->code) && inst->b.kind == MIR_VREG && gen->stack[inst->b.u.vreg]
+                    && !(inst->a.kind == MIR_VREG && gen->stack[inst->a.u.vreg])) {
+                MirOperand_t t = inst->a;
+                inst->a = inst->b;
+                inst->b = t;
+            }
+        }
+    }
+
+    // drop the candidates whose uses don't match the stack order until every block works out
+    pending = (int32_t*) malloc((f->vregCnt + 1) * sizeof(int32_t));
+    for (b = 0; b < f->blockCnt; ++b)
+        if (!f->blocks[b].dead)
+            while (!stack_block(gen, &f->blocks[b], pending))
+                ;
+    free(pending);
+}
+
+// is_commutative - check for an operation whose operands can be swapped
+static bool is_commutative(int code) {
+    switch (code) {
+        case OP_ADD:
+        case OP_MUL:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_EQ:
+        case OP_NE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// stack_block - simulate the vm stack over a block, false after dropping a candidate that doesn't fit
+static bool stack_block(MirGen_t *gen, MirBlock_t *blk, int32_t *pending) {
+    int32_t sp = 0, k, i, m;
+
+    for (k = 0; k < blk->cnt; ++k) {
+        MirInst_t *inst = &blk->inst[k];
+        MirOperand_t *op;
+        bool ok = true;
+
+        // the stacked operands must be the first ones pushed and be on top in the same order
+        for (i = m = 0; (op = mir_operand(inst, i)) != NULL; ++i) {
+            if (op->kind == MIR_VREG && gen->stack[op->u.vreg]) {
+                if (i != m++)
+                    ok = false;
+            }
+        }
+        if (ok && m > sp)
+            ok = false;
+        for (i = 0; ok && i < m; ++i)
+            if (pending[sp - m + i] != mir_operand(inst, i)->u.vreg)
+                ok = false;
+
+        if (!ok) {
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                if (op->kind == MIR_VREG)
+                    gen->stack[op->u.vreg] = false;
+            return false;
+        }
+
+        sp -= m;
+        if (inst->dst >= 0 && gen->stack[inst->dst])
+            pending[sp++] = inst->dst;
+    }
+
+    // anything left over was used before it was defined
+    if (sp > 0) {
+        while (--sp >= 0)
+            gen->stack[pending[sp]] = false;
+        return false;
+    }
+
+    return true;
+}
+
+// gen_inst - generate code for an instruction that is not a terminator
+static void gen_inst(MirGen_t *gen, MirInst_t *inst) {
+    GenerateContext_t *g = gen->g;
+    int32_t k;
+
+    switch (inst->op) {
+        case MIR_MOV:
+            gen_push(gen, &inst->a);
+            break;
+        case MIR_UNARY:
+            gen_push(gen, &inst->a);
+            putcbyte(g, inst->code);
+            break;
+        case MIR_BINARY:
+            gen_push(gen, &inst->a);
+            gen_push(gen, &inst->b);
+            putcbyte(g, inst->code);
+            break;
+        case MIR_LOAD:
+            gen_push(gen, &inst->a);
+            putcbyte(g, OP_LOAD);
+            break;
+        case MIR_STORE:
+            gen_push(gen, &inst->a);
+            gen_push(gen, &inst->b);
+            putcbyte(g, OP_STORE);
+            return;
+        case MIR_INDEX:
+            gen_push(gen, &inst->a);
+            gen_push(gen, &inst->b);
+            putcbyte(g, OP_INDEX);
+            break;
+        case MIR_CALL:
+            for (k = 0; k < inst->argc; ++k)
+                gen_push(gen, &inst->args[k]);
+            gen_push(gen, &inst->a);
+            putcbyte(g, OP_CALL);
+            if (inst->argc > 0) {
+                putcbyte(g, OP_CLEAN);
+                putcbyte(g, inst->argc);
+            }
+            break;
+    }
+
+    gen_result(gen, inst->dst);
+}
+
+// gen_push - push an operand, a stacked temporary is already there
+static void gen_push(MirGen_t *gen, MirOperand_t *op) {
+    GenerateContext_t *g = gen->g;
+
+    switch (op->kind) {
+        case MIR_VREG:
+            if (!gen->stack[op->u.vreg]) {
+                putcbyte(g, OP_LREF);
+                putcbyte(g, gen->slot[op->u.vreg]);
+            }
+            break;
+        case MIR_CONST:
+            if (op->u.value >= -128 && op->u.value <= 127) {
+                putcbyte(g, OP_SLIT);
+                putcbyte(g, op->u.value);
+            } else {
+                putcbyte(g, OP_LIT);
+                putcword(g, op->u.value);
+            }
+            break;
+        case MIR_SYMBOL:
+            code_symbolRef(g, op->u.sym);
+            break;
+        case MIR_STRING:
+            putcbyte(g, OP_LIT);
+            code_stringWord(g, op->u.str);
+            break;
+    }
+}
+
+// gen_result - dispose of the value left by an instruction
+static void gen_result(MirGen_t *gen, int32_t dst) {
+    GenerateContext_t *g = gen->g;
+
+    if (dst >= 0 && gen->stack[dst])
+        return;
+
+    if (dst < 0 || (dst >= gen->f->varCnt && gen->uses[dst] == 0))
+        putcbyte(g, OP_DROP);
+    else {
+        putcbyte(g, OP_LSET);
+        putcbyte(g, gen->slot[dst]);
+    }
+}
+
+// gen_branch - generate a branch to a block, forward branches are chained until the block is placed
+static void gen_branch(MirGen_t *gen, int op, int32_t target) {
+    GenerateContext_t *g = gen->g;
+    MirBlock_t *blk = &gen->f->blocks[target];
+
+    putcbyte(g, op);
+    if (blk->addr >= 0)
+        putcword(g, blk->addr - (codeaddr(g) + sizeof(VMVALUE)));
+    else
+        blk->fixups = putcword(g, blk->fixups);
+}
+
+// gen_fornext - generate a FORNEXT that branches back to a block while the loop runs
+static void gen_fornext(MirGen_t *gen, int32_t var, int32_t limit, VMVALUE step, int32_t target) {
+    GenerateContext_t *g = gen->g;
+    MirBlock_t *blk = &gen->f->blocks[target];
+
+    putcbyte(g, OP_FORNEXT);
+    putcbyte(g, gen->slot[var]);
+    putcbyte(g, gen->slot[limit]);
+    putcbyte(g, step);
+    if (blk->addr >= 0)
+        putcword(g, blk->addr - (codeaddr(g) + sizeof(VMVALUE)));
+    else
+        blk->fixups = putcword(g, blk->fixups);
+}
+
+// next_block - get the live block placed after the n-th one, -1 at the end
+static int32_t next_block(MirFunction_t *f, int32_t n) {
+    while (++n < f->layoutCnt)
+        if (!f->blocks[f->layout[n]].dead)
+            return f->layout[n];
+    return -1;
+}
@@ -0,0 +1,313 @@
+/*
+ * @mirinline.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "compile.h"
+#include "mir.h"
+
+#define MIR_INLINE_SIZE   16  // largest body that is inlined, in instructions
+#define MIR_INLINE_VREGS  96  // registers a function may grow to by inlining, the frame offsets are signed bytes
+
+// optimized body of a function that can be inlined
+typedef struct MirInline_s {
+    struct MirInline_s *next;
+       ParseTreeNode_t *node;
+              Symbol_t *sym;
+         MirFunction_t *f;    // NULL when the function is too large to inline
+                   int order; // position of the function among the used functions, callees come first
+                  bool done;  // false while a worker thread generates the function
+} MirInline_t;
+
+// the functions generated so far in the current compile, shared by the worker threads
+static MirInline_t *inlines = NULL;
+static pthread_mutex_t inlineLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inlineDone = PTHREAD_COND_INITIALIZER;
+
+// local function prototypes
+static bool inline_size(MirFunction_t *f);
+static MirInline_t* find_entry(ParseTreeNode_t *node);
+static MirFunction_t* find_inline(MirFunction_t *f, Symbol_t *sym);
+static void inline_call(MirFunction_t *f, int32_t pos, int32_t k, MirFunction_t *callee);
+static MirInst_t* inline_emit(MirFunction_t *f, int32_t b, int op);
+static void inline_rename(MirOperand_t *op, int32_t base);
+
+// forget the functions of the previous compile
+void mir_inline_reset(void) {
+    MirInline_t *entry;
+
+    while ((entry = inlines) != NULL) {
+        inlines = entry->next;
+        mir_free(entry->f);
+        free(entry);
+    }
+}
+
+// announce a function that a worker thread will generate, the functions that call it wait for its body
+void mir_inline_expect(ParseTreeNode_t *node) {
+    MirInline_t *entry;
+
+    if (!(entry = (MirInline_t*) calloc(1, sizeof(MirInline_t))))
+        return;
+    entry->node = node;
+    entry->sym = node->u.functionDefinition.symbol;
+    entry->order = node->u.functionDefinition.order;
+    pthread_mutex_lock(&inlineLock);
+    entry->next = inlines;
+    inlines = entry;
+    pthread_mutex_unlock(&inlineLock);
+}
+
+// keep the body of a small function for inlining into the ones that call it, true if it took f
+bool mir_inline_register(MirFunction_t *f) {
+    ParseTreeNode_t *node = f->node;
+    MirInline_t *entry;
+    bool keep;
+
+    if (node->u.functionDefinition.symbol == NULL)
+        return false;
+    keep = !node->u.functionDefinition.noInline && inline_size(f);
+
+    pthread_mutex_lock(&inlineLock);
+    if ((entry = find_entry(node)) == NULL && keep && (entry = (MirInline_t*) calloc(1, sizeof(MirInline_t))) != NULL) {
+        entry->node = node;
+        entry->sym = node->u.functionDefinition.symbol;
+        entry->order = node->u.functionDefinition.order;
+        entry->next = inlines;
+        inlines = entry;
+    }
+    if (entry) {
+        entry->f = keep ? f : NULL;
+        entry->done = true;
+        pthread_cond_broadcast(&inlineDone);
+    }
+    pthread_mutex_unlock(&inlineLock);
+
+    return keep && entry;
+}
+
+// release the functions waiting for a function generated without a body to inline
+void mir_inline_finish(ParseTreeNode_t *node) {
+    MirInline_t *entry;
+
+    pthread_mutex_lock(&inlineLock);
+    if ((entry = find_entry(node)) != NULL && !entry->done) {
+        entry->done = true;
+        pthread_cond_broadcast(&inlineDone);
+    }
+    pthread_mutex_unlock(&inlineLock);
+}
+
+// inline_size - check for a body small enough to inline that doesn't call itself
+static bool inline_size(MirFunction_t *f) {
+    Symbol_t *sym = f->node->u.functionDefinition.symbol;
+    int32_t b, k, size = 0;
+
+    // a recursive function would be copied into itself
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < blk->cnt; ++k)
+            if (blk->inst[k].op == MIR_CALL && blk->inst[k].a.kind == MIR_SYMBOL && blk->inst[k].a.u.sym == sym)
+                return false;
+        size += blk->cnt;
+    }
+
+    return size <= MIR_INLINE_SIZE;
+}
+
+// find_entry - find the entry of a function definition, the caller holds the lock
+static MirInline_t* find_entry(ParseTreeNode_t *node) {
+    MirInline_t *entry;
+
+    for (entry = inlines; entry != NULL; entry = entry->next)
+        if (entry->node == node)
+            return entry;
+
+    return NULL;
+}
+
+// inline - replace the calls to small functions with a copy of their body
+bool mir_inline(MirFunction_t *f) {
+    MirFunction_t *callee;
+    bool changed = false;
+    int32_t n, k;
+
+    for (n = 0; n < f->layoutCnt; ++n) {
+        MirBlock_t *blk = &f->blocks[f->layout[n]];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            if (inst->op != MIR_CALL || inst->a.kind != MIR_SYMBOL || !(callee = find_inline(f, inst->a.u.sym)))
+                continue;
+            if (callee->argc != inst->argc || f->vregCnt + callee->vregCnt > MIR_INLINE_VREGS)
+                continue;
+
+            // the rest of the block moved to a new one, the next layout entries are the copy
+            inline_call(f, n, k, callee);
+            changed = true;
+            break;
+        }
+    }
+
+    return changed;
+}
+
+// find_inline - get the body of an inlinable function generated before f, NULL if there is none
+static MirFunction_t* find_inline(MirFunction_t *f, Symbol_t *sym) {
+    MirInline_t *entry;
+    MirFunction_t *callee = NULL;
+
+    pthread_mutex_lock(&inlineLock);
+    for (entry = inlines; entry != NULL; entry = entry->next)
+        if (entry->sym == sym && entry->order < f->node->u.functionDefinition.order)
+            break;
+
+    // a function generated by another thread is waited for, it was started before this one
+    if (entry) {
+        while (!entry->done)
+            pthread_cond_wait(&inlineDone, &inlineLock);
+        callee = entry->f;
+    }
+    pthread_mutex_unlock(&inlineLock);
+
+    return callee;
+}
+
+// inline_call - replace the k-th instruction of the block at layout position pos with a copy of a function
+static void inline_call(MirFunction_t *f, int32_t pos, int32_t k, MirFunction_t *callee) {
+    int32_t b = f->layout[pos], base = f->vregCnt, cont, *map, n, i, j, cnt = 0;
+    MirInst_t call = f->blocks[b].inst[k], *inst;
+    MirBlock_t *blk;
+
+    f->vregCnt += callee->vregCnt;
+
+    // the instructions after the call continue in a new block
+    cont = mir_new_block(f);
+    blk = &f->blocks[b];
+    for (i = k + 1; i < blk->cnt; ++i)
+        *mir_insert(f, &f->blocks[cont]) = blk->inst[i];
+    f->blocks[cont].succ[0] = blk->succ[0];
+    f->blocks[cont].succ[1] = blk->succ[1];
+    blk->cnt = k;
+
+    // the arguments are pushed last first, the locals start at zero
+    for (j = 0; j < callee->varCnt; ++j) {
+        inst = inline_emit(f, b, MIR_MOV);
+        inst->dst = base + j;
+        if (j < callee->argc)
+            inst->a = call.args[call.argc - 1 - j];
+        else {
+            inst->a.kind = MIR_CONST;
+            inst->a.u.value = 0;
+        }
+    }
+    free(call.args);
+
+    map = (int32_t*) malloc(callee->blockCnt * sizeof(int32_t));
+    if (map == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    for (n = 0; n < callee->blockCnt; ++n)
+        map[n] = callee->blocks[n].dead ? -1 : mir_new_block(f);
+
+    inline_emit(f, b, MIR_BR);
+    f->blocks[b].succ[0] = map[callee->layout[0]];
+    f->blocks[b].succ[1] = -1;
+
+    for (n = 0; n < callee->blockCnt; ++n) {
+        MirBlock_t *src = &callee->blocks[n];
+        if (src->dead)
+            continue;
+
+        for (i = 0; i < src->cnt; ++i) {
+            MirInst_t *from = &src->inst[i];
+
+            // a return stores the result and continues after the call
+            if (from->op == MIR_RET || from->op == MIR_RETZ) {
+                if (call.dst >= 0) {
+                    inst = inline_emit(f, map[n], MIR_MOV);
+                    inst->dst = call.dst;
+                    if (from->op == MIR_RET) {
+                        inst->a = from->a;
+                        inline_rename(&inst->a, base);
+                    } else {
+                        inst->a.kind = MIR_CONST;
+                        inst->a.u.value = 0;
+                    }
+                }
+                inline_emit(f, map[n], MIR_BR);
+                f->blocks[map[n]].succ[0] = cont;
+                continue;
+            }
+
+            inst = mir_insert(f, &f->blocks[map[n]]);
+            *inst = *from;
+            if (inst->dst >= 0)
+                inst->dst += base;
+            inline_rename(&inst->a, base);
+            inline_rename(&inst->b, base);
+            if (from->argc > 0) {
+                inst->args = (MirOperand_t*) malloc(from->argc * sizeof(MirOperand_t));
+                if (inst->args == NULL)
+                    vm_system_abort(f->sys, "insufficient memory");
+                for (j = 0; j < from->argc; ++j) {
+                    inst->args[j] = from->args[j];
+                    inline_rename(&inst->args[j], base);
+                }
+            }
+        }
+
+        for (j = 0; j < 2; ++j)
+            if (src->succ[j] >= 0)
+                f->blocks[map[n]].succ[j] = map[src->succ[j]];
+    }
+
+    // place the copy in the callee order between the call and its continuation
+    for (n = 0; n < callee->layoutCnt; ++n)
+        if (map[callee->layout[n]] >= 0)
+            ++cnt;
+    ++cnt;
+    memmove(&f->layout[pos + 1 + cnt], &f->layout[pos + 1], (f->layoutCnt - pos - 1) * sizeof(int32_t));
+    for (i = pos + 1, n = 0; n < callee->layoutCnt; ++n)
+        if (map[callee->layout[n]] >= 0)
+            f->layout[i++] = map[callee->layout[n]];
+    f->layout[i] = cont;
+    f->layoutCnt += cnt;
+
+    free(map);
+}
+
+// inline_emit - add an instruction at the end of a block
+static MirInst_t* inline_emit(MirFunction_t *f, int32_t b, int op) {
+    MirInst_t *inst = mir_insert(f, &f->blocks[b]);
+
+    memset(inst, 0, sizeof(MirInst_t));
+    inst->op = op;
+    inst->dst = -1;
+    return inst;
+}
+
+// inline_rename - move a register of the callee into the registers added to the caller
+static void inline_rename(MirOperand_t *op, int32_t base) {
+    if (op->kind == MIR_VREG)
+        op->u.vreg += base;
+}
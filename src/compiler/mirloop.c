@@ -0,0 +1,736 @@
+/*
+ * @mirloop.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+#define MIR_UNROLL_SIZE 64 // instructions an unrolled loop may grow to
+#define MIR_UNROLL_MAX  8  // largest number of copies of a body a loop that stays runs on each pass
+
+// control flow of a function, rebuilt after every change
+typedef struct MirLoop_s {
+    MirFunction_t *f;
+          int32_t *order;     // reachable blocks in reverse postorder
+          int32_t cnt;
+          int32_t *rpo;       // position of every block in order, -1 if it can't be reached
+          int32_t *idom;      // immediate dominator of every block
+          int32_t *predFirst; // predecessors of block b are preds[predFirst[b]] to preds[predFirst[b + 1] - 1]
+          int32_t *preds;
+          int32_t *defs;      // definitions of every register in the function
+          int32_t *inner;     // definitions of every register inside the loop being optimized
+             bool *body;      // blocks of the loop being optimized
+             bool clobber;    // the loop calls a function or stores through a computed address
+} MirLoop_t;
+
+// local function prototypes
+static void loop_analyze(MirLoop_t *l);
+static void loop_release(MirLoop_t *l);
+static bool loop_dominates(MirLoop_t *l, int32_t a, int32_t b);
+static int32_t loop_body(MirLoop_t *l, int32_t h);
+static bool loop_optimize(MirLoop_t *l, int32_t h);
+static bool loop_invariant(MirLoop_t *l, MirOperand_t *op);
+static bool loop_hoistable(MirLoop_t *l, MirInst_t *inst);
+static bool loop_stored(MirLoop_t *l, Symbol_t *sym);
+static bool loop_reduce(MirLoop_t *l, int32_t h, MirInst_t *index);
+static int32_t loop_preheader(MirLoop_t *l, int32_t h);
+static MirInst_t* loop_insert(MirFunction_t *f, MirBlock_t *blk, int32_t k);
+static bool loop_unroll(MirLoop_t *l, int32_t h);
+static bool loop_entry_value(MirBlock_t *blk, int32_t vreg, VMVALUE *pValue);
+static int32_t* loop_copy(MirLoop_t *l, int32_t *list, int32_t cnt, int32_t pos);
+static void loop_chain(MirFunction_t *f, int32_t latch, int32_t next);
+
+// licm - move loop invariant instructions to the loop preheaders and reduce array indexing to pointer increments
+bool mir_licm(MirFunction_t *f) {
+    MirLoop_t l;
+    int32_t n, h, best, size, bestSize;
+    bool changed = false, *done;
+
+    memset(&l, 0, sizeof(l));
+    l.f = f;
+
+    // every change reshapes the function, start over until the loops are left alone
+    for (;;) {
+        loop_analyze(&l);
+        done = (bool*) calloc(f->blockCnt, sizeof(bool));
+        if (done == NULL)
+            vm_system_abort(f->sys, "insufficient memory");
+
+        // inner loops first, their preheaders are in the body of the enclosing loop
+        for (;;) {
+            best = -1;
+            bestSize = 0;
+            for (n = 0; n < l.cnt; ++n) {
+                h = l.order[n];
+                if (done[h] || (size = loop_body(&l, h)) == 0)
+                    continue;
+                if (best < 0 || size < bestSize) {
+                    best = h;
+                    bestSize = size;
+                }
+            }
+            if (best < 0)
+                break;
+            done[best] = true;
+            loop_body(&l, best);
+            if (loop_optimize(&l, best))
+                break;
+        }
+
+        free(done);
+        loop_release(&l);
+        if (best < 0)
+            break;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// unroll - copy the bodies of FOR loops that run a known number of times, all of them when the loop is small
+bool mir_unroll(MirFunction_t *f) {
+    int32_t n = 0, h, doneCnt = 0;
+    bool changed = false, *done = NULL;
+    MirLoop_t l;
+
+    // the copies would be unrolled again on every round
+    if (f->unrolled)
+        return false;
+    f->unrolled = true;
+
+    memset(&l, 0, sizeof(l));
+    l.f = f;
+
+    for (;;) {
+        loop_analyze(&l);
+        done = (bool*) realloc(done, f->blockCnt * sizeof(bool));
+        if (done == NULL)
+            vm_system_abort(f->sys, "insufficient memory");
+        memset(&done[doneCnt], 0, (f->blockCnt - doneCnt) * sizeof(bool));
+        doneCnt = f->blockCnt;
+
+        for (n = 0; n < l.cnt; ++n) {
+            h = l.order[n];
+            if (done[h] || loop_body(&l, h) == 0)
+                continue;
+            done[h] = true;
+            if (loop_unroll(&l, h))
+                break;
+        }
+
+        loop_release(&l);
+        if (n >= l.cnt)
+            break;
+        changed = true;
+    }
+
+    free(done);
+    return changed;
+}
+
+// loop_analyze - find the predecessors, the reverse postorder and the dominators of the blocks
+static void loop_analyze(MirLoop_t *l) {
+    MirFunction_t *f = l->f;
+    int32_t b, k, n, s, p, top, *stack, *next, *fill;
+    bool changed;
+
+    l->rpo = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    l->idom = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    l->order = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    l->predFirst = (int32_t*) calloc(f->blockCnt + 1, sizeof(int32_t));
+    l->body = (bool*) calloc(f->blockCnt + 1, sizeof(bool)); // a preheader added later is outside
+    l->defs = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    l->inner = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    if (l->rpo == NULL || l->idom == NULL || l->order == NULL || l->predFirst == NULL || l->body == NULL
+            || (f->vregCnt > 0 && (l->defs == NULL || l->inner == NULL)))
+        vm_system_abort(f->sys, "insufficient memory");
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < 2; ++k)
+            if (blk->succ[k] >= 0)
+                ++l->predFirst[blk->succ[k] + 1];
+        for (k = 0; k < blk->cnt; ++k)
+            if (blk->inst[k].dst >= 0)
+                ++l->defs[blk->inst[k].dst];
+    }
+    for (b = 0; b < f->blockCnt; ++b)
+        l->predFirst[b + 1] += l->predFirst[b];
+    l->preds = (int32_t*) malloc((l->predFirst[f->blockCnt] + 1) * sizeof(int32_t));
+    fill = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    if (l->preds == NULL || fill == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    memcpy(fill, l->predFirst, f->blockCnt * sizeof(int32_t));
+    for (b = 0; b < f->blockCnt; ++b) {
+        if (f->blocks[b].dead)
+            continue;
+        for (k = 0; k < 2; ++k)
+            if ((s = f->blocks[b].succ[k]) >= 0)
+                l->preds[fill[s]++] = b;
+    }
+    free(fill);
+
+    // depth first walk from the entry, a block is numbered once all its successors are done
+    stack = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    next = (int32_t*) calloc(f->blockCnt, sizeof(int32_t));
+    if (stack == NULL || next == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    for (b = 0; b < f->blockCnt; ++b)
+        l->rpo[b] = -1;
+    n = f->blockCnt;
+    top = 0;
+    stack[top++] = f->layout[0];
+    l->rpo[f->layout[0]] = 0;
+    while (top > 0) {
+        b = stack[top - 1];
+        if (next[b] < 2) {
+            s = f->blocks[b].succ[next[b]++];
+            if (s >= 0 && l->rpo[s] < 0) {
+                l->rpo[s] = 0;
+                stack[top++] = s;
+            }
+            continue;
+        }
+        l->order[--n] = b;
+        --top;
+    }
+    l->cnt = f->blockCnt - n;
+    memmove(l->order, &l->order[n], l->cnt * sizeof(int32_t));
+    for (n = 0; n < l->cnt; ++n)
+        l->rpo[l->order[n]] = n;
+    free(stack);
+    free(next);
+
+    // the dominators are refined in reverse postorder until they settle
+    for (b = 0; b < f->blockCnt; ++b)
+        l->idom[b] = -1;
+    l->idom[l->order[0]] = l->order[0];
+    do {
+        changed = false;
+        for (n = 1; n < l->cnt; ++n) {
+            int32_t d = -1;
+            b = l->order[n];
+            for (k = l->predFirst[b]; k < l->predFirst[b + 1]; ++k) {
+                if (l->idom[p = l->preds[k]] < 0)
+                    continue;
+                if (d < 0)
+                    d = p;
+                else {
+                    while (d != p) {
+                        while (l->rpo[d] > l->rpo[p])
+                            d = l->idom[d];
+                        while (l->rpo[p] > l->rpo[d])
+                            p = l->idom[p];
+                    }
+                }
+            }
+            if (l->idom[b] != d) {
+                l->idom[b] = d;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+// loop_release - free the control flow information
+static void loop_release(MirLoop_t *l) {
+    free(l->order);
+    free(l->rpo);
+    free(l->idom);
+    free(l->predFirst);
+    free(l->preds);
+    free(l->body);
+    free(l->defs);
+    free(l->inner);
+}
+
+// loop_dominates - check whether every path from the entry to block b goes through block a
+static bool loop_dominates(MirLoop_t *l, int32_t a, int32_t b) {
+    while (b != a) {
+        if (b == l->order[0] || l->idom[b] < 0)
+            return false;
+        b = l->idom[b];
+    }
+    return true;
+}
+
+// loop_body - mark the blocks of the natural loop with header h, zero if no back edge enters h
+static int32_t loop_body(MirLoop_t *l, int32_t h) {
+    MirFunction_t *f = l->f;
+    int32_t k, b, p, top = 0, size = 0, *stack;
+
+    memset(l->body, 0, f->blockCnt * sizeof(bool));
+    stack = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    if (stack == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+
+    // the blocks that reach a back edge without going through the header
+    for (k = l->predFirst[h]; k < l->predFirst[h + 1]; ++k) {
+        p = l->preds[k];
+        if (l->rpo[p] >= 0 && loop_dominates(l, h, p)) {
+            if (!l->body[h]) {
+                l->body[h] = true;
+                ++size;
+            }
+            if (!l->body[p]) {
+                l->body[p] = true;
+                stack[top++] = p;
+            }
+        }
+    }
+    while (top > 0) {
+        b = stack[--top];
+        ++size;
+        for (k = l->predFirst[b]; k < l->predFirst[b + 1]; ++k) {
+            p = l->preds[k];
+            if (l->rpo[p] >= 0 && !l->body[p]) {
+                l->body[p] = true;
+                stack[top++] = p;
+            }
+        }
+    }
+
+    free(stack);
+    return size;
+}
+
+// loop_optimize - hoist the invariant instructions of a loop and reduce its indexing, true if anything changed
+static bool loop_optimize(MirLoop_t *l, int32_t h) {
+    MirFunction_t *f = l->f;
+    int32_t n, k, pre = -1;
+    bool changed = false;
+
+    memset(l->inner, 0, f->vregCnt * sizeof(int32_t));
+    l->clobber = false;
+    for (n = 0; n < f->layoutCnt; ++n) {
+        MirBlock_t *blk = &f->blocks[f->layout[n]];
+        if (blk->dead || !l->body[f->layout[n]])
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            if (inst->dst >= 0)
+                ++l->inner[inst->dst];
+            if (inst->op == MIR_CALL || (inst->op == MIR_STORE && inst->b.kind != MIR_SYMBOL))
+                l->clobber = true;
+        }
+    }
+
+    // an instruction moves once its operands are defined outside the loop, the ones it feeds may follow
+    for (n = 0; n < f->layoutCnt; ++n) {
+        int32_t b = f->layout[n];
+        if (f->blocks[b].dead || !l->body[b])
+            continue;
+        for (k = 0; k < f->blocks[b].cnt; ++k) {
+            MirInst_t inst = f->blocks[b].inst[k];
+            MirBlock_t *blk;
+
+            if (!loop_hoistable(l, &inst))
+                continue;
+            if (pre < 0)
+                pre = loop_preheader(l, h);
+            blk = &f->blocks[b];
+            memmove(&blk->inst[k], &blk->inst[k + 1], (blk->cnt - k - 1) * sizeof(MirInst_t));
+            --blk->cnt;
+            *loop_insert(f, &f->blocks[pre], f->blocks[pre].cnt - 1) = inst;
+            --l->inner[inst.dst];
+            changed = true;
+            n = -1;
+            break;
+        }
+    }
+    if (changed)
+        return true;
+
+    for (n = 0; n < f->layoutCnt; ++n) {
+        int32_t b = f->layout[n];
+        if (f->blocks[b].dead || !l->body[b])
+            continue;
+        for (k = 0; k < f->blocks[b].cnt; ++k)
+            if (f->blocks[b].inst[k].op == MIR_INDEX && loop_reduce(l, h, &f->blocks[b].inst[k]))
+                return true;
+    }
+
+    return false;
+}
+
+// loop_invariant - check for an operand that has the same value on every pass through the loop
+static bool loop_invariant(MirLoop_t *l, MirOperand_t *op) {
+    return op->kind != MIR_VREG || l->inner[op->u.vreg] == 0;
+}
+
+// loop_hoistable - check for an instruction that can run once before the loop
+static bool loop_hoistable(MirLoop_t *l, MirInst_t *inst) {
+    MirOperand_t *op;
+    int i;
+
+    // only temporaries have a single definition that dominates their uses
+    if (inst->dst < l->f->varCnt || l->defs[inst->dst] != 1)
+        return false;
+
+    switch (inst->op) {
+        case MIR_BINARY:
+            // a division moved ahead of a loop that never runs could still overflow
+            if ((inst->code == OP_DIV || inst->code == OP_REM) && (inst->b.kind != MIR_CONST || inst->b.u.value == -1))
+                return false;
+            break;
+        case MIR_MOV:
+        case MIR_UNARY:
+        case MIR_INDEX:
+            break;
+        case MIR_LOAD:
+            // a global that nothing in the loop can write, other loads could fault when moved
+            if (inst->a.kind != MIR_SYMBOL || l->clobber || loop_stored(l, inst->a.u.sym))
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+        if (!loop_invariant(l, op))
+            return false;
+
+    return true;
+}
+
+// loop_stored - check whether the loop stores into a global
+static bool loop_stored(MirLoop_t *l, Symbol_t *sym) {
+    MirFunction_t *f = l->f;
+    int32_t b, k;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead || !l->body[b])
+            continue;
+        for (k = 0; k < blk->cnt; ++k)
+            if (blk->inst[k].op == MIR_STORE && blk->inst[k].b.kind == MIR_SYMBOL && blk->inst[k].b.u.sym == sym)
+                return true;
+    }
+
+    return false;
+}
+
+// loop_reduce - turn the indexing by a counter into a pointer stepped along with it
+static bool loop_reduce(MirLoop_t *l, int32_t h, MirInst_t *index) {
+    MirFunction_t *f = l->f;
+    MirOperand_t base = index->a, ctr = index->b;
+    MirInst_t *inst, *step = NULL;
+    int32_t b, k, stepBlock = -1, stepPos = -1, pre, p;
+    VMVALUE inc;
+
+    if (index->dst < f->varCnt || l->defs[index->dst] != 1 || !loop_invariant(l, &base))
+        return false;
+    if (ctr.kind != MIR_VREG || l->inner[ctr.u.vreg] != 1)
+        return false;
+
+    // the counter changes only by a constant
+    for (b = 0; b < f->blockCnt && step == NULL; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead || !l->body[b])
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            if (blk->inst[k].dst == ctr.u.vreg) {
+                step = &blk->inst[k];
+                stepBlock = b;
+                stepPos = k;
+                break;
+            }
+        }
+    }
+    if (step == NULL || step->op != MIR_BINARY || step->code != OP_ADD || step->a.kind != MIR_VREG
+            || step->a.u.vreg != ctr.u.vreg || step->b.kind != MIR_CONST)
+        return false;
+    inc = (VMVALUE) ((VMUVALUE) step->b.u.value * sizeof(VMVALUE));
+
+    // the pointer starts at the element of the counter on entry
+    pre = loop_preheader(l, h);
+    p = mir_new_vreg(f);
+    inst = loop_insert(f, &f->blocks[pre], f->blocks[pre].cnt - 1);
+    memset(inst, 0, sizeof(MirInst_t));
+    inst->op = MIR_INDEX;
+    inst->dst = p;
+    inst->a = base;
+    inst->b = ctr;
+
+    // every indexing of the same element reads the pointer
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead || !l->body[b])
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            inst = &blk->inst[k];
+            if (inst->op == MIR_INDEX && mir_same_operand(&inst->a, &base) && mir_same_operand(&inst->b, &ctr)) {
+                inst->op = MIR_MOV;
+                inst->a.kind = MIR_VREG;
+                inst->a.u.vreg = p;
+                memset(&inst->b, 0, sizeof(inst->b));
+            }
+        }
+    }
+
+    // the pointer steps just before the counter so the end of the block still ends the loop
+    inst = loop_insert(f, &f->blocks[stepBlock], stepPos);
+    memset(inst, 0, sizeof(MirInst_t));
+    inst->op = MIR_BINARY;
+    inst->code = OP_ADD;
+    inst->dst = p;
+    inst->a.kind = MIR_VREG;
+    inst->a.u.vreg = p;
+    inst->b.kind = MIR_CONST;
+    inst->b.u.value = inc;
+
+    return true;
+}
+
+// loop_preheader - get the block that enters the loop from outside, adding one if there is none
+static int32_t loop_preheader(MirLoop_t *l, int32_t h) {
+    MirFunction_t *f = l->f;
+    int32_t k, n, p, pre = -1, outside = 0;
+    MirInst_t *inst;
+
+    for (k = l->predFirst[h]; k < l->predFirst[h + 1]; ++k) {
+        if (!l->body[p = l->preds[k]]) {
+            pre = p;
+            ++outside;
+        }
+    }
+
+    // a single predecessor outside the loop that always branches to the header
+    if (outside == 1 && h != f->layout[0] && f->blocks[pre].succ[1] < 0 && mir_term(&f->blocks[pre])
+            && mir_term(&f->blocks[pre])->op == MIR_BR)
+        return pre;
+
+    pre = mir_new_block(f);
+    inst = mir_insert(f, &f->blocks[pre]);
+    memset(inst, 0, sizeof(MirInst_t));
+    inst->op = MIR_BR;
+    inst->dst = -1;
+    f->blocks[pre].succ[0] = h;
+
+    for (k = l->predFirst[h]; k < l->predFirst[h + 1]; ++k) {
+        MirBlock_t *blk = &f->blocks[l->preds[k]];
+        if (l->body[l->preds[k]])
+            continue;
+        for (n = 0; n < 2; ++n)
+            if (blk->succ[n] == h)
+                blk->succ[n] = pre;
+    }
+
+    // placed right before the header, the function entry when the loop starts the function
+    for (n = 0; n < f->layoutCnt && f->layout[n] != h; ++n)
+        ;
+    memmove(&f->layout[n + 1], &f->layout[n], (f->layoutCnt - n) * sizeof(int32_t));
+    f->layout[n] = pre;
+    ++f->layoutCnt;
+
+    return pre;
+}
+
+// loop_insert - open a slot for an instruction at position k of a block
+static MirInst_t* loop_insert(MirFunction_t *f, MirBlock_t *blk, int32_t k) {
+    mir_insert(f, blk);
+    memmove(&blk->inst[k + 1], &blk->inst[k], (blk->cnt - k - 1) * sizeof(MirInst_t));
+    return &blk->inst[k];
+}
+
+// loop_unroll - unroll an inner FOR loop with constant bounds, true if it was changed
+static bool loop_unroll(MirLoop_t *l, int32_t h) {
+    MirFunction_t *f = l->f;
+    int32_t k, n, b, s, i, latch = -1, pre = -1, out, var, limit, size = 0, cnt = 0, factor, peel, last, pos;
+    int32_t *list, **maps;
+    int64_t trips;
+    VMVALUE step, start, end;
+
+    // the only back edge comes from the end of the FOR loop, the loop is entered from one block
+    for (k = l->predFirst[h]; k < l->predFirst[h + 1]; ++k) {
+        int32_t *which = l->body[l->preds[k]] ? &latch : &pre;
+        if (*which >= 0)
+            return false;
+        *which = l->preds[k];
+    }
+    if (latch < 0 || pre < 0 || mir_fornext(&f->blocks[latch], &var, &limit, &step) < 0 || step == 0)
+        return false;
+    if (f->blocks[latch].succ[0] != h || l->body[out = f->blocks[latch].succ[1]])
+        return false;
+
+    // an inner loop whose counter changes only at the end and whose limit doesn't change
+    memset(l->inner, 0, f->vregCnt * sizeof(int32_t));
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead || !l->body[b])
+            continue;
+        for (k = 0; k < 2; ++k)
+            if ((s = blk->succ[k]) >= 0 && l->body[s] && l->rpo[s] <= l->rpo[b] && !(b == latch && s == h))
+                return false;
+        for (k = 0; k < blk->cnt; ++k)
+            if (blk->inst[k].dst >= 0)
+                ++l->inner[blk->inst[k].dst];
+        size += blk->cnt;
+        ++cnt;
+    }
+    if (l->inner[var] != 1 || l->inner[limit] != 0)
+        return false;
+
+    // the counter and the limit are set to constants just before the loop
+    if (!loop_entry_value(&f->blocks[pre], var, &start) || !loop_entry_value(&f->blocks[pre], limit, &end))
+        return false;
+    if (step > 0)
+        trips = start <= end ? ((int64_t) end - start) / step + 1 : 1;
+    else
+        trips = start >= end ? ((int64_t) start - end) / -step + 1 : 1;
+
+    // small loops are replaced by their copies, larger ones run several copies per pass after a few peeled ones
+    if (trips * size <= MIR_UNROLL_SIZE) {
+        factor = (int32_t) trips;
+        peel = 0;
+    } else {
+        for (factor = MIR_UNROLL_MAX; factor > 1; --factor)
+            if (trips / factor >= 2 && (factor + trips % factor) * size <= MIR_UNROLL_SIZE)
+                break;
+        if (factor < 2)
+            return false;
+        peel = (int32_t) (trips % factor);
+    }
+
+    // the body in code order, the copies follow it
+    list = (int32_t*) malloc(cnt * sizeof(int32_t));
+    if (list == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    for (n = 0, i = 0, pos = -1; n < f->layoutCnt; ++n) {
+        if (!f->blocks[f->layout[n]].dead && l->body[f->layout[n]]) {
+            list[i++] = f->layout[n];
+            pos = n;
+        }
+    }
+    maps = (int32_t**) malloc((factor + peel) * sizeof(int32_t*));
+    if (maps == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    for (i = 1; i < factor; ++i, pos += cnt)
+        maps[i] = loop_copy(l, list, cnt, pos + 1);
+
+    // the peeled copies go before the header
+    for (pos = 0; f->layout[pos] != h; ++pos)
+        ;
+    for (i = 0; i < peel; ++i, pos += cnt)
+        maps[factor + i] = loop_copy(l, list, cnt, pos);
+
+    // every copy but the one that closes the loop goes on to the next one
+    last = latch;
+    for (i = 1; i < factor; ++i) {
+        loop_chain(f, last, maps[i][h]);
+        last = maps[i][latch];
+    }
+    if (factor == trips)
+        loop_chain(f, last, out);
+    else
+        f->blocks[last].succ[0] = h;
+
+    if (peel > 0) {
+        for (k = 0; k < 2; ++k)
+            if (f->blocks[pre].succ[k] == h)
+                f->blocks[pre].succ[k] = maps[factor][h];
+        for (i = 0; i < peel; ++i)
+            loop_chain(f, maps[factor + i][latch], i + 1 < peel ? maps[factor + i + 1][h] : h);
+    }
+
+    for (i = 1; i < factor + peel; ++i)
+        free(maps[i]);
+    free(maps);
+    free(list);
+    return true;
+}
+
+// loop_entry_value - get the constant a block leaves in a register, false if it doesn't set one
+static bool loop_entry_value(MirBlock_t *blk, int32_t vreg, VMVALUE *pValue) {
+    int32_t k;
+
+    for (k = blk->cnt; --k >= 0; ) {
+        MirInst_t *inst = &blk->inst[k];
+        if (inst->dst != vreg)
+            continue;
+        if (inst->op != MIR_MOV || inst->a.kind != MIR_CONST)
+            return false;
+        *pValue = inst->a.u.value;
+        return true;
+    }
+
+    return false;
+}
+
+// loop_copy - copy the blocks of a loop body into the layout at position pos, the map from the body to the copy
+static int32_t* loop_copy(MirLoop_t *l, int32_t *list, int32_t cnt, int32_t pos) {
+    MirFunction_t *f = l->f;
+    int32_t *map, n, k, j, s;
+
+    map = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    if (map == NULL)
+        vm_system_abort(f->sys, "insufficient memory");
+    for (n = 0; n < f->blockCnt; ++n)
+        map[n] = -1;
+    for (n = 0; n < cnt; ++n)
+        map[list[n]] = mir_new_block(f);
+
+    for (n = 0; n < cnt; ++n) {
+        MirBlock_t *src = &f->blocks[list[n]], *dst = &f->blocks[map[list[n]]];
+
+        for (k = 0; k < src->cnt; ++k) {
+            MirInst_t *inst = mir_insert(f, dst);
+            src = &f->blocks[list[n]];
+            *inst = src->inst[k];
+            if (inst->argc > 0) {
+                inst->args = (MirOperand_t*) malloc(inst->argc * sizeof(MirOperand_t));
+                if (inst->args == NULL)
+                    vm_system_abort(f->sys, "insufficient memory");
+                for (j = 0; j < inst->argc; ++j)
+                    inst->args[j] = src->inst[k].args[j];
+            }
+        }
+
+        // the edges inside the body stay inside the copy, the others leave the loop as before
+        for (k = 0; k < 2; ++k)
+            if ((s = src->succ[k]) >= 0)
+                dst->succ[k] = map[s] >= 0 ? map[s] : s;
+    }
+
+    memmove(&f->layout[pos + cnt], &f->layout[pos], (f->layoutCnt - pos) * sizeof(int32_t));
+    for (n = 0; n < cnt; ++n)
+        f->layout[pos + n] = map[list[n]];
+    f->layoutCnt += cnt;
+
+    return map;
+}
+
+// loop_chain - end a copy of the body after its counter steps and go on to another block
+static void loop_chain(MirFunction_t *f, int32_t latch, int32_t next) {
+    MirBlock_t *blk = &f->blocks[latch];
+
+    // the compare and the branch that follow the step
+    blk->cnt -= 2;
+    blk->inst[blk->cnt].op = MIR_BR;
+    blk->inst[blk->cnt].code = 0;
+    blk->inst[blk->cnt].dst = -1;
+    memset(&blk->inst[blk->cnt].a, 0, sizeof(MirOperand_t));
+    memset(&blk->inst[blk->cnt].b, 0, sizeof(MirOperand_t));
+    ++blk->cnt;
+    blk->succ[0] = next;
+    blk->succ[1] = -1;
+}
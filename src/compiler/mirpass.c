@@ -0,0 +1,606 @@
+/*
+ * @mirpass.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+// maximum number of times the pass list is run over a function
+#define MIR_MAXROUNDS 8
+
+// maximum number of empty blocks a branch is threaded through
+#define MIR_MAXTHREAD 8
+
+// local function prototypes
+static bool pass_cfg(MirFunction_t *f);
+static bool pass_fold(MirFunction_t *f);
+static bool pass_copyprop(MirFunction_t *f);
+static bool pass_cse(MirFunction_t *f);
+static bool pass_dce(MirFunction_t *f);
+static int32_t* count_uses(MirFunction_t *f, int32_t *defs);
+static void remove_inst(MirBlock_t *blk, int32_t k);
+static void set_mov(MirInst_t *inst, MirOperand_t a);
+static bool is_vreg(const MirOperand_t *op, int32_t vreg);
+static bool is_const(const MirOperand_t *op, VMVALUE value);
+static bool is_commutative(int code);
+static bool same_value(const MirInst_t *a, const MirInst_t *b);
+static bool may_alias(const MirInst_t *store, const MirInst_t *load);
+
+// passes in the order they run, each one is enabled from its level up
+static MirPass_t passes[] = {
+        { "inline"   , 1, mir_inline    },
+        { "cfg"      , 1, pass_cfg      },
+        { "fold"     , 1, pass_fold     },
+        { "constprop", 1, mir_constprop },
+        { "copyprop" , 1, pass_copyprop },
+        { "cse"      , 1, pass_cse      },
+        { "licm"     , 2, mir_licm      },
+        { "unroll"   , 2, mir_unroll    },
+        { "dce"      , 1, pass_dce      },
+        { "dse"      , 1, mir_dse       },
+        { NULL       , 0, NULL          }
+};
+
+// run the passes enabled at an optimization level until nothing changes
+void mir_optimize(MirFunction_t *f, int level) {
+    MirPass_t *pass;
+    bool changed;
+    int round;
+
+    for (round = 0; round < MIR_MAXROUNDS; ++round) {
+        changed = false;
+        for (pass = passes; pass->name != NULL; ++pass)
+            if (level >= pass->level && (*pass->run)(f))
+                changed = true;
+        if (!changed)
+            break;
+    }
+}
+
+// evaluate a unary or binary operation the way the vm does, false if it can't be done at compile time
+bool mir_fold(int code, VMVALUE a, VMVALUE b, VMVALUE *pValue) {
+    VMUVALUE ua = (VMUVALUE) a, ub = (VMUVALUE) b;
+
+    switch (code) {
+        case OP_NOT:
+            *pValue = a ? VMFALSE : VMTRUE;
+            break;
+        case OP_NEG:
+            *pValue = (VMVALUE) (0 - ua);
+            break;
+        case OP_BNOT:
+            *pValue = ~a;
+            break;
+        case OP_ADD:
+            *pValue = (VMVALUE) (ua + ub);
+            break;
+        case OP_SUB:
+            *pValue = (VMVALUE) (ua - ub);
+            break;
+        case OP_MUL:
+            *pValue = (VMVALUE) (ua * ub);
+            break;
+        case OP_DIV:
+        case OP_REM:
+            // the vm divides by zero to zero, the overflowing case is left to run time
+            if (b == -1 && a == (VMVALUE) ((VMUVALUE) 1 << (sizeof(VMVALUE) * 8 - 1)))
+                return false;
+            *pValue = b == 0 ? 0 : code == OP_DIV ? a / b : a % b;
+            break;
+        case OP_BAND:
+            *pValue = a & b;
+            break;
+        case OP_BOR:
+            *pValue = a | b;
+            break;
+        case OP_BXOR:
+            *pValue = a ^ b;
+            break;
+        case OP_SHL:
+            if (b < 0 || b >= (VMVALUE) (sizeof(VMVALUE) * 8))
+                return false;
+            *pValue = (VMVALUE) (ua << b);
+            break;
+        case OP_SHR:
+            if (b < 0 || b >= (VMVALUE) (sizeof(VMVALUE) * 8))
+                return false;
+            *pValue = a >> b;
+            break;
+        case OP_LT:
+            *pValue = a < b ? VMTRUE : VMFALSE;
+            break;
+        case OP_LE:
+            *pValue = a <= b ? VMTRUE : VMFALSE;
+            break;
+        case OP_EQ:
+            *pValue = a == b ? VMTRUE : VMFALSE;
+            break;
+        case OP_NE:
+            *pValue = a != b ? VMTRUE : VMFALSE;
+            break;
+        case OP_GE:
+            *pValue = a >= b ? VMTRUE : VMFALSE;
+            break;
+        case OP_GT:
+            *pValue = a > b ? VMTRUE : VMFALSE;
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// pass_cfg - fold constant branches, thread branches through empty blocks, drop unreachable blocks and merge straight lines
+static bool pass_cfg(MirFunction_t *f) {
+    int32_t b, k, n, *stack;
+    bool changed = false;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        MirInst_t *term;
+
+        if (blk->dead || !(term = mir_term(blk)))
+            continue;
+
+        // a conditional branch on a constant or to a single target
+        if (term->op == MIR_CBR && (term->a.kind == MIR_CONST || blk->succ[0] == blk->succ[1])) {
+            if (term->a.kind == MIR_CONST && !term->a.u.value)
+                blk->succ[0] = blk->succ[1];
+            blk->succ[1] = -1;
+            term->op = MIR_BR;
+            memset(&term->a, 0, sizeof(term->a));
+            changed = true;
+        }
+
+        // skip blocks that only branch somewhere else
+        for (k = 0; k < 2; ++k) {
+            for (n = 0; n < MIR_MAXTHREAD && blk->succ[k] >= 0; ++n) {
+                MirBlock_t *target = &f->blocks[blk->succ[k]];
+                if (target->cnt != 1 || target->inst[0].op != MIR_BR || target->succ[0] == blk->succ[k])
+                    break;
+                blk->succ[k] = target->succ[0];
+                changed = true;
+            }
+        }
+    }
+
+    // everything not reachable from the entry block is dead
+    stack = (int32_t*) malloc(f->blockCnt * sizeof(int32_t));
+    for (b = 0; b < f->blockCnt; ++b)
+        f->blocks[b].predCnt = -1;
+    n = 0;
+    stack[n++] = f->layout[0];
+    f->blocks[f->layout[0]].predCnt = 0;
+    while (n > 0) {
+        MirBlock_t *blk = &f->blocks[stack[--n]];
+        for (k = 0; k < 2; ++k) {
+            if (blk->succ[k] >= 0 && f->blocks[blk->succ[k]].predCnt < 0) {
+                f->blocks[blk->succ[k]].predCnt = 0;
+                stack[n++] = blk->succ[k];
+            }
+        }
+    }
+    free(stack);
+    for (b = 0; b < f->blockCnt; ++b) {
+        if (!f->blocks[b].dead && f->blocks[b].predCnt < 0) {
+            f->blocks[b].dead = true;
+            changed = true;
+        }
+    }
+
+    // append a block to its only predecessor when that one always branches to it
+    mir_preds(f);
+    for (n = 0; n < f->layoutCnt; ++n) {
+        MirBlock_t *blk = &f->blocks[f->layout[n]];
+        MirBlock_t *next;
+        MirInst_t *term;
+
+        if (blk->dead)
+            continue;
+
+        while ((term = mir_term(blk)) != NULL && term->op == MIR_BR && blk->succ[0] != f->layout[0]
+                && (next = &f->blocks[blk->succ[0]]) != blk && next->predCnt == 1) {
+            --blk->cnt;
+            for (k = 0; k < next->cnt; ++k)
+                *mir_insert(f, blk) = next->inst[k];
+            blk->succ[0] = next->succ[0];
+            blk->succ[1] = next->succ[1];
+            next->cnt = 0;
+            next->dead = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// pass_fold - evaluate operations on constants and drop identity operations
+static bool pass_fold(MirFunction_t *f) {
+    bool changed = false;
+    int32_t b, k;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+
+        if (blk->dead)
+            continue;
+
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t value;
+            VMVALUE result;
+
+            memset(&value, 0, sizeof(value));
+            value.kind = MIR_CONST;
+
+            switch (inst->op) {
+                case MIR_UNARY:
+                    if (inst->a.kind == MIR_CONST && mir_fold(inst->code, inst->a.u.value, 0, &result)) {
+                        value.u.value = result;
+                        set_mov(inst, value);
+                        changed = true;
+                    }
+                    break;
+                case MIR_BINARY:
+                    if (inst->a.kind == MIR_CONST && inst->b.kind == MIR_CONST) {
+                        if (mir_fold(inst->code, inst->a.u.value, inst->b.u.value, &result)) {
+                            value.u.value = result;
+                            set_mov(inst, value);
+                            changed = true;
+                        }
+                        break;
+                    }
+
+                    // x + 0, x - 0, x * 1, x / 1, x | 0, x ^ 0 and shifts by 0 are x
+                    switch (inst->code) {
+                        case OP_ADD:
+                        case OP_BOR:
+                        case OP_BXOR:
+                            if (is_const(&inst->a, 0)) {
+                                set_mov(inst, inst->b);
+                                changed = true;
+                                break;
+                            }
+                            // fall through
+                        case OP_SUB:
+                        case OP_SHL:
+                        case OP_SHR:
+                            if (is_const(&inst->b, 0)) {
+                                set_mov(inst, inst->a);
+                                changed = true;
+                            }
+                            break;
+                        case OP_MUL:
+                            if (is_const(&inst->a, 0) || is_const(&inst->b, 0)) {
+                                value.u.value = 0;
+                                set_mov(inst, value);
+                                changed = true;
+                            } else if (is_const(&inst->a, 1)) {
+                                set_mov(inst, inst->b);
+                                changed = true;
+                                break;
+                            }
+                            // fall through
+                        case OP_DIV:
+                            if (inst->op == MIR_BINARY && is_const(&inst->b, 1)) {
+                                set_mov(inst, inst->a);
+                                changed = true;
+                            }
+                            break;
+                    }
+                    break;
+                case MIR_INDEX:
+                    if (inst->a.kind == MIR_CONST && inst->b.kind == MIR_CONST) {
+                        value.u.value = (VMVALUE) ((VMUVALUE) inst->a.u.value + (VMUVALUE) inst->b.u.value * sizeof(VMVALUE));
+                        set_mov(inst, value);
+                        changed = true;
+                    } else if (is_const(&inst->b, 0)) {
+                        set_mov(inst, inst->a);
+                        changed = true;
+                    }
+                    break;
+                case MIR_MOV:
+                    if (is_vreg(&inst->a, inst->dst)) {
+                        remove_inst(blk, k--);
+                        changed = true;
+                    }
+                    break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// pass_copyprop - replace temporaries holding constants or copies by their values
+static bool pass_copyprop(MirFunction_t *f) {
+    int32_t *defs = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    int32_t *uses = count_uses(f, defs);
+    bool changed = false;
+    int32_t b, k, n, i;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+
+        if (blk->dead)
+            continue;
+
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            int32_t t = inst->dst;
+            MirOperand_t *op;
+
+            if (t < f->varCnt || defs[t] != 1 || uses[t] == 0)
+                continue;
+
+            // a constant never changes so it replaces every use of the temporary
+            if (inst->op == MIR_MOV && inst->a.kind != MIR_VREG) {
+                int32_t bb;
+                for (bb = 0; bb < f->blockCnt; ++bb) {
+                    MirBlock_t *ublk = &f->blocks[bb];
+                    if (ublk->dead)
+                        continue;
+                    for (n = 0; n < ublk->cnt; ++n)
+                        for (i = 0; (op = mir_operand(&ublk->inst[n], i)) != NULL; ++i)
+                            if (is_vreg(op, t)) {
+                                *op = inst->a;
+                                changed = true;
+                            }
+                }
+                uses[t] = 0;
+                continue;
+            }
+
+            // a copy of a register replaces the uses that follow in the block until it is redefined
+            if (inst->op == MIR_MOV) {
+                int32_t v = inst->a.u.vreg;
+                for (n = k + 1; n < blk->cnt; ++n) {
+                    for (i = 0; (op = mir_operand(&blk->inst[n], i)) != NULL; ++i)
+                        if (is_vreg(op, t)) {
+                            op->u.vreg = v;
+                            --uses[t];
+                            ++uses[v];
+                            changed = true;
+                        }
+                    if (blk->inst[n].dst == v)
+                        break;
+                }
+                continue;
+            }
+
+            // t = ...; v = t becomes v = ... when nothing in between touches v
+            if (uses[t] == 1) {
+                int32_t v = -1, m;
+                for (n = k + 1; n < blk->cnt; ++n) {
+                    MirInst_t *next = &blk->inst[n];
+                    if (next->op == MIR_MOV && is_vreg(&next->a, t)) {
+                        v = next->dst;
+                        break;
+                    }
+                    for (i = 0; (op = mir_operand(next, i)) != NULL; ++i)
+                        if (is_vreg(op, t))
+                            break;
+                    if (op != NULL)
+                        break;
+                }
+                if (v < 0)
+                    continue;
+                for (m = k + 1; m < n; ++m) {
+                    MirInst_t *mid = &blk->inst[m];
+                    if (mid->dst == v)
+                        break;
+                    for (i = 0; (op = mir_operand(mid, i)) != NULL; ++i)
+                        if (is_vreg(op, v))
+                            break;
+                    if (op != NULL)
+                        break;
+                }
+                if (m == n) {
+                    inst->dst = v;
+                    remove_inst(blk, n);
+                    uses[t] = 0;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    free(uses);
+    free(defs);
+    return changed;
+}
+
+// pass_cse - reuse the result of an earlier operation of the block that computes the same value
+static bool pass_cse(MirFunction_t *f) {
+    bool changed = false;
+    int32_t b, k, j, n;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+
+        if (blk->dead)
+            continue;
+
+        for (k = 1; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t value;
+
+            if (inst->op != MIR_UNARY && inst->op != MIR_BINARY && inst->op != MIR_INDEX && inst->op != MIR_LOAD)
+                continue;
+
+            for (j = k - 1; j >= 0; --j) {
+                MirInst_t *prev = &blk->inst[j];
+
+                // nothing in between may change the operands, the result or the memory that is loaded
+                if (prev->dst >= 0 && (is_vreg(&inst->a, prev->dst) || is_vreg(&inst->b, prev->dst)))
+                    break;
+                if (inst->op == MIR_LOAD && (prev->op == MIR_CALL || (prev->op == MIR_STORE && may_alias(prev, inst))))
+                    break;
+                if (prev->dst < 0 || prev->dst == inst->dst || !same_value(prev, inst))
+                    continue;
+                for (n = j + 1; n < k; ++n)
+                    if (blk->inst[n].dst == prev->dst)
+                        break;
+                if (n < k)
+                    continue;
+
+                memset(&value, 0, sizeof(value));
+                value.kind = MIR_VREG;
+                value.u.vreg = prev->dst;
+                set_mov(inst, value);
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// pass_dce - remove operations whose results are never used
+static bool pass_dce(MirFunction_t *f) {
+    bool changed = false, again;
+    int32_t *uses, b, k, i;
+
+    do {
+        again = false;
+        uses = count_uses(f, NULL);
+        for (b = 0; b < f->blockCnt; ++b) {
+            MirBlock_t *blk = &f->blocks[b];
+
+            if (blk->dead)
+                continue;
+
+            for (k = 0; k < blk->cnt; ++k) {
+                MirInst_t *inst = &blk->inst[k];
+                MirOperand_t *op;
+
+                if (inst->dst < 0 || uses[inst->dst] > 0)
+                    continue;
+
+                // a call is still made for its side effects
+                if (inst->op == MIR_CALL) {
+                    inst->dst = -1;
+                    changed = true;
+                    continue;
+                }
+
+                for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                    if (op->kind == MIR_VREG && --uses[op->u.vreg] == 0)
+                        again = true;
+                remove_inst(blk, k--);
+                changed = true;
+            }
+        }
+        free(uses);
+    } while (again);
+
+    return changed;
+}
+
+// count_uses - count the uses and optionally the definitions of every register
+static int32_t* count_uses(MirFunction_t *f, int32_t *defs) {
+    int32_t *uses = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    int32_t b, k, i;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                if (op->kind == MIR_VREG)
+                    ++uses[op->u.vreg];
+            if (defs && inst->dst >= 0)
+                ++defs[inst->dst];
+        }
+    }
+
+    return uses;
+}
+
+// remove_inst - remove an instruction from a block
+static void remove_inst(MirBlock_t *blk, int32_t k) {
+    free(blk->inst[k].args);
+    memmove(&blk->inst[k], &blk->inst[k + 1], (blk->cnt - k - 1) * sizeof(MirInst_t));
+    --blk->cnt;
+}
+
+// set_mov - turn an instruction into a copy of an operand
+static void set_mov(MirInst_t *inst, MirOperand_t a) {
+    inst->op = MIR_MOV;
+    inst->code = 0;
+    inst->a = a;
+    memset(&inst->b, 0, sizeof(inst->b));
+}
+
+// is_vreg - check for a register operand
+static bool is_vreg(const MirOperand_t *op, int32_t vreg) {
+    return op->kind == MIR_VREG && op->u.vreg == vreg;
+}
+
+// is_const - check for a constant operand with a given value
+static bool is_const(const MirOperand_t *op, VMVALUE value) {
+    return op->kind == MIR_CONST && op->u.value == value;
+}
+
+// is_commutative - check for a binary operation whose operands can be swapped
+static bool is_commutative(int code) {
+    switch (code) {
+        case OP_ADD:
+        case OP_MUL:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_EQ:
+        case OP_NE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// same_value - check whether two pure operations compute the same value from the same operands
+static bool same_value(const MirInst_t *a, const MirInst_t *b) {
+    if (a->op != b->op || a->code != b->code)
+        return false;
+    switch (a->op) {
+        case MIR_UNARY:
+        case MIR_LOAD:
+            return mir_same_operand(&a->a, &b->a);
+        case MIR_BINARY:
+        case MIR_INDEX:
+            if (mir_same_operand(&a->a, &b->a) && mir_same_operand(&a->b, &b->b))
+                return true;
+            return a->op == MIR_BINARY && is_commutative(a->code) && mir_same_operand(&a->a, &b->b) && mir_same_operand(&a->b, &b->a);
+        default:
+            return false;
+    }
+}
+
+// may_alias - check whether a store can change the memory a load reads, only two different globals are known apart
+static bool may_alias(const MirInst_t *store, const MirInst_t *load) {
+    if (store->b.kind == MIR_SYMBOL && load->a.kind == MIR_SYMBOL)
+        return store->b.u.sym == load->a.u.sym;
+    return true;
+}
@@ -0,0 +1,498 @@
+/*
+ * @mirreg.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+#include "mir.h"
+
+// registers are frame slots, the arguments above fp and everything else below it
+#define REG_NONE  0x7fffffff
+
+// register state while generating register code
+typedef struct MirReg_s {
+    GenerateContext_t *g;
+        MirFunction_t *f;
+              int32_t *block;  // block holding every occurrence of a temporary, -1 if none, -2 if several
+              int32_t *last;   // index of the last occurrence in its block
+              int32_t *pool;   // slot shared with other block temporaries, -1 if the register has its own
+              int32_t *slot;   // frame offset of each register
+              int32_t fixed;   // number of slots owned by a single register
+              int32_t shared;  // number of slots shared by block temporaries
+              int32_t scratch; // number of slots for operands that are not in a register
+} MirReg_t;
+
+// local function prototypes
+static void reg_scan(MirReg_t *gen);
+static void reg_assign(MirReg_t *gen);
+static int reg_scratch(MirInst_t *inst);
+static bool reg_addi(MirInst_t *inst, int32_t *pReg, VMVALUE *pValue);
+static void reg_inst(MirReg_t *gen, MirInst_t *inst);
+static void reg_load(MirReg_t *gen, int32_t reg, MirOperand_t *op);
+static int32_t reg_operand(MirReg_t *gen, MirOperand_t *op, int scratch);
+static void reg_push(MirReg_t *gen, MirOperand_t *op);
+static void reg_branch(MirReg_t *gen, int op, int32_t reg, int32_t target);
+static void reg_fornext(MirReg_t *gen, int32_t var, int32_t limit, VMVALUE step, int32_t target);
+static int reg_opcode(int code);
+static int32_t next_block(MirFunction_t *f, int32_t n);
+
+// generate register code for a function, false if its frame doesn't fit the instruction formats
+bool mir_generate_reg(GenerateContext_t *g, MirFunction_t *f) {
+    MirReg_t gen;
+    int32_t n;
+    bool ok;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.g = g;
+    gen.f = f;
+    gen.block = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.last = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.pool = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+    gen.slot = (int32_t*) calloc(f->vregCnt, sizeof(int32_t));
+
+    reg_scan(&gen);
+    reg_assign(&gen);
+
+    // register operands are signed byte offsets
+    if ((ok = f->argc <= 127 && F_SIZE + 1 + gen.fixed + gen.shared + gen.scratch <= 128)) {
+        for (n = 0; n < f->blockCnt; ++n) {
+            f->blocks[n].addr = -1;
+            f->blocks[n].fixups = 0;
+        }
+
+        putcbyte(g, OP_FRAME);
+        putcbyte(g, F_SIZE + gen.fixed + gen.shared + gen.scratch);
+
+        for (n = 0; n < f->layoutCnt; ++n) {
+            MirBlock_t *blk = &f->blocks[f->layout[n]];
+            int32_t next = next_block(f, n);
+            MirInst_t *term;
+            int32_t k, r, t, var, limit;
+            VMVALUE step;
+
+            if (blk->dead || blk->cnt == 0)
+                continue;
+
+            blk->addr = codeaddr(g);
+            fixupbranch(g, blk->fixups, blk->addr);
+
+            // the back edge of a counted FOR loop is a single FORNEXT
+            t = mir_fornext(blk, &var, &limit, &step);
+            if (t >= 0 && (gen.block[t] != f->layout[n] || gen.pool[var] >= 0 || gen.slot[var] == REG_NONE
+                    || gen.pool[limit] >= 0 || gen.slot[limit] == REG_NONE))
+                t = -1;
+
+            for (k = 0; k < blk->cnt - (t >= 0 ? 3 : 1); ++k)
+                reg_inst(&gen, &blk->inst[k]);
+
+            if (t >= 0) {
+                reg_fornext(&gen, var, limit, step, blk->succ[0]);
+                if (blk->succ[1] != next)
+                    reg_branch(&gen, OP_BR, -1, blk->succ[1]);
+                continue;
+            }
+
+            term = &blk->inst[blk->cnt - 1];
+            switch (term->op) {
+                case MIR_BR:
+                    if (blk->succ[0] != next)
+                        reg_branch(&gen, OP_BR, -1, blk->succ[0]);
+                    break;
+                case MIR_CBR:
+                    if (term->a.kind == MIR_CONST) {
+                        r = blk->succ[term->a.u.value ? 0 : 1];
+                        if (r != next)
+                            reg_branch(&gen, OP_BR, -1, r);
+                        break;
+                    }
+                    r = reg_operand(&gen, &term->a, 0);
+                    if (blk->succ[1] == next)
+                        reg_branch(&gen, OP_RBRT, r, blk->succ[0]);
+                    else if (blk->succ[0] == next)
+                        reg_branch(&gen, OP_RBRF, r, blk->succ[1]);
+                    else {
+                        reg_branch(&gen, OP_RBRT, r, blk->succ[0]);
+                        reg_branch(&gen, OP_BR, -1, blk->succ[1]);
+                    }
+                    break;
+                case MIR_RET:
+                    if (term->a.kind == MIR_VREG) {
+                        putcbyte(g, OP_RRET);
+                        putcbyte(g, gen.slot[term->a.u.vreg]);
+                    } else {
+                        reg_push(&gen, &term->a);
+                        putcbyte(g, OP_RETURN);
+                    }
+                    break;
+                case MIR_RETZ:
+                    putcbyte(g, OP_RETURNZ);
+                    break;
+                case MIR_HALT:
+                    putcbyte(g, OP_HALT);
+                    break;
+            }
+        }
+    }
+
+    free(gen.block);
+    free(gen.last);
+    free(gen.pool);
+    free(gen.slot);
+    return ok;
+}
+
+// reg_scan - find the temporaries that live inside a single block and where they die
+static void reg_scan(MirReg_t *gen) {
+    MirFunction_t *f = gen->f;
+    int32_t b, k, i, v;
+
+    for (v = 0; v < f->vregCnt; ++v)
+        gen->block[v] = -1;
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+
+            // a temporary read before it is written in the block is live on entry
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i) {
+                if (op->kind != MIR_VREG)
+                    continue;
+                v = op->u.vreg;
+                gen->block[v] = gen->block[v] == b ? b : -2;
+                gen->last[v] = k;
+            }
+            if ((v = inst->dst) >= 0) {
+                gen->block[v] = gen->block[v] == -1 || gen->block[v] == b ? b : -2;
+                gen->last[v] = k;
+            }
+        }
+    }
+}
+
+// reg_assign - give every register a frame slot, block temporaries share them when their lifetimes don't overlap
+static void reg_assign(MirReg_t *gen) {
+    MirFunction_t *f = gen->f;
+    int32_t b, k, i, v, p, *owner;
+    int scratch;
+
+    owner = (int32_t*) malloc((f->vregCnt + 1) * sizeof(int32_t));
+
+    for (v = 0; v < f->vregCnt; ++v) {
+        gen->pool[v] = -1;
+        if (v < f->argc)
+            gen->slot[v] = v;
+        else if (v < f->varCnt || gen->block[v] == -2)
+            gen->slot[v] = -F_SIZE - 1 - gen->fixed++;
+        else
+            gen->slot[v] = REG_NONE;
+    }
+
+    for (b = 0; b < f->blockCnt; ++b) {
+        MirBlock_t *blk = &f->blocks[b];
+        if (blk->dead)
+            continue;
+
+        // every shared slot is free at the start of a block
+        for (p = 0; p < gen->shared; ++p)
+            owner[p] = -1;
+
+        for (k = 0; k < blk->cnt; ++k) {
+            MirInst_t *inst = &blk->inst[k];
+            MirOperand_t *op;
+
+            if ((scratch = reg_scratch(inst)) > gen->scratch)
+                gen->scratch = scratch;
+
+            // the operands are read before the result is written so a dying operand gives its slot to the result
+            for (i = 0; (op = mir_operand(inst, i)) != NULL; ++i)
+                if (op->kind == MIR_VREG && (p = gen->pool[op->u.vreg]) >= 0 && gen->last[op->u.vreg] == k)
+                    owner[p] = -1;
+
+            if ((v = inst->dst) >= 0 && gen->block[v] == b) {
+                if (gen->pool[v] < 0) {
+                    for (p = 0; p < gen->shared && owner[p] >= 0; ++p)
+                        ;
+                    if (p == gen->shared)
+                        owner[gen->shared++] = -1;
+                    gen->pool[v] = p;
+                }
+                owner[gen->pool[v]] = gen->last[v] == k ? -1 : v;
+            }
+        }
+    }
+
+    // the shared slots follow the ones owned by a single register
+    for (v = 0; v < f->vregCnt; ++v)
+        if (gen->pool[v] >= 0)
+            gen->slot[v] = -F_SIZE - 1 - gen->fixed - gen->pool[v];
+
+    free(owner);
+}
+
+// reg_scratch - get the number of operands that have to be loaded into a scratch register
+static int reg_scratch(MirInst_t *inst) {
+    int32_t reg;
+    VMVALUE value;
+
+    switch (inst->op) {
+        case MIR_CBR:
+            // a constant condition is a plain branch
+            return inst->a.kind != MIR_VREG && inst->a.kind != MIR_CONST;
+        case MIR_UNARY:
+        case MIR_LOAD:
+            return inst->a.kind != MIR_VREG;
+        case MIR_BINARY:
+            if (reg_addi(inst, &reg, &value))
+                return 0;
+            // fall through
+        case MIR_STORE:
+        case MIR_INDEX:
+            return (inst->a.kind != MIR_VREG) + (inst->b.kind != MIR_VREG);
+        default:
+            return 0;
+    }
+}
+
+// reg_addi - check for an addition of a short literal to a register
+static bool reg_addi(MirInst_t *inst, int32_t *pReg, VMVALUE *pValue) {
+    if (inst->op != MIR_BINARY)
+        return false;
+
+    if (inst->code == OP_ADD && inst->a.kind == MIR_VREG && inst->b.kind == MIR_CONST) {
+        *pReg = inst->a.u.vreg;
+        *pValue = inst->b.u.value;
+    } else if (inst->code == OP_ADD && inst->a.kind == MIR_CONST && inst->b.kind == MIR_VREG) {
+        *pReg = inst->b.u.vreg;
+        *pValue = inst->a.u.value;
+    } else if (inst->code == OP_SUB && inst->a.kind == MIR_VREG && inst->b.kind == MIR_CONST && inst->b.u.value > -128) {
+        *pReg = inst->a.u.vreg;
+        *pValue = -inst->b.u.value;
+    } else
+        return false;
+
+    return *pValue >= -128 && *pValue <= 127;
+}
+
+// reg_inst - generate code for an instruction that is not a terminator
+static void reg_inst(MirReg_t *gen, MirInst_t *inst) {
+    GenerateContext_t *g = gen->g;
+    int32_t d = inst->dst >= 0 ? gen->slot[inst->dst] : REG_NONE, a, b, k;
+    VMVALUE value;
+
+    switch (inst->op) {
+        case MIR_MOV:
+            if (inst->a.kind != MIR_VREG)
+                reg_load(gen, d, &inst->a);
+            else if ((a = gen->slot[inst->a.u.vreg]) != d) {
+                putcbyte(g, OP_RMOV);
+                putcbyte(g, d);
+                putcbyte(g, a);
+            }
+            break;
+        case MIR_UNARY:
+            a = reg_operand(gen, &inst->a, 0);
+            putcbyte(g, reg_opcode(inst->code));
+            putcbyte(g, d);
+            putcbyte(g, a);
+            break;
+        case MIR_BINARY:
+            if (reg_addi(inst, &a, &value)) {
+                putcbyte(g, OP_RADDI);
+                putcbyte(g, d);
+                putcbyte(g, gen->slot[a]);
+                putcbyte(g, value);
+                break;
+            }
+            // fall through
+        case MIR_INDEX:
+            a = reg_operand(gen, &inst->a, 0);
+            b = reg_operand(gen, &inst->b, inst->a.kind != MIR_VREG);
+            putcbyte(g, inst->op == MIR_INDEX ? OP_RINDEX : reg_opcode(inst->code));
+            putcbyte(g, d);
+            putcbyte(g, a);
+            putcbyte(g, b);
+            break;
+        case MIR_LOAD:
+            a = reg_operand(gen, &inst->a, 0);
+            putcbyte(g, OP_RLOAD);
+            putcbyte(g, d);
+            putcbyte(g, a);
+            break;
+        case MIR_STORE:
+            a = reg_operand(gen, &inst->a, 0);
+            b = reg_operand(gen, &inst->b, inst->a.kind != MIR_VREG);
+            putcbyte(g, OP_RSTORE);
+            putcbyte(g, a);
+            putcbyte(g, b);
+            break;
+        case MIR_CALL:
+            // calls keep the stack convention so both kinds of functions can call each other
+            for (k = 0; k < inst->argc; ++k)
+                reg_push(gen, &inst->args[k]);
+            reg_push(gen, &inst->a);
+            putcbyte(g, OP_CALL);
+            if (inst->argc > 0) {
+                putcbyte(g, OP_CLEAN);
+                putcbyte(g, inst->argc);
+            }
+            if (d == REG_NONE)
+                putcbyte(g, OP_DROP);
+            else {
+                putcbyte(g, OP_LSET);
+                putcbyte(g, d);
+            }
+            break;
+    }
+}
+
+// reg_load - load an operand that is not a register into a register
+static void reg_load(MirReg_t *gen, int32_t reg, MirOperand_t *op) {
+    GenerateContext_t *g = gen->g;
+
+    switch (op->kind) {
+        case MIR_CONST:
+            if (op->u.value >= -128 && op->u.value <= 127) {
+                putcbyte(g, OP_RSLIT);
+                putcbyte(g, reg);
+                putcbyte(g, op->u.value);
+            } else {
+                putcbyte(g, OP_RLIT);
+                putcbyte(g, reg);
+                putcword(g, op->u.value);
+            }
+            break;
+        case MIR_SYMBOL:
+            putcbyte(g, OP_RLIT);
+            putcbyte(g, reg);
+            code_symbolWord(g, op->u.sym);
+            break;
+        case MIR_STRING:
+            putcbyte(g, OP_RLIT);
+            putcbyte(g, reg);
+            code_stringWord(g, op->u.str);
+            break;
+    }
+}
+
+// reg_operand - get the register holding an operand, loading it into the n-th scratch register if needed
+static int32_t reg_operand(MirReg_t *gen, MirOperand_t *op, int scratch) {
+    int32_t reg;
+
+    if (op->kind == MIR_VREG)
+        return gen->slot[op->u.vreg];
+
+    reg = -F_SIZE - 1 - gen->fixed - gen->shared - scratch;
+    reg_load(gen, reg, op);
+    return reg;
+}
+
+// reg_push - push an operand on the vm stack
+static void reg_push(MirReg_t *gen, MirOperand_t *op) {
+    GenerateContext_t *g = gen->g;
+
+    switch (op->kind) {
+        case MIR_VREG:
+            putcbyte(g, OP_LREF);
+            putcbyte(g, gen->slot[op->u.vreg]);
+            break;
+        case MIR_CONST:
+            if (op->u.value >= -128 && op->u.value <= 127) {
+                putcbyte(g, OP_SLIT);
+                putcbyte(g, op->u.value);
+            } else {
+                putcbyte(g, OP_LIT);
+                putcword(g, op->u.value);
+            }
+            break;
+        case MIR_SYMBOL:
+            code_symbolRef(g, op->u.sym);
+            break;
+        case MIR_STRING:
+            putcbyte(g, OP_LIT);
+            code_stringWord(g, op->u.str);
+            break;
+    }
+}
+
+// reg_branch - generate a branch to a block, a register test when reg is not negative
+static void reg_branch(MirReg_t *gen, int op, int32_t reg, int32_t target) {
+    GenerateContext_t *g = gen->g;
+    MirBlock_t *blk = &gen->f->blocks[target];
+
+    putcbyte(g, op);
+    if (op != OP_BR)
+        putcbyte(g, reg);
+    if (blk->addr >= 0)
+        putcword(g, blk->addr - (codeaddr(g) + sizeof(VMVALUE)));
+    else
+        blk->fixups = putcword(g, blk->fixups);
+}
+
+// reg_fornext - generate a FORNEXT that branches back to a block while the loop runs
+static void reg_fornext(MirReg_t *gen, int32_t var, int32_t limit, VMVALUE step, int32_t target) {
+    GenerateContext_t *g = gen->g;
+    MirBlock_t *blk = &gen->f->blocks[target];
+
+    putcbyte(g, OP_FORNEXT);
+    putcbyte(g, gen->slot[var]);
+    putcbyte(g, gen->slot[limit]);
+    putcbyte(g, step);
+    if (blk->addr >= 0)
+        putcword(g, blk->addr - (codeaddr(g) + sizeof(VMVALUE)));
+    else
+        blk->fixups = putcword(g, blk->fixups);
+}
+
+// reg_opcode - get the register form of a stack operation
+static int reg_opcode(int code) {
+    switch (code) {
+        case OP_NOT:  return OP_RNOT;
+        case OP_NEG:  return OP_RNEG;
+        case OP_BNOT: return OP_RBNOT;
+        case OP_ADD:  return OP_RADD;
+        case OP_SUB:  return OP_RSUB;
+        case OP_MUL:  return OP_RMUL;
+        case OP_DIV:  return OP_RDIV;
+        case OP_REM:  return OP_RREM;
+        case OP_BAND: return OP_RBAND;
+        case OP_BOR:  return OP_RBOR;
+        case OP_BXOR: return OP_RBXOR;
+        case OP_SHL:  return OP_RSHL;
+        case OP_SHR:  return OP_RSHR;
+        case OP_LT:   return OP_RLT;
+        case OP_LE:   return OP_RLE;
+        case OP_EQ:   return OP_REQ;
+        case OP_NE:   return OP_RNE;
+        case OP_GE:   return OP_RGE;
+        case OP_GT:   return OP_RGT;
+        default:      return OP_HALT;
+    }
+}
+
+// next_block - get the live block placed after the n-th one, -1 at the end
+static int32_t next_block(MirFunction_t *f, int32_t n) {
+    while (++n < f->layoutCnt)
+        if (!f->blocks[f->layout[n]].dead && f->blocks[f->layout[n]].cnt > 0)
+            return f->layout[n];
+    return -1;
+}
@@ -21,130 +21,236 @@
 #include <stdbool.h>
 
 #include "compile.h"
+#include "ir.h"
 #include "vmdebug.h"
 
 extern int generate_functionCount;
-extern functions_t generate_functions[100];
-
-typedef struct codeString_s {
-    uint32_t pos;
-       char *str;
-} codeString_t;
-
-typedef struct codeGlobal_s {
-    uint32_t pos;
-        char *name;
-        bool placed;
-     VMVALUE value;
-} codeGlobal_t;
-
-typedef struct codeFunction_s {
-       char *name;
-       char **code;
-    uint32_t code_len;
-} codeFunction_t;
-
-typedef struct codeActual_s {
-      codeString_t *strings;
-          uint32_t strings_qty;
-      codeGlobal_t *globals;
-          uint32_t globals_qty;
-    codeFunction_t *functions;
-          uint32_t functions_qty;
-} codeActual_t;
-
-codeActual_t actual;
+extern functions_t *generate_functions;
+
+// reference chain of a symbol that is still unplaced
+typedef struct peepChain_s {
+    Symbol_t *sym;
+     VMVALUE *links;
+    uint32_t cnt;
+} peepChain_t;
+
+static VMVALUE rd_word(const uint8_t *p);
+static void wr_word(uint8_t *p, VMVALUE w);
+static void peephole(ParseContext_t *c);
+static void peep_function(IrFunction_t *f);
 
 void optimize(ParseContext_t *c, bool dump) {
-    uint32_t i, j;
-
-    actual.strings = malloc(sizeof(codeString_t));
-    actual.strings_qty = 0;
-    actual.globals = malloc(sizeof(codeGlobal_t));
-    actual.globals_qty = 0;
-    actual.functions = malloc(sizeof(codeFunction_t));
-    actual.functions_qty = 0;
-
-    // load strings
-    String_t *str = c->strings;
-    if (str) {
-        while (str != NULL) {
-            actual.strings = realloc(actual.strings, (actual.strings_qty + 1) * sizeof(codeString_t));
-            actual.strings[actual.strings_qty].str = strdup(str->data);
-            actual.strings[actual.strings_qty].pos = (VMVALUE) ((uint8_t*) str->data - c->g->codeBuf);
-            ++actual.strings_qty;
-            str = str->next;
-        }
+    IrFunction_t *f;
+    String_t *str;
+    Symbol_t *sym;
+    int i;
+
+    if (!dump) {
+        if (c->g->optLevel > 0)
+            peephole(c);
+        return;
     }
 
-    // load globals
+    vm_printf("STRINGS:\n");
+    for (str = c->strings; str != NULL; str = str->next)
+        vm_printf("  %s\n", str->data);
+
+    vm_printf("\nGLOBALS:\n");
+    for (sym = c->globals.head; sym != NULL; sym = sym->next)
+        vm_printf("  %s: %d(%08x) %s\n", sym->name, sym->value, sym->value, sym->placed ? "(placed)" : "");
+
+    vm_printf("\nFUNCTIONS:\n");
+    for (i = 0; i < generate_functionCount; ++i) {
+        vm_printf("  %s:\n", generate_functions[i].symbol ? generate_functions[i].symbol->name : "<main>");
+        if ((f = ir_build(c->g, &generate_functions[i])) != NULL) {
+            ir_blocks(f);
+            ir_print(f);
+            ir_free(f);
+        } else
+            vm_printf("    <can't decode>\n");
+        vm_printf("\n");
+    }
+}
+
+// rd_word - read a big endian code word
+static VMVALUE rd_word(const uint8_t *p) {
+    VMUVALUE w = 0;
+    int cnt = sizeof(VMVALUE);
+    while (--cnt >= 0)
+        w = (w << 8) | *p++;
+    return w;
+}
+
+// wr_word - write a big endian code word
+static void wr_word(uint8_t *p, VMVALUE w) {
+    int cnt = sizeof(VMVALUE);
+    p += sizeof(VMVALUE);
+    while (--cnt >= 0) {
+        *--p = w;
+        w >>= 8;
+    }
+}
+
+// peephole - run the peephole pass over every function and relink unplaced symbol references
+static void peephole(ParseContext_t *c) {
+    GenerateContext_t *g = c->g;
+    peepChain_t *chains = NULL, *newChains;
+    uint32_t chainCnt = 0, k;
+    VMVALUE *remap, *links, link;
     Symbol_t *sym;
-    if ((sym = c->globals.head) != NULL) {
-        for (; sym != NULL; sym = sym->next) {
-            actual.globals = realloc(actual.globals, (actual.globals_qty + 1) * sizeof(codeGlobal_t));
-            actual.globals[actual.globals_qty].name = strdup(sym->name);
-            actual.globals[actual.globals_qty].pos= sym->value;
-            actual.globals[actual.globals_qty].placed = (bool)sym->placed;
-            actual.globals[actual.globals_qty].value = sym->value;
-            ++actual.globals_qty;
+    int i;
+
+    if (g->code_len == 0 || !(remap = (VMVALUE*) malloc(g->code_len * sizeof(VMVALUE))))
+        return;
+    for (k = 0; k < g->code_len; ++k)
+        remap[k] = (VMVALUE) k;
+
+    // collect the reference chains threaded through the code before it moves, the code is left alone without memory for them
+    for (sym = c->globals.head; sym != NULL; sym = sym->next) {
+        if (sym->placed || sym->value == 0)
+            continue;
+        if (!(newChains = realloc(chains, (chainCnt + 1) * sizeof(peepChain_t))))
+            goto fail;
+        chains = newChains;
+        chains[chainCnt].sym = sym;
+        chains[chainCnt].links = NULL;
+        chains[chainCnt].cnt = 0;
+        ++chainCnt;
+        for (link = sym->value; link != 0; link = rd_word(g->codeBuf + link)) {
+            if (!(links = realloc(chains[chainCnt - 1].links, (chains[chainCnt - 1].cnt + 1) * sizeof(VMVALUE))))
+                goto fail;
+            chains[chainCnt - 1].links = links;
+            chains[chainCnt - 1].links[chains[chainCnt - 1].cnt++] = link;
         }
     }
 
     for (i = 0; i < generate_functionCount; ++i) {
-        actual.functions = realloc(actual.functions, (actual.functions_qty + 1) * sizeof(codeFunction_t));
-        actual.functions[actual.functions_qty].code = malloc(sizeof(char*));
-        actual.functions[actual.functions_qty].code_len = 0;
+        IrFunction_t *f;
+        if ((f = ir_build(g, &generate_functions[i])) == NULL)
+            continue;
+        peep_function(f);
+        ir_encode(g, f, remap);
+        ir_free(f);
+    }
 
-        actual.functions[actual.functions_qty].name = strdup(generate_functions[i].symbol ? generate_functions[i].symbol->name : "<main>");
-        vmdebug_decode_function(generate_functions[i].code, c->g->codeBuf + generate_functions[i].code, generate_functions[i].codeLen, &(actual.functions[actual.functions_qty].code),
-                &actual.functions[actual.functions_qty].code_len, true);
+    // a link follows the opcode of a LIT, the functions that weren't rewritten keep their offsets
+    for (k = 0; k < chainCnt; ++k) {
+        VMVALUE prev = 0;
+        uint32_t n;
 
-        ++actual.functions_qty;
+        chains[k].sym->value = 0;
+        for (n = 0; n < chains[k].cnt; ++n) {
+            VMVALUE op = remap[chains[k].links[n] - 1];
+            if (op < 0)
+                continue;
+            if (prev)
+                wr_word(g->codeBuf + prev, op + 1);
+            else
+                chains[k].sym->value = op + 1;
+            prev = op + 1;
+        }
+        if (prev)
+            wr_word(g->codeBuf + prev, 0);
+        free(chains[k].links);
     }
 
-    // show actual
-    if (dump) {
-        vm_printf("STRINGS:\n");
-        for (i = 0; i < actual.strings_qty; i++) {
-            vm_printf("  %s\n", actual.strings[i].str);
-        }
+    free(chains);
+    free(remap);
+    return;
 
-        vm_printf("\nGLOBALS:\n");
-        for (i = 0; i < actual.globals_qty; i++) {
-            vm_printf("  %s: %d(%08x) %s\n", actual.globals[i].name, actual.globals[i].value, actual.globals[i].value, actual.globals[i].placed ? "(placed)" : "");
-        }
+fail:
+    for (k = 0; k < chainCnt; ++k)
+        free(chains[k].links);
+    free(chains);
+    free(remap);
+}
 
-        vm_printf("\nFUNCTIONS:\n");
-        for (i = 0; i < actual.functions_qty; i++) {
-            vm_printf("  %s:\n", actual.functions[i].name);
-            for (j = 0; j < actual.functions[i].code_len; j++) {
-                vm_printf("    %s\n", actual.functions[i].code[j]);
+// peep_function - optimize the instructions of one function
+static void peep_function(IrFunction_t *f) {
+    IrInst_t *inst = f->inst;
+    int32_t k, n, t, b, cnt = f->cnt;
+    bool changed;
+
+    do {
+        changed = false;
+
+        // thread branches to unconditional branches
+        for (k = 0; k < cnt; ++k) {
+            if (inst[k].dead || !ir_is_branch(&inst[k]))
+                continue;
+            for (n = 0, t = inst[k].arg; n < 8 && t < cnt; ++n) {
+                if (inst[t].dead)
+                    t = ir_next(f, t);
+                if (t >= cnt || inst[t].op != OP_BR || inst[t].arg == t)
+                    break;
+                t = inst[t].arg;
+            }
+            // a cycle of branches keeps its last hop so the pass still ends
+            if (t != inst[k].arg && (t >= cnt || inst[t].op != OP_BR)) {
+                inst[k].arg = t;
+                changed = true;
             }
-            vm_printf("\n");
         }
-    } else {
-    // optimize
 
+        // blocks that can't be reached from the entry are dead
+        ir_blocks(f);
+        for (b = 0; b < f->blockCnt; ++b) {
+            if (f->blocks[b].reachable)
+                continue;
+            for (k = f->blocks[b].first; k < f->blocks[b].last; ++k)
+                inst[k].dead = true;
+            changed = true;
+        }
+        if (changed)
+            ir_blocks(f);
 
-    }
+        for (k = ir_next(f, -1); k < cnt; k = n) {
+            n = ir_next(f, k);
 
-    // free
-    for (i = 0; i < actual.strings_qty; i++) {
-        free(actual.strings[i].str);
-    }
-    free(actual.strings);
+            // branch to the next instruction
+            if (inst[k].fmt == FMT_BR && inst[k].arg == n) {
+                if (inst[k].op == OP_BR) {
+                    inst[k].dead = true;
+                    changed = true;
+                } else if (inst[k].op == OP_BRT || inst[k].op == OP_BRF) {
+                    inst[k].op = OP_DROP;
+                    inst[k].fmt = FMT_NONE;
+                    inst[k].arg = 0;
+                    changed = true;
+                }
+                continue;
+            }
 
-    for (i = 0; i < actual.globals_qty; i++) {
-        free(actual.globals[i].name);
-    }
-    free(actual.globals);
+            // patterns never span a block boundary
+            if (n >= cnt || inst[n].block != inst[k].block)
+                continue;
+
+            // SLIT 0; ADD (or SUB)
+            if (inst[k].op == OP_SLIT && inst[k].arg == 0 && (inst[n].op == OP_ADD || inst[n].op == OP_SUB)) {
+                inst[k].dead = inst[n].dead = true;
+                changed = true;
+                n = ir_next(f, n);
+            }
 
-    for (i = 0; i < actual.functions_qty; i++) {
-        free(actual.functions[i].name);
-        for (j = 0; j < actual.functions[i].code_len; j++) {
-            free(actual.functions[i].code[j]);
+            // NOT; BRF -> BRT and NOT; BRT -> BRF
+            else if (inst[k].op == OP_NOT && (inst[n].op == OP_BRF || inst[n].op == OP_BRT)) {
+                inst[n].op = inst[n].op == OP_BRF ? OP_BRT : OP_BRF;
+                inst[k].dead = true;
+                changed = true;
+            }
+
+            // LSET n; LREF n -> DUP; LSET n, the stored value is still in tos
+            // the window is run again on the moved LSET so a repeated LREF n becomes another DUP
+            else if (inst[k].op == OP_LSET && inst[n].op == OP_LREF && inst[k].arg == inst[n].arg) {
+                do {
+                    inst[k].op = OP_DUP;
+                    inst[k].fmt = FMT_NONE;
+                    inst[n].op = OP_LSET;
+                    k = n;
+                    n = ir_next(f, k);
+                } while (n < cnt && inst[n].block == inst[k].block && inst[n].op == OP_LREF && inst[n].arg == inst[k].arg);
+                changed = true;
+            }
         }
-        free(actual.functions[i].code);
-    }
-    free(actual.functions);
+    } while (changed);
 }
@@ -0,0 +1,173 @@
+/*
+ * @parallel.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "compile.h"
+#include "mir.h"
+
+#define PRIVATE_CODE_SIZE 4096 // initial size of the code buffer of a worker, it grows for larger functions
+
+// functions waiting for a worker, taken with the functions they call first
+typedef struct {
+    ParseTreeNode_t **nodes;
+                int cnt;
+                int next;   // next function to generate
+               bool failed; // a function failed, the remaining ones are left alone
+    pthread_mutex_t lock;
+} WorkQueue_t;
+
+// worker thread with its own code buffer, arena and error target
+typedef struct {
+          WorkQueue_t *queue;
+         vm_context_t sys;
+    GenerateContext_t g;
+            pthread_t thread;
+                 bool started;
+} Worker_t;
+
+// local function prototypes
+static void* GenerateWorker(void *arg);
+static bool GenerateFunction(Worker_t *w, ParseTreeNode_t *node);
+
+// GenerateParallel - generate the used functions into private buffers, they are linked in the same order afterwards
+void GenerateParallel(ParseContext_t *c) {
+    NodeListEntry_t *entry;
+    MemoryChunk_t *chunk;
+    WorkQueue_t queue;
+    Worker_t *workers;
+    int cnt = 0, i;
+
+    // functions with code from the previous compile are only generated when it can't be relinked
+    for (entry = c->usedFunctions; entry != NULL; entry = entry->next)
+        if (!entry->node->u.functionDefinition.cached)
+            ++cnt;
+    if (cnt < 2)
+        return;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.nodes = (ParseTreeNode_t**) system_arena_allocate(c->sys, cnt * sizeof(ParseTreeNode_t*));
+    for (entry = c->usedFunctions; entry != NULL; entry = entry->next) {
+        ParseTreeNode_t *node = entry->node;
+        if (!node->u.functionDefinition.cached) {
+            queue.nodes[queue.cnt++] = node;
+            mir_inline_expect(node);
+        }
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+
+    // each worker generates with a copy of the options into its own memory
+    cnt = c->g->threads < queue.cnt ? c->g->threads : queue.cnt;
+    workers = (Worker_t*) system_arena_allocate(c->sys, cnt * sizeof(Worker_t));
+    memset(workers, 0, cnt * sizeof(Worker_t));
+    for (i = 0; i < cnt; ++i) {
+        Worker_t *w = &workers[i];
+        w->queue = &queue;
+        w->g = *c->g;
+        w->g.sys = &w->sys;
+        w->g.debug = false;
+        w->g.privateCode = true;
+        w->g.refs = NULL;
+        w->g.refCnt = w->g.refMax = 0;
+        if (!(w->g.codeBuf = (uint8_t*) malloc(PRIVATE_CODE_SIZE)))
+            vm_system_abort(c->sys, "insufficient memory");
+        w->sys.nextLow = w->g.codeBuf;
+        w->sys.nextHigh = w->g.codeBuf + PRIVATE_CODE_SIZE;
+    }
+
+    // the calling thread is the last worker, the others take over what threads can't be started for
+    for (i = 0; i < cnt - 1; ++i)
+        workers[i].started = pthread_create(&workers[i].thread, NULL, GenerateWorker, &workers[i]) == 0;
+    GenerateWorker(&workers[cnt - 1]);
+    for (i = 0; i < cnt - 1; ++i)
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&queue.lock);
+
+    // the generated code lives in the arenas of the workers until the compile is done
+    for (i = 0; i < cnt; ++i) {
+        Worker_t *w = &workers[i];
+        free(w->g.codeBuf);
+        if ((chunk = w->sys.chunks) != NULL) {
+            while (chunk->next != NULL)
+                chunk = chunk->next;
+            chunk->next = c->sys->chunks;
+            c->sys->chunks = w->sys.chunks;
+        }
+    }
+
+    // the failing worker has reported the error
+    if (queue.failed)
+        longjmp(c->sys->errorTarget, 1);
+}
+
+// GenerateWorker - generate functions until there are none left
+static void* GenerateWorker(void *arg) {
+    Worker_t *w = (Worker_t*) arg;
+    WorkQueue_t *queue = w->queue;
+    ParseTreeNode_t *node;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        node = !queue->failed && queue->next < queue->cnt ? queue->nodes[queue->next++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+        if (!node)
+            break;
+        if (!GenerateFunction(w, node)) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    return NULL;
+}
+
+// GenerateFunction - generate a function into the buffer of a worker and keep a copy for the link step, false after an error
+static bool GenerateFunction(Worker_t *w, ParseTreeNode_t *node) {
+    GenerateContext_t *g = &w->g;
+    GeneratedCode_t *gen;
+    size_t size;
+
+    // the functions waiting to inline this one go on after an error
+    if (setjmp(w->sys.errorTarget) != 0) {
+        mir_inline_finish(node);
+        return false;
+    }
+
+    w->sys.nextLow = g->codeBuf;
+    Generate(g, node);
+    mir_inline_finish(node);
+
+    size = codeaddr(g);
+    gen = (GeneratedCode_t*) system_arena_allocate(&w->sys, sizeof(GeneratedCode_t));
+    gen->code = (uint8_t*) system_arena_allocate(&w->sys, size);
+    memcpy(gen->code, g->codeBuf, size);
+    gen->codeLen = size;
+    gen->refs = NULL;
+    gen->refCnt = g->refCnt;
+    if (g->refCnt > 0) {
+        gen->refs = (CodeRef_t*) system_arena_allocate(&w->sys, g->refCnt * sizeof(CodeRef_t));
+        memcpy(gen->refs, g->refs, g->refCnt * sizeof(CodeRef_t));
+    }
+    node->u.functionDefinition.generated = gen;
+
+    return true;
+}
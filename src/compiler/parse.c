@@ -31,7 +31,7 @@ static void ParseFunction(ParseContext_t *c);
 static void ParseEndFunction(ParseContext_t *c);
 static void EndFunction(ParseContext_t *c);
 static void ParseDim(ParseContext_t *c);
-static int ParseVariableDecl(ParseContext_t *c, char *name, VMVALUE *pSize);
+static int ParseVariableDecl(ParseContext_t *c, char **pName, VMVALUE *pSize);
 static VMVALUE ParseScalarInitializer(ParseContext_t *c);
 static void ParseArrayInitializers(ParseContext_t *c, VMVALUE size);
 static void ClearArrayInitializers(ParseContext_t *c, VMVALUE size);
@@ -51,6 +51,12 @@ static void ParseLoopWhile(ParseContext_t *c);
 static void ParseLoopUntil(ParseContext_t *c);
 static void ParseReturn(ParseContext_t *c);
 static void ParsePrint(ParseContext_t *c);
+static void ParseOpen(ParseContext_t *c);
+static void ParseClose(ParseContext_t *c);
+static void ParseInput(ParseContext_t *c);
+static void ParseLineInput(ParseContext_t *c);
+static ParseTreeNode_t* ParseChannel(ParseContext_t *c);
+static ParseTreeNode_t* ParseInputChannel(ParseContext_t *c);
 static void ParseEnd(ParseContext_t *c);
 static ParseTreeNode_t* ParseExpr2(ParseContext_t *c);
 static ParseTreeNode_t* ParseExpr3(ParseContext_t *c);
@@ -75,10 +81,13 @@ static ParseTreeNode_t* MakeBinaryOpNode(ParseContext_t *c, int op, ParseTreeNod
 static void PushBlock(ParseContext_t *c, BlockType_t type, ParseTreeNode_t *node);
 static void PopBlock(ParseContext_t *c);
 static int IsIntegerLit(ParseTreeNode_t *node);
+static Type_t* NewArrayType(ParseContext_t *c, VMVALUE size);
+static char* CopyToken(ParseContext_t *c);
+static void HashConstant(ParseContext_t *c, VMVALUE value);
 
 // InitParseContext - parse a statement
 ParseContext_t* InitParseContext(vm_context_t *sys) {
-    ParseContext_t *c = (ParseContext_t*) system_allocate_high_memory(sys, sizeof(ParseContext_t));
+    ParseContext_t *c = (ParseContext_t*) system_arena_allocate(sys, sizeof(ParseContext_t));
     if (c) {
         memset(c, 0, sizeof(ParseContext_t));
         c->sys = sys;
@@ -155,6 +164,18 @@ void ParseStatement(ParseContext_t *c, int tkn) {
         case T_PRINT:
             ParsePrint(c);
             break;
+        case T_OPEN:
+            ParseOpen(c);
+            break;
+        case T_CLOSE:
+            ParseClose(c);
+            break;
+        case T_INPUT:
+            ParseInput(c);
+            break;
+        case T_LINE_INPUT:
+            ParseLineInput(c);
+            break;
         case T_END:
             ParseEnd(c);
             break;
@@ -170,9 +191,9 @@ void ParseStatement(ParseContext_t *c, int tkn) {
 
 // ParseInclude - parse the 'INCLUDE' statement
 static void ParseInclude(ParseContext_t *c) {
-    char name[MAXTOKEN];
+    char *name;
     FRequire(c, T_STRING);
-    strcpy(name, c->token);
+    name = CopyToken(c);
     FRequire(c, T_EOL);
     if (!PushFile(c, name))
         ParseError(c, "include file not found: %s", name);
@@ -196,12 +217,14 @@ static void ParseFunction(ParseContext_t *c) {
     if (!(symbol = FindGlobal(c, c->token)))
         symbol = AddGlobal(c, c->token, SC_FUNCTION, &c->integerFunctionType, 0);
     else {
-        if (symbol->storageClass != SC_FUNCTION || symbol->type != &c->integerFunctionType || symbol->placed)
+        if (symbol->storageClass != SC_FUNCTION || symbol->type != &c->integerFunctionType || symbol->placed || FindFunction(c, symbol))
             ParseError(c, "invalid definition of a forward referenced function");
     }
     
     // create the function node
     function = StartFunction(c, symbol);
+    function->u.functionDefinition.included = c->currentFile != NULL;
+    function->u.functionDefinition.source = HashSource(SOURCE_HASH_INIT, c->sys_line->line, c->sys_line->lineLen);
 
     // get the argument list
     if ((tkn = GetToken(c)) == '(') {
@@ -214,7 +237,12 @@ static void ParseFunction(ParseContext_t *c) {
             } while ((tkn = GetToken(c)) == ',');
         }
         Require(c, tkn, ')');
+        tkn = GetToken(c);
     }
+
+    // NOINLINE keeps the calls to the function
+    if (tkn == T_NOINLINE)
+        function->u.functionDefinition.noInline = VMTRUE;
     else
         SaveToken(c, tkn);
 
@@ -228,7 +256,7 @@ static void ParseEndFunction(ParseContext_t *c) {
     else if (c->bptr->type != BLOCK_FUNCTION)
         ParseError(c, "function definition not complete");
     //PrintNode(c->currentFunction, 0);
-    Generate(c->g, c->currentFunction);
+    AddNodeToList(c, &c->pNextFunction, c->currentFunction);
     EndFunction(c);
 }
 
@@ -244,6 +272,15 @@ ParseTreeNode_t* StartFunction(ParseContext_t *c, Symbol_t *symbol) {
     return node;
 }
 
+// FindFunction - find the definition of a function, NULL if it isn't defined yet
+ParseTreeNode_t* FindFunction(ParseContext_t *c, Symbol_t *symbol) {
+    NodeListEntry_t *entry;
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (entry->node->u.functionDefinition.symbol == symbol)
+            return entry->node;
+    return NULL;
+}
+
 // EndFunction - end a function definition
 static void EndFunction(ParseContext_t *c) {
     PopBlock(c);
@@ -252,7 +289,7 @@ static void EndFunction(ParseContext_t *c) {
 
 // ParseDim - parse the 'DIM' statement
 static void ParseDim(ParseContext_t *c) {
-    char name[MAXTOKEN];
+    char *name;
     VMVALUE value = 0, size = 0;
     int isArray;
     int tkn;
@@ -261,7 +298,7 @@ static void ParseDim(ParseContext_t *c) {
     do {
 
         // get variable name
-        isArray = ParseVariableDecl(c, name, &size);
+        isArray = ParseVariableDecl(c, &name, &size);
 
         // add to the global symbol table if outside a function definition
         if (c->currentFunction == c->mainFunction) {
@@ -285,7 +322,7 @@ static void ParseDim(ParseContext_t *c) {
             }
 
             // add the symbol to the global symbol table
-            sym = AddGlobal(c, name, isArray ? SC_CONSTANT : SC_VARIABLE, &c->integerType, value);
+            sym = AddGlobal(c, name, isArray ? SC_CONSTANT : SC_VARIABLE, isArray ? NewArrayType(c, size) : &c->integerType, value);
             sym->placed = VMTRUE;
         }
 
@@ -325,13 +362,13 @@ static void ParseDim(ParseContext_t *c) {
 }
 
 // ParseVariableDecl - parse a variable declaration
-static int ParseVariableDecl(ParseContext_t *c, char *name, VMVALUE *pSize) {
+static int ParseVariableDecl(ParseContext_t *c, char **pName, VMVALUE *pSize) {
     int isArray;
     int tkn;
 
     // parse the variable name
     FRequire(c, T_IDENTIFIER);
-    strcpy(name, c->token);
+    *pName = CopyToken(c);
 
     // handle arrays
     if ((tkn = GetToken(c)) == '[') {
@@ -555,6 +592,7 @@ static void ParseFor(ParseContext_t *c) {
     // get the control variable
     FRequire(c, T_IDENTIFIER);
     node->u.forStatement.var = GetSymbolRef(c, c->token);
+    ResolveVariableRef(c, node->u.forStatement.var);
 
     // parse the starting value expression
     FRequire(c, '=');
@@ -570,6 +608,13 @@ static void ParseFor(ParseContext_t *c) {
         tkn = GetToken(c);
     }
     Require(c, tkn, T_EOL);
+
+    // the limit and a computed step are evaluated once into hidden locals
+    node->u.forStatement.limitOffset = c->currentFunction->u.functionDefinition.localOffset++;
+    if (node->u.forStatement.stepExpr && !IsIntegerLit(node->u.forStatement.stepExpr))
+        node->u.forStatement.stepOffset = c->currentFunction->u.functionDefinition.localOffset++;
+    else
+        node->u.forStatement.stepOffset = -1;
 }
 
 // ParseNext - parse the 'NEXT' statement
@@ -685,20 +730,21 @@ static void ParseReturn(ParseContext_t *c) {
     AddNodeToList(c, &c->bptr->pNextStatement, node);
 }
 
-// BuildHandlerFunctionCall - compile a call to a runtime print function
-static ParseTreeNode_t* BuildHandlerCall(ParseContext_t *c, char *name, ParseTreeNode_t *devExpr, ParseTreeNode_t *expr) {
-    ParseTreeNode_t *functionNode, *callNode, *node;
+// BuildHandlerFunctionCall - compile a call to a runtime helper function
+static ParseTreeNode_t* BuildHandlerFunctionCall(ParseContext_t *c, char *name, ParseTreeNode_t *devExpr, ParseTreeNode_t *expr, ParseTreeNode_t *expr2) {
+    ParseTreeNode_t *functionNode, *callNode;
     NodeListEntry_t **pNext;
     Symbol_t *symbol;
 
     if (!(symbol = FindGlobal(c, name)))
-        ParseError(c, "print helper not defined: %s", name);
+        ParseError(c, "runtime helper not defined: %s", name);
 
     functionNode = NewParseTreeNode(c, NodeTypeGlobalRef);
     functionNode->u.symbolRef.symbol = symbol;
     
     // intialize the function call node
     callNode = NewParseTreeNode(c, NodeTypeFunctionCall);
+    callNode->type = &c->integerType;
     callNode->u.functionCall.fcn = functionNode;
     callNode->u.functionCall.args = NULL;
     pNext = &callNode->u.functionCall.args;
@@ -708,14 +754,23 @@ static ParseTreeNode_t* BuildHandlerCall(ParseContext_t *c, char *name, ParseTre
         ++callNode->u.functionCall.argc;
     }
 
+    if (expr2) {
+        AddNodeToList(c, &pNext, expr2);
+        ++callNode->u.functionCall.argc;
+    }
+
+    // the channel is pushed last so it is argument 0 of the helper
     AddNodeToList(c, &pNext, devExpr);
     ++callNode->u.functionCall.argc;
 
-    // build the function call statement
-    node = NewParseTreeNode(c, NodeTypeCallStatement);
-    node->u.callStatement.expr = callNode;
-    
-    // return the function call statement
+    // return the function call
+    return callNode;
+}
+
+// BuildHandlerCall - compile a call statement to a runtime helper function
+static ParseTreeNode_t* BuildHandlerCall(ParseContext_t *c, char *name, ParseTreeNode_t *devExpr, ParseTreeNode_t *expr) {
+    ParseTreeNode_t *node = NewParseTreeNode(c, NodeTypeCallStatement);
+    node->u.callStatement.expr = BuildHandlerFunctionCall(c, name, devExpr, expr, NULL);
     return node;
 }
 
@@ -766,6 +821,139 @@ static void ParsePrint(ParseContext_t *c) {
         AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printNL", devExpr, NULL));
 }
 
+// ParseChannel - parse a '#chn' channel expression, the '#' is optional
+static ParseTreeNode_t* ParseChannel(ParseContext_t *c) {
+    int tkn;
+    if ((tkn = GetToken(c)) != '#')
+        SaveToken(c, tkn);
+    return ParseExpr(c);
+}
+
+// ParseOpen - parse the 'OPEN name FOR INPUT|OUTPUT|APPEND AS #chn' statement
+static void ParseOpen(ParseContext_t *c) {
+    ParseTreeNode_t *nameExpr, *modeExpr, *node;
+    VMVALUE mode = 0;
+
+    nameExpr = ParseExpr(c);
+    FRequire(c, T_FOR);
+
+    // the mode names are not reserved words
+    switch (GetToken(c)) {
+        case T_INPUT:
+            mode = 0;
+            break;
+        case T_IDENTIFIER:
+            if (strcasecmp(c->token, "OUTPUT") == 0)
+                mode = 1;
+            else if (strcasecmp(c->token, "APPEND") == 0)
+                mode = 2;
+            else
+                ParseError(c, "expecting INPUT, OUTPUT or APPEND");
+            break;
+        default:
+            ParseError(c, "expecting INPUT, OUTPUT or APPEND");
+            break;
+    }
+
+    modeExpr = NewParseTreeNode(c, NodeTypeIntegerLit);
+    modeExpr->type = &c->integerType;
+    modeExpr->u.integerLit.value = mode;
+
+    FRequire(c, T_AS);
+    node = NewParseTreeNode(c, NodeTypeCallStatement);
+    node->u.callStatement.expr = BuildHandlerFunctionCall(c, "fileOpen", ParseChannel(c), nameExpr, modeExpr);
+    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    FRequire(c, T_EOL);
+}
+
+// ParseClose - parse the 'CLOSE #chn' statement
+static void ParseClose(ParseContext_t *c) {
+    AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "fileClose", ParseChannel(c), NULL));
+    FRequire(c, T_EOL);
+}
+
+// ParseInputChannel - parse the optional '#chn,' of an input statement, the console is channel 0
+static ParseTreeNode_t* ParseInputChannel(ParseContext_t *c) {
+    ParseTreeNode_t *devExpr;
+    int tkn;
+
+    if ((tkn = GetToken(c)) == '#') {
+        devExpr = ParseExpr(c);
+        FRequire(c, ',');
+    }
+    else {
+        SaveToken(c, tkn);
+        devExpr = NewParseTreeNode(c, NodeTypeIntegerLit);
+        devExpr->type = &c->integerType;
+        devExpr->u.integerLit.value = 0;
+    }
+
+    return devExpr;
+}
+
+// ParseInput - parse the 'INPUT [#chn,] ["prompt";] var [, var]...' statement
+static void ParseInput(ParseContext_t *c) {
+    ParseTreeNode_t *devExpr, *conExpr, *node;
+    int tkn;
+
+    devExpr = ParseInputChannel(c);
+
+    // the prompt always goes to the console
+    if ((tkn = GetToken(c)) == T_STRING) {
+        conExpr = NewParseTreeNode(c, NodeTypeIntegerLit);
+        conExpr->type = &c->integerType;
+        conExpr->u.integerLit.value = 0;
+        node = NewParseTreeNode(c, NodeTypeStringLit);
+        node->u.stringLit.string = AddString(c, c->token);
+        AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printStr", conExpr, node));
+        if ((tkn = GetToken(c)) != ';')
+            Require(c, tkn, ',');
+    }
+    else
+        SaveToken(c, tkn);
+
+    // each variable gets the next integer from the channel
+    do {
+        node = NewParseTreeNode(c, NodeTypeLetStatement);
+        node->u.letStatement.lvalue = ParsePrimary(c);
+        ResolveVariableRef(c, node->u.letStatement.lvalue);
+        node->u.letStatement.rvalue = BuildHandlerFunctionCall(c, "inputInt", devExpr, NULL, NULL);
+        AddNodeToList(c, &c->bptr->pNextStatement, node);
+    } while ((tkn = GetToken(c)) == ',');
+
+    // the rest of the line goes with the statement
+    AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "inputEnd", devExpr, NULL));
+    Require(c, tkn, T_EOL);
+}
+
+// ParseLineInput - parse the 'LINE INPUT [#chn,] array' statement
+static void ParseLineInput(ParseContext_t *c) {
+    ParseTreeNode_t *devExpr, *bufExpr, *sizeExpr, *node;
+    Symbol_t *symbol;
+
+    devExpr = ParseInputChannel(c);
+
+    // the line is stored one character per element so the target must be an array
+    FRequire(c, T_IDENTIFIER);
+    if (!(symbol = FindGlobal(c, c->token)) || symbol->storageClass != SC_CONSTANT || symbol->type->id != TYPE_ARRAY)
+        ParseError(c, "expecting an array");
+
+    bufExpr = NewParseTreeNode(c, NodeTypeIntegerLit);
+    bufExpr->type = &c->integerType;
+    bufExpr->u.integerLit.value = symbol->value;
+    HashConstant(c, symbol->value);
+    HashConstant(c, symbol->type->u.arrayInfo.size);
+
+    sizeExpr = NewParseTreeNode(c, NodeTypeIntegerLit);
+    sizeExpr->type = &c->integerType;
+    sizeExpr->u.integerLit.value = symbol->type->u.arrayInfo.size;
+
+    node = NewParseTreeNode(c, NodeTypeCallStatement);
+    node->u.callStatement.expr = BuildHandlerFunctionCall(c, "lineInput", devExpr, bufExpr, sizeExpr);
+    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    FRequire(c, T_EOL);
+}
+
 // ParseEnd - parse the 'END' statement
 static void ParseEnd(ParseContext_t *c) {
     ParseTreeNode_t *node = NewParseTreeNode(c, NodeTypeEndStatement);
@@ -1144,7 +1332,7 @@ static ParseTreeNode_t* ParseCall(ParseContext_t *c, ParseTreeNode_t *functionNo
     if ((tkn = GetToken(c)) != ')') {
         SaveToken(c, tkn);
         do {
-            NodeListEntry_t *actual = (NodeListEntry_t*) system_allocate_high_memory(c->sys, sizeof(NodeListEntry_t));
+            NodeListEntry_t *actual = (NodeListEntry_t*) system_arena_allocate(c->sys, sizeof(NodeListEntry_t));
             actual->node = ParseExpr(c);
             actual->next = node->u.functionCall.args;
             node->u.functionCall.args = actual;
@@ -1251,6 +1439,7 @@ static ParseTreeNode_t* GetSymbolRef(ParseContext_t *c, const char *name) {
             node = NewParseTreeNode(c, NodeTypeIntegerLit);
             node->type = &c->integerType;
             node->u.integerLit.value = symbol->value;
+            HashConstant(c, symbol->value);
         }
         else {
             node = NewParseTreeNode(c, NodeTypeGlobalRef);
@@ -1389,10 +1578,16 @@ integerOp:
     return node;
 }
 
-// PushBlock - push a block on the stack
+// PushBlock - push a block on the stack, doubling the stack when it is full
 static void PushBlock(ParseContext_t *c, BlockType_t type, ParseTreeNode_t *node) {
-    if (++c->bptr >= c->btop)
-        ParseError(c, "statements too deeply nested");
+    if (++c->bptr >= c->btop) {
+        size_t depth = c->btop - c->blockBuf;
+        Block_t *blockBuf = (Block_t*) system_arena_allocate(c->sys, depth * 2 * sizeof(Block_t));
+        memcpy(blockBuf, c->blockBuf, depth * sizeof(Block_t));
+        c->bptr = blockBuf + depth;
+        c->btop = blockBuf + depth * 2;
+        c->blockBuf = blockBuf;
+    }
     c->bptr->type = type;
     c->bptr->node = node;
 }
@@ -1402,9 +1597,26 @@ static void PopBlock(ParseContext_t *c) {
     --c->bptr;
 }
 
+// CopyToken - copy the current token string
+static char* CopyToken(ParseContext_t *c) {
+    char *copy = (char*) system_arena_allocate(c->sys, strlen(c->token) + 1);
+    strcpy(copy, c->token);
+    return copy;
+}
+
+// NewArrayType - allocate an integer array type
+static Type_t* NewArrayType(ParseContext_t *c, VMVALUE size) {
+    Type_t *type = (Type_t*) system_arena_allocate(c->sys, sizeof(Type_t));
+    memset(type, 0, sizeof(Type_t));
+    type->id = TYPE_ARRAY;
+    type->u.arrayInfo.elementType = &c->integerType;
+    type->u.arrayInfo.size = size;
+    return type;
+}
+
 // NewParseTreeNode - allocate a new parse tree node
 ParseTreeNode_t* NewParseTreeNode(ParseContext_t *c, int type) {
-    ParseTreeNode_t *node = (ParseTreeNode_t*) system_allocate_high_memory(c->sys, sizeof(ParseTreeNode_t));
+    ParseTreeNode_t *node = (ParseTreeNode_t*) system_arena_allocate(c->sys, sizeof(ParseTreeNode_t));
     memset(node, 0, sizeof(ParseTreeNode_t));
     node->nodeType = type;
     return node;
@@ -1412,7 +1624,7 @@ ParseTreeNode_t* NewParseTreeNode(ParseContext_t *c, int type) {
 
 // AddNodeToList - add a node to a parse tree node list
 void AddNodeToList(ParseContext_t *c, NodeListEntry_t ***ppNextEntry, ParseTreeNode_t *node) {
-    NodeListEntry_t *entry = (NodeListEntry_t*) system_allocate_high_memory(c->sys, sizeof(NodeListEntry_t));
+    NodeListEntry_t *entry = (NodeListEntry_t*) system_arena_allocate(c->sys, sizeof(NodeListEntry_t));
     entry->node = node;
     entry->next = NULL;
     **ppNextEntry = entry;
@@ -1449,6 +1661,12 @@ static String_t* AddString(ParseContext_t *c, const char *value) {
     return str;
 }
 
+// HashConstant - add the value of a global constant used by a function to the hash of its source
+static void HashConstant(ParseContext_t *c, VMVALUE value) {
+    if (c->currentFunction != c->mainFunction)
+        c->currentFunction->u.functionDefinition.source = HashSource(c->currentFunction->u.functionDefinition.source, &value, sizeof(VMVALUE));
+}
+
 // DumpStrings - dump the string table
 void DumpStrings(ParseContext_t *c) {
     String_t *str = c->strings;
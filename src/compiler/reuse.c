@@ -0,0 +1,346 @@
+/*
+ * @reuse.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compile.h"
+
+#define CACHE_BUCKETS_INIT 64 // hash chains of a new function cache
+
+// local function prototypes
+static uint64_t CodeContext(ParseContext_t *c);
+static CachedFunction_t* FindCached(FunctionCache_t *cache, Symbol_t *symbol);
+static CachedFunction_t* AddCached(ParseContext_t *c, Symbol_t *symbol);
+static void FreeCode(CachedFunction_t *cf);
+static void AddCaller(ParseContext_t *c, CachedFunction_t *callee, CachedFunction_t *caller);
+static void AddCallers(ParseContext_t *c, CachedFunction_t *caller, ParseTreeNode_t *node);
+static void AddCallersList(ParseContext_t *c, CachedFunction_t *caller, NodeListEntry_t *list);
+
+// HashSource - add bytes to a source hash (64 bit FNV-1a)
+uint64_t HashSource(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t*) data;
+    while (size-- > 0) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// CheckCachedFunctions - find the functions that can keep the code of the previous compile
+void CheckCachedFunctions(ParseContext_t *c) {
+    FunctionCache_t *cache = c->cache;
+    CachedFunction_t *cf, **stack;
+    NodeListEntry_t *entry;
+    int top = 0, cnt = 0, i;
+
+    ++cache->compile;
+
+    // a function is unchanged when its source hashes the same as when its callers were generated
+    for (entry = c->functions; entry != NULL; entry = entry->next) {
+        ParseTreeNode_t *node = entry->node;
+        if (!(cf = FindCached(cache, node->u.functionDefinition.symbol)))
+            cf = AddCached(c, node->u.functionDefinition.symbol);
+        cf->seen = cache->compile;
+        cf->fresh = cf->source == node->u.functionDefinition.source;
+        cf->callers = NULL;
+        cf->callerCnt = cf->callerMax = 0;
+        ++cnt;
+    }
+
+    // a function may have inlined or evaluated the functions it references, so it changes with them
+    for (entry = c->functions; entry != NULL; entry = entry->next) {
+        cf = FindCached(cache, entry->node->u.functionDefinition.symbol);
+        if (cf->fresh)
+            AddCallersList(c, cf, entry->node->u.functionDefinition.bodyStatements);
+    }
+    stack = (CachedFunction_t**) system_arena_allocate(c->sys, (cnt + 1) * sizeof(CachedFunction_t*));
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        if (!(cf = FindCached(cache, entry->node->u.functionDefinition.symbol))->fresh)
+            stack[top++] = cf;
+    while (top > 0) {
+        cf = stack[--top];
+        for (i = 0; i < cf->callerCnt; ++i) {
+            if (cf->callers[i]->fresh) {
+                cf->callers[i]->fresh = VMFALSE;
+                stack[top++] = cf->callers[i];
+            }
+        }
+    }
+
+    // the code of a changed function is never valid again
+    for (entry = c->functions; entry != NULL; entry = entry->next) {
+        cf = FindCached(cache, entry->node->u.functionDefinition.symbol);
+        if (!cf->fresh)
+            FreeCode(cf);
+        entry->node->u.functionDefinition.cached = cf->code ? cf : NULL;
+    }
+}
+
+// GenerateCached - store the kept code of a function, false when it has to be generated
+int GenerateCached(ParseContext_t *c, ParseTreeNode_t *node) {
+    CachedFunction_t *cf = node->u.functionDefinition.cached;
+    CodeRef_t *refs = NULL;
+    String_t *str;
+    int i;
+
+    // the code depends on the options and on the values of the known globals
+    if (!cf || cf->context != CodeContext(c))
+        return VMFALSE;
+
+    // find the globals and strings the code refers to in this compile
+    if (cf->refCnt > 0)
+        refs = (CodeRef_t*) system_arena_allocate(c->sys, cf->refCnt * sizeof(CodeRef_t));
+    for (i = 0; i < cf->refCnt; ++i) {
+        refs[i].offset = cf->refs[i].offset;
+        refs[i].sym = NULL;
+        refs[i].str = NULL;
+        if (cf->refs[i].name) {
+            if (!(refs[i].sym = FindGlobal(c, cf->refs[i].name)) || refs[i].sym->storageClass != cf->refs[i].storageClass)
+                return VMFALSE;
+        } else {
+            for (str = c->strings; str != NULL; str = str->next)
+                if (strcmp(cf->refs[i].data, str->data) == 0)
+                    break;
+            if (!(refs[i].str = str))
+                return VMFALSE;
+        }
+    }
+
+    GenerateCopy(c->g, node, cf->code, cf->codeLen, refs, cf->refCnt);
+    return VMTRUE;
+}
+
+// CacheFunction - keep the code just generated for a function
+void CacheFunction(ParseContext_t *c, ParseTreeNode_t *node, VMVALUE code) {
+    GenerateContext_t *g = c->g;
+    CachedFunction_t *cf;
+    int i;
+
+    if (!(cf = FindCached(c->cache, node->u.functionDefinition.symbol)))
+        return;
+    FreeCode(cf);
+    cf->source = node->u.functionDefinition.source;
+    cf->context = CodeContext(c);
+
+    // the code is kept before the peephole pass, which runs again over the whole program
+    cf->codeLen = codeaddr(g) - code;
+    if (!(cf->code = (uint8_t*) malloc(cf->codeLen))
+            || (g->refCnt > 0 && !(cf->refs = (CachedRef_t*) calloc(g->refCnt, sizeof(CachedRef_t))))) {
+        FreeCode(cf);
+        return;
+    }
+    memcpy(cf->code, g->codeBuf + code, cf->codeLen);
+
+    // the addresses are relinked by name, their words hold reference chains until then
+    for (i = 0; i < g->refCnt; ++i) {
+        CachedRef_t *ref = &cf->refs[cf->refCnt++];
+        ref->offset = g->refs[i].offset - code;
+        if (g->refs[i].sym) {
+            ref->storageClass = g->refs[i].sym->storageClass;
+            ref->name = strdup(g->refs[i].sym->name);
+        } else
+            ref->data = strdup(g->refs[i].str->data);
+        if (!ref->name && !ref->data) {
+            FreeCode(cf);
+            return;
+        }
+    }
+}
+
+// UpdateFunctionCache - remember the sources of a compile that succeeded and drop the functions it doesn't define
+void UpdateFunctionCache(ParseContext_t *c) {
+    FunctionCache_t *cache = c->cache;
+    CachedFunction_t *cf, **pcf;
+    NodeListEntry_t *entry;
+    int i;
+
+    for (entry = c->functions; entry != NULL; entry = entry->next)
+        FindCached(cache, entry->node->u.functionDefinition.symbol)->source = entry->node->u.functionDefinition.source;
+
+    for (i = 0; i < cache->bucketCnt; ++i) {
+        pcf = &cache->buckets[i];
+        while ((cf = *pcf) != NULL) {
+            if (cf->seen != cache->compile) {
+                *pcf = cf->next;
+                FreeCode(cf);
+                free(cf);
+                --cache->count;
+            } else
+                pcf = &cf->next;
+        }
+    }
+}
+
+// CodeContext - hash the options and the known globals that the generated code depends on
+static uint64_t CodeContext(ParseContext_t *c) {
+    int options[3];
+    options[0] = c->g->optLevel;
+    options[1] = c->g->isa;
+    options[2] = c->g->debug;
+    return HashSource(c->knownGlobals, options, sizeof(options));
+}
+
+// FindCached - find the cache entry of a function
+static CachedFunction_t* FindCached(FunctionCache_t *cache, Symbol_t *symbol) {
+    CachedFunction_t *cf;
+    if (cache->bucketCnt == 0)
+        return NULL;
+    for (cf = cache->buckets[symbol->hash & (cache->bucketCnt - 1)]; cf != NULL; cf = cf->next)
+        if (cf->hash == symbol->hash && strcasecmp(cf->name, symbol->name) == 0)
+            return cf;
+    return NULL;
+}
+
+// AddCached - add a cache entry for a function without code
+static CachedFunction_t* AddCached(ParseContext_t *c, Symbol_t *symbol) {
+    FunctionCache_t *cache = c->cache;
+    CachedFunction_t *cf, *next, **buckets;
+    int cnt, i;
+
+    // keep the chains short
+    if (cache->count >= cache->bucketCnt) {
+        cnt = cache->bucketCnt ? cache->bucketCnt * 2 : CACHE_BUCKETS_INIT;
+        if (!(buckets = (CachedFunction_t**) calloc(cnt, sizeof(CachedFunction_t*))))
+            vm_system_abort(c->sys, "insufficient memory");
+        for (i = 0; i < cache->bucketCnt; ++i) {
+            for (cf = cache->buckets[i]; cf != NULL; cf = next) {
+                next = cf->next;
+                cf->next = buckets[cf->hash & (cnt - 1)];
+                buckets[cf->hash & (cnt - 1)] = cf;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->bucketCnt = cnt;
+    }
+
+    if (!(cf = (CachedFunction_t*) calloc(1, sizeof(CachedFunction_t) + strlen(symbol->name))))
+        vm_system_abort(c->sys, "insufficient memory");
+    strcpy(cf->name, symbol->name);
+    cf->hash = symbol->hash;
+    cf->next = cache->buckets[cf->hash & (cache->bucketCnt - 1)];
+    cache->buckets[cf->hash & (cache->bucketCnt - 1)] = cf;
+    ++cache->count;
+    return cf;
+}
+
+// FreeCode - free the code kept for a function
+static void FreeCode(CachedFunction_t *cf) {
+    int i;
+    for (i = 0; i < cf->refCnt; ++i) {
+        free(cf->refs[i].name);
+        free(cf->refs[i].data);
+    }
+    free(cf->refs);
+    free(cf->code);
+    cf->refs = NULL;
+    cf->refCnt = 0;
+    cf->code = NULL;
+    cf->codeLen = 0;
+}
+
+// AddCaller - add a function to the callers of another one
+static void AddCaller(ParseContext_t *c, CachedFunction_t *callee, CachedFunction_t *caller) {
+    if (callee->callerCnt >= callee->callerMax) {
+        CachedFunction_t **callers;
+        callee->callerMax = callee->callerMax ? callee->callerMax * 2 : 4;
+        callers = (CachedFunction_t**) system_arena_allocate(c->sys, callee->callerMax * sizeof(CachedFunction_t*));
+        if (callee->callerCnt > 0)
+            memcpy(callers, callee->callers, callee->callerCnt * sizeof(CachedFunction_t*));
+        callee->callers = callers;
+    }
+    callee->callers[callee->callerCnt++] = caller;
+}
+
+// AddCallers - add a function to the callers of the functions referenced by a parse tree node
+static void AddCallers(ParseContext_t *c, CachedFunction_t *caller, ParseTreeNode_t *node) {
+    CachedFunction_t *callee;
+
+    if (node == NULL)
+        return;
+
+    switch (node->nodeType) {
+        case NodeTypeLetStatement:
+            AddCallers(c, caller, node->u.letStatement.lvalue);
+            AddCallers(c, caller, node->u.letStatement.rvalue);
+            break;
+        case NodeTypeIfStatement:
+            AddCallers(c, caller, node->u.ifStatement.test);
+            AddCallersList(c, caller, node->u.ifStatement.thenStatements);
+            AddCallersList(c, caller, node->u.ifStatement.elseStatements);
+            break;
+        case NodeTypeForStatement:
+            AddCallers(c, caller, node->u.forStatement.var);
+            AddCallers(c, caller, node->u.forStatement.startExpr);
+            AddCallers(c, caller, node->u.forStatement.endExpr);
+            AddCallers(c, caller, node->u.forStatement.stepExpr);
+            AddCallersList(c, caller, node->u.forStatement.bodyStatements);
+            break;
+        case NodeTypeDoWhileStatement:
+        case NodeTypeDoUntilStatement:
+        case NodeTypeLoopStatement:
+        case NodeTypeLoopWhileStatement:
+        case NodeTypeLoopUntilStatement:
+            AddCallers(c, caller, node->u.loopStatement.test);
+            AddCallersList(c, caller, node->u.loopStatement.bodyStatements);
+            break;
+        case NodeTypeReturnStatement:
+            AddCallers(c, caller, node->u.returnStatement.expr);
+            break;
+        case NodeTypeCallStatement:
+            AddCallers(c, caller, node->u.callStatement.expr);
+            break;
+        case NodeTypeGlobalRef:
+            // a function the program doesn't define can't have kept code to depend on
+            if (node->u.symbolRef.symbol->storageClass == SC_FUNCTION) {
+                if ((callee = FindCached(c->cache, node->u.symbolRef.symbol)) != NULL && callee->seen == c->cache->compile)
+                    AddCaller(c, callee, caller);
+                else
+                    caller->fresh = VMFALSE;
+            }
+            break;
+        case NodeTypeUnaryOp:
+            AddCallers(c, caller, node->u.unaryOp.expr);
+            break;
+        case NodeTypeBinaryOp:
+            AddCallers(c, caller, node->u.binaryOp.left);
+            AddCallers(c, caller, node->u.binaryOp.right);
+            break;
+        case NodeTypeArrayRef:
+            AddCallers(c, caller, node->u.arrayRef.array);
+            AddCallers(c, caller, node->u.arrayRef.index);
+            break;
+        case NodeTypeFunctionCall:
+            AddCallers(c, caller, node->u.functionCall.fcn);
+            AddCallersList(c, caller, node->u.functionCall.args);
+            break;
+        case NodeTypeDisjunction:
+        case NodeTypeConjunction:
+            AddCallersList(c, caller, node->u.exprList.exprs);
+            break;
+        default:
+            break;
+    }
+}
+
+// AddCallersList - add a function to the callers of the functions referenced by a list of parse tree nodes
+static void AddCallersList(ParseContext_t *c, CachedFunction_t *caller, NodeListEntry_t *list) {
+    for (; list != NULL; list = list->next)
+        AddCallers(c, caller, list->node);
+}
@@ -22,6 +22,11 @@
 #include <string.h>
 #include <setjmp.h>
 #include <ctype.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "compile.h"
 
@@ -59,11 +64,60 @@ static struct {
         { "PRINT"   , T_PRINT    },
         { "ASM"     , T_ASM      },
         { "INCLUDE" , T_INCLUDE  },
+        { "OPEN"    , T_OPEN     },
+        { "CLOSE"   , T_CLOSE    },
+        { "INPUT"   , T_INPUT    },
+        { "NOINLINE", T_NOINLINE },
         { NULL      , 0          }
 };
 
+#define KINDEX_BITS 7                  // keyword index has 2^KINDEX_BITS slots
+#define KINDEX_SIZE (1 << KINDEX_BITS)
+#define KSEED_TRIES 65536              // multipliers tried before the keywords are taken to collide whatever the seed
+
+// keyword index, a perfect hash of the keywords built from ktab
+static uint8_t kindex[KINDEX_SIZE]; // ktab entry + 1 in each slot, 0 for none
+static uint32_t kseed;              // multiplier that gives no collisions, 0 until built
+
+// character classes that are skipped as a run
+enum {
+    SPAN_SPACE,      // isspace
+    SPAN_IDENTIFIER, // letters, digits, '$', '%' and '_'
+    SPAN_DIGIT       // digits and '_'
+};
+
+// vector operations to classify SCAN_VECTOR characters at once, the scalar loops handle the rest
+#if defined(__AVX2__)
+#define SCAN_VECTOR 32
+typedef __m256i scan_vec_t;
+#define VLOAD(p)   _mm256_loadu_si256((const __m256i*) (p))
+#define VEQ(v, ch) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(ch))
+#define VGT(a, b)  _mm256_cmpgt_epi8((a), (b))
+#define VSET(ch)   _mm256_set1_epi8(ch)
+#define VOR(a, b)  _mm256_or_si256((a), (b))
+#define VAND(a, b) _mm256_and_si256((a), (b))
+#define VMASK(v)   ((uint32_t) _mm256_movemask_epi8(v))
+#define VALL       0xffffffffu
+#elif defined(__SSE2__)
+#define SCAN_VECTOR 16
+typedef __m128i scan_vec_t;
+#define VLOAD(p)   _mm_loadu_si128((const __m128i*) (p))
+#define VEQ(v, ch) _mm_cmpeq_epi8((v), _mm_set1_epi8(ch))
+#define VGT(a, b)  _mm_cmpgt_epi8((a), (b))
+#define VSET(ch)   _mm_set1_epi8(ch)
+#define VOR(a, b)  _mm_or_si128((a), (b))
+#define VAND(a, b) _mm_and_si128((a), (b))
+#define VMASK(v)   ((uint32_t) _mm_movemask_epi8(v))
+#define VALL       0xffffu
+#endif
+
+// characters from lo to hi, bytes above 0x7f compare as negative and never match
+#define VRANGE(v, lo, hi) VAND(VGT((v), VSET((lo) - 1)), VGT(VSET((hi) + 1), (v)))
+
 // local function prototypes
 static int GetToken1(ParseContext_t *c);
+static bool InitKeywords(void);
+static uint32_t KeywordHash(const char *name, int len, uint32_t seed);
 static int IdentifierToken(ParseContext_t *c, int ch);
 static int IdentifierCharP(int ch);
 static int NumberToken(ParseContext_t *c, int ch);
@@ -73,12 +127,49 @@ static int StringToken(ParseContext_t *c);
 static int CharToken(ParseContext_t *c);
 static int LiteralChar(ParseContext_t *c);
 static int SkipComment(ParseContext_t *c);
+static int SpanClass(const char *p, const char *end, int cls);
+static const char* FindCommentEnd(const char *p, const char *end);
 static int XGetC(ParseContext_t *c);
 
 // InitScan - initialize the scanner
 void InitScan(ParseContext_t *c) {
     c->inComment = VMFALSE;
     c->savedToken = T_NONE;
+    if (!InitKeywords())
+        vm_system_abort(c->sys, "no keyword hash seed, two keywords share their first and last characters and length");
+}
+
+// InitKeywords - find a multiplier that hashes every keyword to its own slot and fill the keyword index, false if there is none
+static bool InitKeywords(void) {
+    uint32_t seed, i;
+    int k, j;
+
+    if (kseed != 0)
+        return true;
+
+    for (i = 1; i <= KSEED_TRIES; ++i) {
+        seed = (i * 0x9e3779b9u) | 1;
+        memset(kindex, 0, sizeof(kindex));
+        for (k = 0; ktab[k].keyword != NULL; ++k) {
+            j = KeywordHash(ktab[k].keyword, strlen(ktab[k].keyword), seed);
+            if (kindex[j] == 0)
+                kindex[j] = k + 1;
+            else if (strcasecmp(ktab[kindex[j] - 1].keyword, ktab[k].keyword) != 0)
+                break;
+        }
+        if (ktab[k].keyword == NULL) {
+            kseed = seed;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// KeywordHash - hash a name by its case folded first and last characters and its length
+static uint32_t KeywordHash(const char *name, int len, uint32_t seed) {
+    uint32_t key = toupper((uint8_t) name[0]) | toupper((uint8_t) name[len - 1]) << 8 | (uint32_t) len << 16;
+    return (key * seed) >> (32 - KINDEX_BITS);
 }
 
 // FRequire - fetch a token and check it
@@ -88,7 +179,7 @@ void FRequire(ParseContext_t *c, int requiredToken) {
 
 // Require - check for a required token
 void Require(ParseContext_t *c, int token, int requiredToken) {
-    char tknbuf[MAXTOKEN];
+    char tknbuf[sizeof("<FLOATNUMBER>")];
     if (token != requiredToken) {
         strcpy(tknbuf, TokenName(requiredToken));
         ParseError(c, "Expecting '%s', found '%s'", tknbuf, TokenName(token));
@@ -120,6 +211,7 @@ void SaveToken(ParseContext_t *c, int token) {
 char* TokenName(int token) {
     static char nameBuf[4];
     char *name;
+    int i;
 
     switch (token) {
         case T_NONE:
@@ -150,7 +242,16 @@ char* TokenName(int token) {
             case T_NOT:
             case T_RETURN:
             case T_PRINT:
-            name = ktab[token - T_REM].keyword;
+            case T_ASM:
+            case T_INCLUDE:
+            case T_OPEN:
+            case T_CLOSE:
+            case T_INPUT:
+            case T_NOINLINE:
+            for (i = 0; ktab[i].keyword != NULL; ++i)
+                if (ktab[i].token == token)
+                    break;
+            name = ktab[i].keyword ? ktab[i].keyword : "<KEYWORD>";
             break;
         case T_END_FUNCTION:
             name = "END FUNCTION";
@@ -164,6 +265,9 @@ char* TokenName(int token) {
         case T_END_ASM:
             name = "END ASM";
             break;
+        case T_LINE_INPUT:
+            name = "LINE INPUT";
+            break;
         case T_DO_WHILE:
             name = "DO WHILE";
             break;
@@ -233,7 +337,7 @@ static int GetToken1(ParseContext_t *c) {
     ch = SkipSpaces(c);
 
     // remember the start of the current token
-    c->tokenOffset = (int) (c->sys_line->linePtr - c->sys_line->lineBuf);
+    c->tokenOffset = (int) (c->sys_line->linePtr - c->sys_line->line);
 
     // check the next character
     switch (ch) {
@@ -288,6 +392,7 @@ static int GetToken1(ParseContext_t *c) {
             if (isdigit(ch))
                 tkn = NumberToken(c, ch);
             else if (IdentifierCharP(ch)) {
+                char saveToken[sizeof("LINE")];
                 char *savePtr;
                 switch (tkn = IdentifierToken(c, ch)) {
                     case T_ELSE:
@@ -347,6 +452,19 @@ static int GetToken1(ParseContext_t *c) {
                         else
                             c->sys_line->linePtr = savePtr;
                         break;
+                    case T_IDENTIFIER:
+                        // LINE is only special when followed by INPUT
+                        if (strcasecmp(c->token, "LINE") != 0)
+                            break;
+                        savePtr = c->sys_line->linePtr;
+                        strcpy(saveToken, c->token);
+                        if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch) && IdentifierToken(c, ch) == T_INPUT)
+                            tkn = T_LINE_INPUT;
+                        else {
+                            c->sys_line->linePtr = savePtr;
+                            strcpy(c->token, saveToken);
+                        }
+                        break;
                     case T_LOOP:
                         savePtr = c->sys_line->linePtr;
                         if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
@@ -380,22 +498,18 @@ static int IdentifierToken(ParseContext_t *c, int ch) {
     int len, i;
     char *p;
 
-    // get the identifier
+    // get the identifier, no comment can start inside it
     p = c->token;
     *p++ = ch;
-    len = 1;
-    while ((ch = GetChar(c)) != EOF && IdentifierCharP(ch)) {
-        if (++len > MAXTOKEN)
-            ParseError(c, "Identifier too long");
-        *p++ = ch;
-    }
-    UngetC(c);
-    *p = '\0';
+    len = SpanClass(c->sys_line->linePtr, c->sys_line->line + c->sys_line->lineLen, SPAN_IDENTIFIER);
+    memcpy(p, c->sys_line->linePtr, len);
+    c->sys_line->linePtr += len;
+    p[len] = '\0';
+    ++len;
 
-    // check to see if it is a keyword
-    for (i = 0; ktab[i].keyword != NULL; ++i)
-        if (strcasecmp(ktab[i].keyword, c->token) == 0)
-            return ktab[i].token;
+    // check to see if it is a keyword, only the keyword in its slot can match
+    if ((i = kindex[KeywordHash(c->token, len, kseed)]) != 0 && strcasecmp(ktab[i - 1].keyword, c->token) == 0)
+        return ktab[i - 1].token;
 
     // otherwise, it is an identifier
     return T_IDENTIFIER;
@@ -406,22 +520,21 @@ static int IdentifierCharP(int ch) {
     return isupper(ch)
             || islower(ch)
             || isdigit(ch)
-            || strchr("$%_", ch) != NULL;
+            || (ch != '\0' && strchr("$%_", ch) != NULL);
 }
 
 // NumberToken - get a number
 static int NumberToken(ParseContext_t *c, int ch) {
-    char *p = c->token;
+    char *p = c->token, *q, *end;
 
-    // get the number
+    // get the number, dropping the separators
     *p++ = ch;
-    while ((ch = GetChar(c)) != EOF) {
-        if (isdigit(ch))
-            *p++ = ch;
-        else if (ch != '_')
-            break;
-    }
-    UngetC(c);
+    q = c->sys_line->linePtr;
+    end = q + SpanClass(q, c->sys_line->line + c->sys_line->lineLen, SPAN_DIGIT);
+    for (; q < end; ++q)
+        if (*q != '_')
+            *p++ = *q;
+    c->sys_line->linePtr = end;
     *p = '\0';
     
     // convert the string to an integer
@@ -477,17 +590,13 @@ static int BinaryNumberToken(ParseContext_t *c) {
 
 // StringToken - get a string
 static int StringToken(ParseContext_t *c) {
-    int ch, len;
+    int ch;
     char *p;
 
     // collect the string
     p = c->token;
-    len = 0;
-    while ((ch = XGetC(c)) != EOF && ch != '"') {
-        if (++len > MAXTOKEN)
-            ParseError(c, "String too long");
+    while ((ch = XGetC(c)) != EOF && ch != '"')
         *p++ = (ch == '\\' ? LiteralChar(c) : ch);
-    }
     *p = '\0';
 
     // check for premature end of file
@@ -532,6 +641,8 @@ static int LiteralChar(ParseContext_t *c) {
 // SkipSpaces - skip leading spaces and the the next non-blank character
 int SkipSpaces(ParseContext_t *c) {
     int ch;
+    if (!c->inComment)
+        c->sys_line->linePtr += SpanClass(c->sys_line->linePtr, c->sys_line->line + c->sys_line->lineLen, SPAN_SPACE);
     while ((ch = GetChar(c)) != EOF)
         if (!isspace(ch))
             break;
@@ -540,14 +651,64 @@ int SkipSpaces(ParseContext_t *c) {
 
 // SkipComment - skip characters up to the end of a comment
 static int SkipComment(ParseContext_t *c) {
-    int lastch, ch;
-    lastch = '\0';
-    while ((ch = XGetC(c)) != EOF) {
-        if (lastch == '*' && ch == '/')
-            return VMTRUE;
-        lastch = ch;
+    System_line_t *sys = c->sys_line;
+    const char *end = sys->line + sys->lineLen, *p;
+
+    // a comment that isn't closed on this line continues on the next one
+    if ((p = FindCommentEnd(sys->linePtr, end)) == NULL) {
+        sys->linePtr = (char*) end;
+        return VMFALSE;
     }
-    return VMFALSE;
+    sys->linePtr = (char*) p;
+    return VMTRUE;
+}
+
+// SpanClass - count the characters of a class starting at p and before end
+static int SpanClass(const char *p, const char *end, int cls) {
+    const char *start = p;
+#ifdef SCAN_VECTOR
+    scan_vec_t v, m;
+    uint32_t miss;
+
+    for (; end - p >= SCAN_VECTOR; p += SCAN_VECTOR) {
+        v = VLOAD(p);
+        switch (cls) {
+            case SPAN_SPACE:
+                m = VOR(VEQ(v, ' '), VRANGE(v, '\t', '\r'));
+                break;
+            case SPAN_IDENTIFIER:
+                m = VOR(VOR(VRANGE(VOR(v, VSET(0x20)), 'a', 'z'), VRANGE(v, '0', '9')),
+                        VOR(VOR(VEQ(v, '$'), VEQ(v, '%')), VEQ(v, '_')));
+                break;
+            default:
+                m = VOR(VRANGE(v, '0', '9'), VEQ(v, '_'));
+                break;
+        }
+        if ((miss = ~VMASK(m) & VALL) != 0)
+            return (int) (p - start) + __builtin_ctz(miss);
+    }
+#endif
+    for (; p < end; ++p) {
+        int ch = (uint8_t) *p;
+        if (cls == SPAN_SPACE ? !isspace(ch) : cls == SPAN_IDENTIFIER ? !IdentifierCharP(ch) : !isdigit(ch) && ch != '_')
+            break;
+    }
+    return (int) (p - start);
+}
+
+// FindCommentEnd - find the character after the first "*/" starting at p and before end, NULL if there is none
+static const char* FindCommentEnd(const char *p, const char *end) {
+#ifdef SCAN_VECTOR
+    uint32_t hit;
+
+    for (; end - p > SCAN_VECTOR; p += SCAN_VECTOR)
+        if ((hit = VMASK(VAND(VEQ(VLOAD(p), '*'), VEQ(VLOAD(p + 1), '/')))) != 0)
+            return p + __builtin_ctz(hit) + 2;
+#endif
+    for (; end - p >= 2; ++p)
+        if (p[0] == '*' && p[1] == '/')
+            return p + 2;
+    return NULL;
 }
 
 // GetChar - get the next character
@@ -598,16 +759,14 @@ int GetChar(ParseContext_t *c) {
 
 // XGetC - get the next character without checking for comments
 static int XGetC(ParseContext_t *c) {
-    int ch;
-    
-    // get the next character on the current line
-    if (!(ch = *c->sys_line->linePtr++)) {
-        --c->sys_line->linePtr;
+    System_line_t *sys = c->sys_line;
+
+    // get the next character on the current line, a mapped line is followed by the next one
+    if (sys->linePtr >= sys->line + sys->lineLen)
         return EOF;
-    }
     
     // return the character
-    return ch;
+    return (uint8_t) *sys->linePtr++;
 }
 
 // UngetC - unget the most recent character
@@ -623,13 +782,13 @@ void ParseError(ParseContext_t *c, const char *fmt, ...) {
     // print the error message
     va_start(ap, fmt);
     vm_printf("error: ");
-    vm_printf(fmt, ap);
+    vm_vprintf(fmt, ap);
     vm_putchar('\n');
     va_end(ap);
 
     // show the context
     vm_printf("  line %d\n", c->lineNumber);
-    vm_printf("    %s", c->sys_line->lineBuf);
+    vm_printf("    %.*s\n", (int) strcspn(c->sys_line->line, "\n"), c->sys_line->line);
     vm_printf("    %*s^\n", c->tokenOffset, "");
 
     // exit until we fix the compiler so it can recover from parse errors
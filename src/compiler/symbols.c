@@ -16,15 +16,22 @@
  * @see https://github.com/hiperiondev/basic_lang
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "compile.h"
 
+#define SYMBOL_INDEX_MIN  8  // symbols a table holds before it gets a hash index
+#define SYMBOL_INDEX_INIT 32 // slots of a new hash index
+
 // local function prototypes
 static Symbol_t* AddLocalSymbol(ParseContext_t *c, SymbolTable_t *table, const char *name, StorageClass_t storageClass, Type_t *type, VMVALUE value);
+static void AddSymbol(ParseContext_t *c, SymbolTable_t *table, Symbol_t *sym);
+static void IndexSymbol(SymbolTable_t *table, Symbol_t *sym);
 static Symbol_t* FindSymbol(SymbolTable_t *table, const char *name);
+static uint32_t SymbolHash(const char *name);
 
 // InitSymbolTable - initialize a symbol table
 void InitSymbolTable(SymbolTable_t *table)
@@ -32,6 +39,8 @@ void InitSymbolTable(SymbolTable_t *table)
     table->head = NULL;
     table->pTail = &table->head;
     table->count = 0;
+    table->index = NULL;
+    table->indexSize = 0;
 }
 
 // AddGlobal - add a global symbol to the symbol table
@@ -44,13 +53,11 @@ Symbol_t* AddGlobal(ParseContext_t *c, const char *name, StorageClass_t storageC
     strcpy(sym->name, name);
     sym->placed = VMFALSE;
     sym->storageClass = storageClass;
+    sym->type = type;
     sym->value = value;
-    sym->next = NULL;
 
     // add it to the symbol table
-    *c->globals.pTail = sym;
-    c->globals.pTail = &sym->next;
-    ++c->globals.count;
+    AddSymbol(c, &c->globals, sym);
     
     // return the symbol
     return sym;
@@ -72,23 +79,52 @@ static Symbol_t* AddLocalSymbol(ParseContext_t *c, SymbolTable_t *table, const c
     Symbol_t *sym;
     
     // allocate the symbol structure
-    sym = (Symbol_t*) system_allocate_high_memory(c->sys, size);
+    sym = (Symbol_t*) system_arena_allocate(c->sys, size);
     strcpy(sym->name, name);
     sym->placed = VMTRUE;
     sym->storageClass = storageClass;
     sym->type = type;
     sym->value = value;
-    sym->next = NULL;
 
     // add it to the symbol table
-    *table->pTail = sym;
-    table->pTail = &sym->next;
-    ++table->count;
+    AddSymbol(c, table, sym);
     
     // return the symbol
     return sym;
 }
 
+// AddSymbol - link a symbol at the end of a symbol table and index it
+static void AddSymbol(ParseContext_t *c, SymbolTable_t *table, Symbol_t *sym) {
+    Symbol_t *p;
+
+    sym->hash = SymbolHash(sym->name);
+    sym->next = NULL;
+    *table->pTail = sym;
+    table->pTail = &sym->next;
+    ++table->count;
+
+    // small tables are searched in order, the index is kept at most three quarters full
+    if (table->count < SYMBOL_INDEX_MIN)
+        return;
+    if (table->count * 4 > table->indexSize * 3) {
+        table->indexSize = table->indexSize ? table->indexSize * 2 : SYMBOL_INDEX_INIT;
+        table->index = (Symbol_t**) system_arena_allocate(c->sys, table->indexSize * sizeof(Symbol_t*));
+        memset(table->index, 0, table->indexSize * sizeof(Symbol_t*));
+        for (p = table->head; p != NULL; p = p->next)
+            IndexSymbol(table, p);
+    } else
+        IndexSymbol(table, sym);
+}
+
+// IndexSymbol - enter a symbol in the hash index, the first symbol with a name is the one found
+static void IndexSymbol(SymbolTable_t *table, Symbol_t *sym) {
+    uint32_t mask = table->indexSize - 1, i;
+    for (i = sym->hash & mask; table->index[i] != NULL; i = (i + 1) & mask)
+        if (table->index[i]->hash == sym->hash && strcasecmp(table->index[i]->name, sym->name) == 0)
+            return;
+    table->index[i] = sym;
+}
+
 // FindGlobal - find a global symbol
 Symbol_t* FindGlobal(ParseContext_t *c, const char *name) {
     return FindSymbol(&c->globals, name);
@@ -106,15 +142,31 @@ Symbol_t* FindLocal(ParseContext_t *c, const char *name) {
 
 // FindSymbol - find a symbol in a symbol table
 static Symbol_t* FindSymbol(SymbolTable_t *table, const char *name) {
-    Symbol_t *sym = table->head;
-    while (sym) {
-        if (strcasecmp(name, sym->name) == 0)
-            return sym;
-        sym = sym->next;
+    uint32_t hash = SymbolHash(name), mask, i;
+    Symbol_t *sym;
+
+    if (table->index) {
+        mask = table->indexSize - 1;
+        for (i = hash & mask; (sym = table->index[i]) != NULL; i = (i + 1) & mask)
+            if (sym->hash == hash && strcasecmp(name, sym->name) == 0)
+                return sym;
+        return NULL;
     }
+
+    for (sym = table->head; sym != NULL; sym = sym->next)
+        if (sym->hash == hash && strcasecmp(name, sym->name) == 0)
+            return sym;
     return NULL;
 }
 
+// SymbolHash - FNV-1a hash of a name with the case folded, names match regardless of case
+static uint32_t SymbolHash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; ++name)
+        hash = (hash ^ (uint8_t) tolower((uint8_t) *name)) * 16777619u;
+    return hash;
+}
+
 // DumpSymbols - dump a symbol table
 void DumpSymbols(SymbolTable_t *table, const char *tag) {
     Symbol_t *sym;
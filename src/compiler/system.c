@@ -17,8 +17,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "system.h"
 
@@ -33,6 +38,7 @@ vm_context_t* system_init_context(uint8_t *freeSpace, size_t freeSize) {
     sys->nextHigh = sys->freeTop;
     sys->heapSize = sys->freeTop - sys->freeSpace;
     sys->maxHeapUsed = 0;
+    sys->chunks = NULL;
     return sys;
 }
 
@@ -47,6 +53,48 @@ void* system_allocate_high_memory(vm_context_t *sys, size_t size) {
     return sys->nextHigh;
 }
 
+// allocate compiler memory from the arena, a new chunk is added when the current one is full
+void* system_arena_allocate(vm_context_t *sys, size_t size) {
+    MemoryChunk_t *chunk = sys->chunks;
+    size_t chunkSize;
+    void *p;
+
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (!chunk || (size_t) (chunk->top - chunk->free) < size) {
+        chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        if (!(chunk = (MemoryChunk_t*) malloc(sizeof(MemoryChunk_t) + chunkSize)))
+            vm_system_abort(sys, "insufficient memory");
+        chunk->free = (uint8_t*) (chunk + 1);
+        chunk->top = chunk->free + chunkSize;
+        chunk->next = sys->chunks;
+        sys->chunks = chunk;
+    }
+    p = chunk->free;
+    chunk->free += size;
+    return p;
+}
+
+// release all the compiler memory of the arena
+void system_arena_release(vm_context_t *sys) {
+    MemoryChunk_t *chunk;
+    while ((chunk = sys->chunks) != NULL) {
+        sys->chunks = chunk->next;
+        free(chunk);
+    }
+}
+
+// initialize the line buffer
+bool system_init_line(System_line_t *sys) {
+    if (!(sys->lineBuf = (char*) malloc(MAXLINE)))
+        return false;
+    sys->lineMax = MAXLINE;
+    sys->lineBuf[0] = '\0';
+    sys->line = sys->linePtr = sys->lineBuf;
+    sys->lineLen = 0;
+    sys->map = NULL;
+    return true;
+}
+
 // GetMainSource - get the main source
 void system_get_main_source(System_line_t *sys, GetLineHandler **pGetLine, void **pGetLineCookie) {
     *pGetLine = sys->getLine;
@@ -59,11 +107,86 @@ void system_set_main_source(System_line_t *sys, GetLineHandler *getLine, void *g
     sys->getLineCookie = getLineCookie;
 }
 
+// ReadLine - read a whole line into the line buffer, doubling it until the line fits, every line ends with a newline
+static int ReadLine(System_line_t *sys, GetLineHandler *getLine, void *cookie, int *pLineNumber) {
+    int len = 0;
+    char *p;
+
+    for (;;) {
+        if (!(*getLine)(sys->lineBuf + len, sys->lineMax - len, pLineNumber, cookie)) {
+            if (len == 0)
+                return VMFALSE;
+            break;
+        }
+        len += strlen(sys->lineBuf + len);
+        if ((len > 0 && sys->lineBuf[len - 1] == '\n') || len < sys->lineMax - 1)
+            break;
+        if (!(p = (char*) realloc(sys->lineBuf, sys->lineMax * 2)))
+            break;
+        sys->lineBuf = p;
+        sys->lineMax *= 2;
+    }
+    if ((len == 0 || sys->lineBuf[len - 1] != '\n') && len < sys->lineMax - 1) {
+        sys->lineBuf[len++] = '\n';
+        sys->lineBuf[len] = '\0';
+    }
+
+    sys->line = sys->linePtr = sys->lineBuf;
+    sys->lineLen = len;
+    return VMTRUE;
+}
+
+// FileGetLine - line handler for an open file
+static char* FileGetLine(char *buf, int len, int *pLineNumber, void *cookie) {
+    return system_fs_getline(buf, len, cookie);
+}
+
 // GetLine - get the next input line
 int system_get_line(System_line_t *sys, int *pLineNumber) {
-    if (!(*sys->getLine)(sys->lineBuf, sizeof(sys->lineBuf) - 1, pLineNumber, sys->getLineCookie))
+    if (sys->map) {
+        if (!system_map_get_line(sys, sys->map))
+            return VMFALSE;
+        *pLineNumber = sys->map->lineNumber;
+        return VMTRUE;
+    }
+    return ReadLine(sys, sys->getLine, sys->getLineCookie, pLineNumber);
+}
+
+// get the next line of an open file
+int system_fs_get_line(System_line_t *sys, void *fp) {
+    return ReadLine(sys, FileGetLine, fp, NULL);
+}
+
+// get the next line of a mapped source without copying it, only a last line without a newline is copied to add one
+int system_map_get_line(System_line_t *sys, SourceMap_t *map) {
+    char *p;
+    size_t len;
+    
+    if (map->next >= map->end)
         return VMFALSE;
-    sys->linePtr = sys->lineBuf;
+        
+    if ((p = (char*) memchr(map->next, '\n', map->end - map->next)) != NULL) {
+        sys->line = map->next;
+        sys->lineLen = (int) (p + 1 - map->next);
+        map->next = p + 1;
+    } else {
+        len = map->end - map->next;
+        while (len + 2 > (size_t) sys->lineMax) {
+            if (!(p = (char*) realloc(sys->lineBuf, sys->lineMax * 2)))
+                return VMFALSE;
+            sys->lineBuf = p;
+            sys->lineMax *= 2;
+        }
+        memcpy(sys->lineBuf, map->next, len);
+        sys->lineBuf[len++] = '\n';
+        sys->lineBuf[len] = '\0';
+        sys->line = sys->lineBuf;
+        sys->lineLen = (int) len;
+        map->next = map->end;
+    }
+
+    sys->linePtr = sys->line;
+    ++map->lineNumber;
     return VMTRUE;
 }
 
@@ -79,6 +202,34 @@ void system_fs_close(void *fp) {
     fclose((FILE*) fp);
 }
 
+// map a source file into memory, false if it can't be opened or mapped
+bool system_fs_map(const char *name, SourceMap_t *map) {
+    struct stat st;
+    void *base = NULL;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || (st.st_size > 0 && (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    map->base = map->next = (char*) base;
+    map->end = base ? map->base + st.st_size : NULL;
+    map->lineNumber = 0;
+    return true;
+}
+
+// unmap a source file
+void system_fs_unmap(SourceMap_t *map) {
+    if (map->base)
+        munmap(map->base, map->end - map->base);
+    map->base = map->next = map->end = NULL;
+}
+
 int system_fs_opendir(const char *path, VMDIR_t *dir) {
     if (!(dir->dirp = opendir(path)))
         return -1;
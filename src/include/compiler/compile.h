@@ -29,7 +29,13 @@
 #include "system.h"
 
 // program limits
-#define MAXTOKEN  32
+#define MAXBLOCKS 10 // initial depth of the block stack, it grows with deeper nesting
+
+// version of the compiler, part of the key of a cached image
+#define COMPILER_VERSION "0.1"
+
+// initial value of a source hash
+#define SOURCE_HASH_INIT 0xcbf29ce484222325ull
 
 // frame size
 #define F_SIZE     1
@@ -46,19 +52,24 @@ typedef struct functions_s {
     Symbol_t *symbol;
     VMVALUE code;
     size_t codeLen;
+    int argc;
+    VMVALUE name;
 } functions_t;
 
 // parse file
 struct ParseFile_s {
        ParseFile_t *next;
     IncludedFile_t *file;
-              void *fp;
+              void *fp;  // file read a line at a time when it can't be mapped
+       SourceMap_t map;
                int lineNumber;
 };
 
 // included file
 struct IncludedFile_s {
     IncludedFile_t *next;
+              bool hashed; // false when the file was read a line at a time
+          uint64_t hash;   // hash of the contents that were compiled
               char name[1];
 };
 
@@ -93,6 +104,10 @@ enum {
     T_PRINT,
     T_ASM,
     T_INCLUDE,
+    T_OPEN,
+    T_CLOSE,
+    T_INPUT,
+    T_NOINLINE,
     T_END_FUNCTION, // compound keywords
     T_END_SUB,
     T_ELSE_IF,
@@ -102,6 +117,7 @@ enum {
     T_LOOP_WHILE,
     T_LOOP_UNTIL,
     T_END_ASM,
+    T_LINE_INPUT,
     T_LE, // non-keyword tokens
     T_NE,
     T_GE,
@@ -201,11 +217,14 @@ struct SymbolTable_s {
     Symbol_t *head;
     Symbol_t **pTail;
          int count;
+    Symbol_t **index;    // open addressing hash index, NULL while the table is small
+         int indexSize;  // number of slots, a power of two
 };
 
 // symbol structure
 struct Symbol_s {
           Symbol_t *next;
+          uint32_t hash; // hash of the case folded name
     StorageClass_t storageClass;
             Type_t *type;
                int placed;
@@ -213,6 +232,57 @@ struct Symbol_s {
               char name[1];
 };
 
+// address coded in a function kept between compiles, relinked by name
+typedef struct {
+           VMVALUE offset;       // offset of the operand word from the start of the function
+    StorageClass_t storageClass; // storage class of the global when the code was generated
+              char *name;        // name of the global, NULL for a string
+              char *data;        // text of the string, NULL for a global
+} CachedRef_t;
+
+// code of a function kept from an earlier compile
+typedef struct CachedFunction_s CachedFunction_t;
+struct CachedFunction_s {
+    CachedFunction_t *next;
+            uint32_t hash;    // hash of the case folded name
+            uint64_t source;  // hash of the source lines and of the global constants they use
+            uint64_t context; // options and known global values the code was generated with
+                 int seen;    // last compile that defined the function
+                 int fresh;   // the function and every function it references are unchanged in the current compile
+    CachedFunction_t **callers; // functions of the current compile that reference this one
+                 int callerCnt;
+                 int callerMax;
+             uint8_t *code;   // code before the peephole pass, NULL when the function wasn't generated
+              size_t codeLen;
+         CachedRef_t *refs;
+                 int refCnt;
+                char name[1];
+};
+
+// functions kept between the compiles of the interactive editor
+typedef struct {
+    CachedFunction_t **buckets;   // hash chains indexed by the name hash
+                 int bucketCnt;   // a power of two
+                 int count;
+                 int compile;     // number of the current compile
+} FunctionCache_t;
+
+// code of a function generated into a private buffer by a worker thread
+typedef struct {
+      uint8_t *code;
+       size_t codeLen;
+    CodeRef_t *refs;  // addresses coded in the function, the offsets are relative to its start
+          int refCnt;
+} GeneratedCode_t;
+
+// compiled image loaded from the image cache
+typedef struct {
+     uint8_t *code; // image, allocated with malloc
+    uint32_t codeLen;
+    uint32_t mainCode;
+    uint32_t exports;
+} CachedImage_t;
+
 // parse context
 typedef struct {
          vm_context_t *sys;                // system context
@@ -223,20 +293,28 @@ typedef struct {
                   int lineNumber;          // scan - current line number
                   int savedToken;          // scan - lookahead token
                   int tokenOffset;         // scan - offset to the start of the current token
-                 char token[MAXTOKEN];     // scan - current token string
+                 char *token;              // scan - current token string
+                  int tokenMax;            // scan - size of the token buffer, at least the size of the line buffer
               VMVALUE tokenValue;          // scan - current token integer value
                   int inComment;           // scan - inside of a slash/star comment
         SymbolTable_t globals;             // parse - global variables and constants
              String_t *strings;            // parse - string constants
       ParseTreeNode_t *mainFunction;       // parse - the main function
       ParseTreeNode_t *currentFunction;    // parse - the function currently being parsed
-              Block_t blockBuf[10];        // parse - stack of nested blocks
+      NodeListEntry_t *functions;          // parse - function definitions in source order
+      NodeListEntry_t **pNextFunction;     // parse - where to link the next function definition
+              Block_t *blockBuf;           // parse - stack of nested blocks
               Block_t *bptr;               // parse - current block
               Block_t *btop;               // parse - top of block stack
                Type_t unknownType;         // parse - unknown type
                Type_t integerType;         // parse - integer type
                Type_t stringType;          // parse - string type
                Type_t integerFunctionType; // parse - integer function type
+      FunctionCache_t *cache;              // compile - code kept from the previous compile, NULL to generate every function
+             uint64_t knownGlobals;        // compile - hash of the global variables replaced by their values
+      NodeListEntry_t *usedFunctions;      // compile - used functions with the ones they call first
+      NodeListEntry_t **pNextUsed;         // compile - where to link the next used function
+                  int usedCnt;             // compile - number of used functions
 } ParseContext_t;
 
 // parse tree node types
@@ -279,6 +357,13 @@ struct ParseTreeNod_se {
             SymbolTable_t locals;
             int argumentOffset;
             int localOffset;
+            int noInline;
+            int included; // defined in an INCLUDE file, dropped when nothing calls it
+            int used;     // reached from main or from a function that is kept
+            uint64_t source;           // hash of the source lines and of the global constants they use
+            CachedFunction_t *cached;  // code from an earlier compile that can be reused, NULL to generate it
+            GeneratedCode_t *generated; // code from a worker thread waiting to be linked, NULL to generate it
+            int order;                  // position among the used functions, a function only inlines the ones before it
             NodeListEntry_t *bodyStatements;
         } functionDefinition;
         struct {
@@ -296,6 +381,8 @@ struct ParseTreeNod_se {
             ParseTreeNode_t *endExpr;
             ParseTreeNode_t *stepExpr;
             NodeListEntry_t *bodyStatements;
+            int limitOffset; // hidden local holding the limit
+            int stepOffset;  // hidden local holding the step, -1 for a literal step
         } forStatement;
         struct {
             ParseTreeNode_t *test;
@@ -352,13 +439,14 @@ struct NodeListEntry_s {
 
 // compile.c
  ParseContext_t* InitCompileContext(vm_context_t *sys);
-            void Compile(ParseContext_t *c, bool debug);
+             int Compile(ParseContext_t *c, bool debug);
 
 // parse.c
  ParseContext_t* InitParseContext(vm_context_t *sys);
              int PushFile(ParseContext_t *c, const char *name);
              int ParseGetLine(ParseContext_t *c);
 ParseTreeNode_t* StartFunction(ParseContext_t *c, Symbol_t *symbol);
+ParseTreeNode_t* FindFunction(ParseContext_t *c, Symbol_t *symbol);
             void ParseStatement(ParseContext_t *c, int tkn);
          VMVALUE ParseIntegerConstant(ParseContext_t *c);
 ParseTreeNode_t* NewParseTreeNode(ParseContext_t *c, int type);
@@ -369,6 +457,28 @@ ParseTreeNode_t* NewParseTreeNode(ParseContext_t *c, int type);
 // assemble.c
             void ParseAsm(ParseContext_t *c);
 
+// constant.c
+            void InitGlobals(ParseContext_t *c);
+            void ConstantGlobals(ParseContext_t *c);
+
+// evaluate.c
+            void EvaluateCalls(ParseContext_t *c);
+
+// image.c
+        uint64_t ImageKey(const SourceMap_t *source, int optLevel, int isa);
+            bool LoadCachedImage(const char *dir, uint64_t key, CachedImage_t *image);
+            void StoreCachedImage(const char *dir, uint64_t key, ParseContext_t *c);
+
+// parallel.c
+            void GenerateParallel(ParseContext_t *c);
+
+// reuse.c
+        uint64_t HashSource(uint64_t hash, const void *data, size_t size);
+            void CheckCachedFunctions(ParseContext_t *c);
+             int GenerateCached(ParseContext_t *c, ParseTreeNode_t *node);
+            void CacheFunction(ParseContext_t *c, ParseTreeNode_t *node, VMVALUE code);
+            void UpdateFunctionCache(ParseContext_t *c);
+
 // scan.c
             void InitScan(ParseContext_t *c);
             void FRequire(ParseContext_t *c, int requiredToken);
@@ -395,13 +505,19 @@ ParseTreeNode_t* NewParseTreeNode(ParseContext_t *c, int type);
 // generate.c
 GenerateContext_t* InitGenerateContext(vm_context_t *sys);
            VMVALUE Generate(GenerateContext_t *c, ParseTreeNode_t *node);
+           VMVALUE GenerateCopy(GenerateContext_t *c, ParseTreeNode_t *node, const uint8_t *code, size_t codeSize, const CodeRef_t *refs, int refCnt);
               void PlaceSymbol(GenerateContext_t *c, Symbol_t *sym, VMUVALUE offset);
            VMVALUE StoreVector(GenerateContext_t *c, const VMVALUE *buf, int size);
            VMVALUE StoreByteVector(GenerateContext_t *c, const uint8_t *buf, int size);
+           VMVALUE StoreExports(GenerateContext_t *c);
               void DumpFunctions(GenerateContext_t *c);
            VMVALUE codeaddr(GenerateContext_t *c);
            VMVALUE putcbyte(GenerateContext_t *c, int b);
            VMVALUE putcword(GenerateContext_t *c, VMVALUE w);
            VMVALUE putdword(GenerateContext_t *c, VMVALUE w);
+              void code_symbolRef(GenerateContext_t *c, Symbol_t *sym);
+              void code_symbolWord(GenerateContext_t *c, Symbol_t *sym);
+              void code_stringWord(GenerateContext_t *c, String_t *str);
+              void fixupbranch(GenerateContext_t *c, VMUVALUE chn, VMUVALUE val);
 
 #endif
@@ -0,0 +1,66 @@
+/*
+ * @ir.h
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#ifndef __IR_H__
+#define __IR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "compile.h"
+
+// bytecode instruction
+typedef struct IrInst_s {
+    uint8_t op;     // opcode
+    uint8_t fmt;    // operand format (FMT_xxx)
+       bool dead;   // removed by a pass
+    VMVALUE arg;    // operand, the target instruction index for branches
+    VMVALUE regs;   // FORNEXT variable, limit and step bytes, first one highest
+    VMVALUE addr;   // original code offset
+    VMVALUE naddr;  // code offset after encoding
+    int32_t block;  // basic block index
+} IrInst_t;
+
+// basic block, a range of instructions
+typedef struct IrBlock_s {
+    int32_t first;  // first instruction
+    int32_t last;   // one past the last instruction
+    int32_t succ[2];// successor blocks or -1
+       bool reachable;
+} IrBlock_t;
+
+// bytecode of one function
+typedef struct IrFunction_s {
+    functions_t *fcn;
+       IrInst_t *inst;
+        int32_t cnt;
+        int32_t max;
+      IrBlock_t *blocks;
+        int32_t blockCnt;
+} IrFunction_t;
+
+IrFunction_t* ir_build(GenerateContext_t *g, functions_t *fcn);
+         void ir_blocks(IrFunction_t *f);
+      int32_t ir_next(IrFunction_t *f, int32_t k);
+         bool ir_is_branch(const IrInst_t *inst);
+         bool ir_is_jump(const IrInst_t *inst);
+         void ir_encode(GenerateContext_t *g, IrFunction_t *f, VMVALUE *remap);
+         void ir_print(IrFunction_t *f);
+         void ir_free(IrFunction_t *f);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * @mir.h
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#ifndef __MIR_H__
+#define __MIR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "compile.h"
+
+// optimization levels
+#define MIR_LEVEL_NONE    0 // the parse tree is coded directly
+#define MIR_LEVEL_DEFAULT 1
+#define MIR_LEVEL_MAX     2
+
+// operand kinds
+typedef enum {
+    MIR_NONE,
+    MIR_VREG,   // virtual register
+    MIR_CONST,  // integer constant
+    MIR_SYMBOL, // address of a global symbol
+    MIR_STRING  // address of a string constant
+} MirOperandKind_t;
+
+// instruction opcodes
+typedef enum {
+    MIR_MOV,    // d = a
+    MIR_UNARY,  // d = code a
+    MIR_BINARY, // d = a code b
+    MIR_LOAD,   // d = [a]
+    MIR_STORE,  // [b] = a
+    MIR_INDEX,  // d = a + b * sizeof(VMVALUE)
+    MIR_CALL,   // d = a(args), d may be -1
+    MIR_BR,     // goto succ[0]
+    MIR_CBR,    // if a goto succ[0] else goto succ[1]
+    MIR_RET,    // return a
+    MIR_RETZ,   // return zero
+    MIR_HALT,   // end of the main function
+    _MIR_MAX
+} MirOpcode_t;
+
+// operand
+typedef struct MirOperand_s {
+    uint8_t kind;
+    union {
+         int32_t vreg;
+         VMVALUE value;
+        Symbol_t *sym;
+        String_t *str;
+    } u;
+} MirOperand_t;
+
+// three address instruction
+typedef struct MirInst_s {
+         uint8_t op;
+         uint8_t code;  // vm opcode of a unary or binary operation
+         int32_t dst;   // destination register or -1
+    MirOperand_t a;
+    MirOperand_t b;
+    MirOperand_t *args; // call arguments in push order
+         int32_t argc;
+} MirInst_t;
+
+// basic block, the last instruction is always a terminator
+typedef struct MirBlock_s {
+    MirInst_t *inst;
+      int32_t cnt;
+      int32_t max;
+      int32_t succ[2];  // successor blocks or -1
+      int32_t predCnt;  // number of predecessors (see mir_preds)
+         bool dead;     // removed from the function
+      VMVALUE addr;     // code offset (generator)
+      VMVALUE fixups;   // branch fixup chain (generator)
+} MirBlock_t;
+
+// function
+typedef struct MirFunction_s {
+       vm_context_t *sys;
+    ParseTreeNode_t *node;
+         MirBlock_t *blocks;
+            int32_t blockCnt;
+            int32_t blockMax;
+            int32_t *layout;   // blocks in code order
+            int32_t layoutCnt;
+            int32_t argc;      // registers 0..argc-1 are the arguments
+            int32_t varCnt;    // registers argc..varCnt-1 are the locals, the rest are temporaries
+            int32_t vregCnt;
+            int32_t cur;       // block being built
+               bool failed;    // the function can't be lowered
+               bool unrolled;  // the loops were already unrolled
+} MirFunction_t;
+
+// optimization pass
+typedef struct MirPass_s {
+    const char *name;
+           int level;          // minimum optimization level
+          bool (*run)(MirFunction_t *f);
+} MirPass_t;
+
+// mir.c
+MirFunction_t* mir_build(GenerateContext_t *g, ParseTreeNode_t *node);
+          void mir_free(MirFunction_t *f);
+    MirInst_t* mir_append(MirFunction_t *f, int op);
+    MirInst_t* mir_insert(MirFunction_t *f, MirBlock_t *blk);
+       int32_t mir_new_block(MirFunction_t *f);
+       int32_t mir_new_vreg(MirFunction_t *f);
+    MirInst_t* mir_term(MirBlock_t *b);
+          void mir_preds(MirFunction_t *f);
+ MirOperand_t* mir_operand(MirInst_t *inst, int k);
+          bool mir_same_operand(const MirOperand_t *a, const MirOperand_t *b);
+       int32_t mir_fornext(MirBlock_t *blk, int32_t *pVar, int32_t *pLimit, VMVALUE *pStep);
+          bool mir_has_side_effects(const MirInst_t *inst);
+          void mir_print(MirFunction_t *f);
+
+// mirpass.c
+          void mir_optimize(MirFunction_t *f, int level);
+          bool mir_fold(int code, VMVALUE a, VMVALUE b, VMVALUE *pValue);
+
+// mirinline.c
+          void mir_inline_reset(void);
+          void mir_inline_expect(ParseTreeNode_t *node);
+          bool mir_inline_register(MirFunction_t *f);
+          void mir_inline_finish(ParseTreeNode_t *node);
+          bool mir_inline(MirFunction_t *f);
+
+// mirconst.c
+          bool mir_constprop(MirFunction_t *f);
+          bool mir_dse(MirFunction_t *f);
+
+// mirloop.c
+          bool mir_licm(MirFunction_t *f);
+          bool mir_unroll(MirFunction_t *f);
+
+// mirgen.c
+          bool mir_generate(GenerateContext_t *g, MirFunction_t *f);
+
+// mirreg.c
+          bool mir_generate_reg(GenerateContext_t *g, MirFunction_t *f);
+
+#endif
@@ -21,13 +21,15 @@
 
 #include <dirent.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <setjmp.h>
 
 #include "vmtypes.h"
 #include "vmsystem.h"
 
 // program limits
-#define MAXLINE  128
+#define MAXLINE          128         // initial size of the line buffer, it grows to fit longer lines
+#define ARENA_CHUNK_SIZE (16 * 1024) // size of the chunks of the compiler arena
 
 // line input handler
 typedef char* GetLineHandler(char *buf, int len, int *pLineNumber, void *cookie);
@@ -50,32 +52,74 @@ typedef struct {
     char name[FILENAME_MAX];
 } VMDIRENT_t;
 
+// source file mapped into memory, its lines are scanned in place
+typedef struct {
+    char *base;      // start of the mapping, NULL for an empty file
+    char *next;      // start of the next line
+    char *end;       // end of the file
+     int lineNumber; // number of the last line read
+} SourceMap_t;
 
 typedef struct System_line_s {
     GetLineHandler *getLine;         // function to get a line from the source program
               void *getLineCookie;   // cookie for the rewind and getLine functions
-              char lineBuf[MAXLINE]; // current input line
+       SourceMap_t *map;             // mapped main source, read instead of getLine when set
+              char *lineBuf;         // line buffer
+               int lineMax;          // size of the line buffer
+              char *line;            // current input line, in the line buffer or in a mapped source
+               int lineLen;          // length of the current line, it ends at a newline or a nul
               char *linePtr;         // pointer to the current character
 } System_line_t;
 
+// chunk of the compiler arena
+typedef struct MemoryChunk_s {
+    struct MemoryChunk_s *next;
+                 uint8_t *free; // next free byte
+                 uint8_t *top;  // end of the chunk
+} MemoryChunk_t;
+
 // code generator context
+// operand word of a function that holds the address of a global or of a string
+typedef struct {
+                VMVALUE offset; // offset of the word in the code buffer, or in the function for kept code
+        struct Symbol_s *sym;   // the global, NULL for a string
+        struct String_s *str;   // the string, NULL for a global
+} CodeRef_t;
+
 typedef struct GenerateContext_s {
     vm_context_t *sys;
          uint8_t *codeBuf;
         uint32_t code_len;
         uint32_t mainCode;
+        uint32_t exports;
+             int optLevel; // optimization level (-O0, -O1, -O2)
+             int isa;      // instruction set the functions are generated for (VM_ISA_STACK, VM_ISA_REGISTER)
+            bool debug;    // dump the mid-level ir of each function
+             int threads;  // worker threads that generate the functions, 1 generates them in order
+            bool privateCode; // code goes to a private buffer that grows, the addresses are left to the link step
+       CodeRef_t *refs;    // addresses coded in the current function
+             int refCnt;   // number of addresses coded in the current function
+             int refMax;   // size of the address list
 } GenerateContext_t;
 
 vm_context_t* system_init_context(uint8_t *freeSpace, size_t freeSize);
         void* system_allocate_high_memory(vm_context_t *sys, size_t size);
+        void* system_arena_allocate(vm_context_t *sys, size_t size);
+         void system_arena_release(vm_context_t *sys);
+
+         bool system_init_line(System_line_t *sys);
 
          void system_get_main_source(System_line_t *sys, GetLineHandler **pGetLine, void **pGetLineCookie);
          void system_set_main_source(System_line_t *sys, GetLineHandler *getLine, void *getLineCookie);
           int system_get_line(System_line_t *sys, int *pLineNumber);
+          int system_fs_get_line(System_line_t *sys, void *fp);
+          int system_map_get_line(System_line_t *sys, SourceMap_t *map);
 
         void* system_fs_open(vm_context_t *sys, const char *name, const char *mode);
         char* system_fs_getline(char *buf, int size, void *fp);
          void system_fs_close(void *fp);
+         bool system_fs_map(const char *name, SourceMap_t *map);
+         void system_fs_unmap(SourceMap_t *map);
           int system_fs_opendir(const char *path, VMDIR_t *dir);
           int system_fs_readdir(VMDIR_t *dir, VMDIRENT_t *entry);
          void system_fs_closedir(VMDIR_t *dir);
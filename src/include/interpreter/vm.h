@@ -40,13 +40,52 @@ enum {
     TRAP_PrintTab   = 4,
     TRAP_PrintNL    = 5,
     TRAP_PrintFlush = 6,
+    TRAP_Open       = 7,
+    TRAP_Close      = 8,
+    TRAP_InputInt   = 9,
+    TRAP_LineInput  = 10,
+    TRAP_Eof        = 11,
+    TRAP_InputEnd   = 12,
 };
 
+// execution status
+enum {
+    VM_ERROR   = 0, // aborted
+    VM_HALTED  = 1, // ran to completion
+    VM_PENDING = 2, // suspended by a trap, continue with vm_resume
+};
+
+// i/o channels, channel 0 is the console
+#define VM_MAXCHANNEL   16
+
+// header at the start of a compiled image
+typedef struct vm_image_s {
+    uint32_t exports;  // offset of the exported function table, 0 if there is none
+    uint32_t reserved;
+} vm_image_t;
+
+// version of the image files saved by SAVEBIN, the high bytes are "BV"
+#define VM_IMAGE_VERSION 0x42560002
+
+// exported function table entry (stored in the image)
+typedef struct vm_export_s {
+    VMVALUE code; // offset of the function code
+    VMVALUE argc; // number of arguments
+    VMVALUE name; // offset of the function name
+} vm_export_t;
+
+// host trap handler, called for trap codes the interpreter does not handle
+// a handler may suspend the vm with vm_suspend and continue it later with vm_resume, under an event loop
+// it either waits on a descriptor with vm_loop_wait or is continued by the host with vm_loop_resume
+struct vm_s;
+typedef void vm_trap_handler_t(struct vm_s *i, uint8_t op);
+
 // interpreter state structure
 typedef struct vm_s {
             bool code_referenced;
          uint8_t *code;
          uint32_t codelen;
+         uint32_t exports;
          jmp_buf errorTarget;
          VMVALUE *stack;
          VMVALUE *stackTop;
@@ -55,6 +94,12 @@ typedef struct vm_s {
          VMVALUE *fp;
          VMVALUE *sp;
          VMVALUE tos;
+         struct vm_channel_s *channels[VM_MAXCHANNEL];
+            bool pending;  // suspended by a trap
+            struct vm_loop_s *loop; // event loop or NULL
+             int waitFd;   // descriptor the loop is waiting on
+ vm_trap_handler_t *hostTrap;
+            void *user;    // host data
 } vm_t;
 
 // stack frame offsets
@@ -81,11 +126,20 @@ typedef struct vm_s {
 #define vm_top(i)            (*(i)->sp)
 #define vm_drop(i, n)        ((i)->sp += (n))
 
+// register operand n bytes after pc
+#define vm_reg(i, n)         ((i)->fp[(int8_t) VMCODEBYTE((i)->pc + (n))])
+
 // prototypes from db_vmint.c
   vm_t* vm_init(uint8_t *code, uint32_t code_len, VMVALUE stackSize, bool reference_code);
+   void vm_image(vm_t *i);
    void vm_deinit(vm_t *i);
 uint8_t vm_execute(vm_t *i, VMVALUE mainCode);
+uint8_t vm_call(vm_t *i, const char *fname, const VMVALUE *args, int argc, VMVALUE *result);
+uint8_t vm_call_batch(vm_t *i, const char *fname, const VMVALUE *argv, size_t rows, int argc, VMVALUE *results);
+   void vm_suspend(vm_t *i);
+uint8_t vm_resume(vm_t *i, VMVALUE result);
    void vm_abort(vm_t *i, const char *fmt, ...);
+vm_export_t* vm_find_function(vm_t *i, const char *fname);
 
 // prototypes and variables
    typedef void vm_intrinsic_func(vm_t *i);
@@ -0,0 +1,65 @@
+/*
+ * @vmchannel.h
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#ifndef __VMCHANNEL_H__
+#define __VMCHANNEL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// size of the per channel buffer
+#define VM_CHANNEL_BUFSIZE  4096
+
+// input files at least this large are mapped instead of read
+#define VM_CHANNEL_MMAP_MIN (64 * 1024)
+
+// channel open modes (must match the parser)
+enum {
+    CHN_INPUT  = 0,
+    CHN_OUTPUT = 1,
+    CHN_APPEND = 2,
+};
+
+// file channel
+typedef struct vm_channel_s {
+        int mode;                    // open mode
+        int fd;                      // file descriptor
+       bool regular;                 // regular file, reads never block
+    uint8_t *ptr;                    // next input byte
+    uint8_t *end;                    // end of the available input
+    uint8_t *map;                    // mapped input file or NULL
+     size_t mapLen;                  // length of the mapping
+     size_t bufCnt;                  // bytes waiting in the output buffer
+    uint8_t buf[VM_CHANNEL_BUFSIZE]; // read or write buffer
+} vm_channel_t;
+
+   void vm_channel_open(vm_t *i, VMVALUE chn, const char *name, VMVALUE mode);
+   void vm_channel_close(vm_t *i, VMVALUE chn);
+   void vm_channel_close_all(vm_t *i);
+   void vm_channel_puts(vm_t *i, VMVALUE chn, const char *str);
+   void vm_channel_putc(vm_t *i, VMVALUE chn, int ch);
+VMVALUE vm_channel_input_int(vm_t *i, VMVALUE chn);
+   void vm_channel_input_end(vm_t *i, VMVALUE chn);
+VMVALUE vm_channel_line_input(vm_t *i, VMVALUE chn, VMVALUE addr, VMVALUE size);
+VMVALUE vm_channel_eof(vm_t *i, VMVALUE chn);
+    int vm_channel_wait_fd(vm_t *i, VMVALUE chn, bool line);
+
+#endif
@@ -29,6 +29,14 @@
 #define FMT_WORD    3
 #define FMT_NATIVE  4
 #define FMT_BR      5
+#define FMT_REG     6  // ra
+#define FMT_REG2    7  // rd, ra
+#define FMT_REG3    8  // rd, ra, rb
+#define FMT_REGI    9  // rd, ra, short literal
+#define FMT_REGS    10 // rd, short literal
+#define FMT_REGW    11 // rd, literal
+#define FMT_REGBR   12 // ra, branch
+#define FMT_FORNEXT 13 // var, limit, short literal step, branch
 
 typedef struct {
      int code;
@@ -0,0 +1,56 @@
+/*
+ * @vmloop.h
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#ifndef __VMLOOP_H__
+#define __VMLOOP_H__
+
+#include <stdint.h>
+
+#include "vm.h"
+
+// the poll() stand-in is used where epoll is not available
+#if !defined(__linux__) && !defined(VM_LOOP_POLL)
+#define VM_LOOP_POLL
+#endif
+
+// maximum events handled per wait
+#define VM_LOOP_EVENTS  64
+
+// called when a vm attached to the loop halts or aborts
+typedef void vm_loop_done_t(vm_t *i, uint8_t status);
+
+// event loop
+typedef struct vm_loop_s {
+               int fd;      // epoll descriptor
+               int waiting; // number of suspended vms
+    vm_loop_done_t *done;   // completion callback
+#ifdef VM_LOOP_POLL
+     struct pollfd *fds;    // descriptors being waited on
+              vm_t **vms;   // vm waiting on each descriptor
+               int max;     // size of the arrays
+#endif
+} vm_loop_t;
+
+vm_loop_t* vm_loop_init(vm_loop_done_t *done);
+      void vm_loop_deinit(vm_loop_t *loop);
+   uint8_t vm_loop_start(vm_loop_t *loop, vm_t *i, VMVALUE mainCode);
+      void vm_loop_wait(vm_t *i, int fd);
+   uint8_t vm_loop_resume(vm_t *i, VMVALUE result);
+       int vm_loop_run(vm_loop_t *loop);
+
+#endif
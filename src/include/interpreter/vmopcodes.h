@@ -67,7 +67,46 @@ enum OPCODES {
     OP_NATIVE,  // 0x27 execute native code
     OP_TRAP,    // 0x28 trap to handler
     OP_RETURNZ, // 0x29 return zero elements
-    OP_CLEAN    // 0x2c drop n elements
+    OP_CLEAN,   // 0x2a drop n elements
+
+    // register instructions, a register is a frame slot addressed by a signed byte offset from fp
+    OP_RMOV,    // 0x2b rd = ra
+    OP_RLIT,    // 0x2c rd = literal
+    OP_RSLIT,   // 0x2d rd = short literal (-128 to 127)
+    OP_RNOT,    // 0x2e rd = !ra
+    OP_RNEG,    // 0x2f rd = -ra
+    OP_RBNOT,   // 0x30 rd = ~ra
+    OP_RADD,    // 0x31 rd = ra + rb
+    OP_RSUB,    // 0x32 rd = ra - rb
+    OP_RMUL,    // 0x33 rd = ra * rb
+    OP_RDIV,    // 0x34 rd = ra / rb
+    OP_RREM,    // 0x35 rd = ra % rb
+    OP_RBAND,   // 0x36 rd = ra & rb
+    OP_RBOR,    // 0x37 rd = ra | rb
+    OP_RBXOR,   // 0x38 rd = ra ^ rb
+    OP_RSHL,    // 0x39 rd = ra << rb
+    OP_RSHR,    // 0x3a rd = ra >> rb
+    OP_RLT,     // 0x3b rd = ra < rb
+    OP_RLE,     // 0x3c rd = ra <= rb
+    OP_REQ,     // 0x3d rd = ra == rb
+    OP_RNE,     // 0x3e rd = ra != rb
+    OP_RGE,     // 0x3f rd = ra >= rb
+    OP_RGT,     // 0x40 rd = ra > rb
+    OP_RADDI,   // 0x41 rd = ra + short literal
+    OP_RLOAD,   // 0x42 rd = long at address ra
+    OP_RSTORE,  // 0x43 long at address rb = ra
+    OP_RINDEX,  // 0x44 rd = ra + rb * sizeof(VMVALUE)
+    OP_RBRT,    // 0x45 branch if ra is true
+    OP_RBRF,    // 0x46 branch if ra is false
+    OP_RRET,    // 0x47 return ra
+
+    OP_FORNEXT  // 0x48 add a short literal step to a local, branch while it hasn't passed the limit local
+};
+
+// instruction sets an image can be compiled for, calls, traps and ASM code always use the stack
+enum VM_ISA {
+    VM_ISA_STACK,    // stack instructions only
+    VM_ISA_REGISTER  // register instructions for the functions lowered to the mid-level ir
 };
 
 #endif
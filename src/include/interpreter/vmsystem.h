@@ -20,10 +20,14 @@
 #define __VMSYSTEM_H__
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <setjmp.h>
 
 #include "vmtypes.h"
 
+// size of the console input buffer
+#define VM_INPUT_BUFSIZE 4096
+
 // system context
 typedef struct vm_context_s {
            jmp_buf errorTarget;      // error target
@@ -34,12 +38,15 @@ typedef struct vm_context_s {
            uint8_t *nextLow;         // next low memory heap space location
             size_t heapSize;         // size of heap space in bytes
             size_t maxHeapUsed;      // maximum amount of heap space allocated so far
+    struct MemoryChunk_s *chunks;    // chunks of the compiler arena, newest first
 } vm_context_t;
 
 void* vm_allocate_low_memory(vm_context_t *sys, size_t size);
  void vm_system_abort(vm_context_t *sys, const char *fmt, ...);
 
   int vm_getchar(void);
+size_t vm_input_buffer(uint8_t **pPtr);
+ void vm_input_consume(size_t n);
  void vm_printf(const char *fmt, ...);
  void vm_vprintf(const char *fmt, va_list ap);
  void vm_putchar(int ch);
@@ -24,5 +24,10 @@
 #include "system.h"
 
 void edit_workspace(vm_context_t *sys, System_line_t *sys_line);
+int edit_run(vm_context_t *sys, System_line_t *sys_line, const char *name);
+void edit_optimize(int level);
+void edit_isa(int set);
+void edit_cache(const char *dir);
+void edit_threads(int cnt);
 
 #endif
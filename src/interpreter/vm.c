@@ -24,6 +24,7 @@
 #include "vmopcodes.h"
 #include "vm.h"
 #include "vmsystem.h"
+#include "vmchannel.h"
 
 #ifdef VM_DEBUG
 #include "vmdebug.h"
@@ -33,11 +34,13 @@
 #include "vmtrap.h"
 #endif
 
+static uint8_t vm_run(vm_t *i);
+
 void vm_abort(vm_t *i, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     vm_printf("abort: ");
-    vm_printf(fmt, ap);
+    vm_vprintf(fmt, ap);
     vm_printf("\n");
     va_end(ap);
     if (i)
@@ -56,6 +59,12 @@ vm_t* vm_init(uint8_t *code, uint32_t code_len, VMVALUE stackSize, bool referenc
 
     i->stackTop = i->stack + stackSize;
     i->codelen = code_len;
+    memset(i->channels, 0, sizeof(i->channels));
+    i->pending = false;
+    i->loop = NULL;
+    i->waitFd = -1;
+    i->hostTrap = NULL;
+    i->user = NULL;
     i->stack_size = stackSize;
 
     if (reference_code) {
@@ -68,13 +77,26 @@ vm_t* vm_init(uint8_t *code, uint32_t code_len, VMVALUE stackSize, bool referenc
         i->code_referenced = false;
     }
 
+    // the export table of a compiled image is found through its header, code loaded later sets it with vm_image
+    i->exports = 0;
+    if (code != NULL)
+        vm_image(i);
+
     return i;
 }
 
+// take the export table offset from the header of the loaded image
+void vm_image(vm_t *i) {
+    i->exports = i->codelen >= sizeof(vm_image_t) ? ((vm_image_t*) i->code)->exports : 0;
+    if (i->exports >= i->codelen)
+        i->exports = 0;
+}
+
 void vm_deinit(vm_t *i) {
     if (i == NULL)
         return;
 
+    vm_channel_close_all(i);
     free(i->stack);
     if (!i->code_referenced)
         free(i->code);
@@ -84,16 +106,142 @@ void vm_deinit(vm_t *i) {
 
 // execute the main code
 uint8_t vm_execute(vm_t *i, VMVALUE mainCode) {
-    VMVALUE tmp;
-    int8_t tmpb;
-    int32_t cnt;
-
     // initialize
     i->pc = i->code + mainCode;
     i->sp = i->fp = i->stackTop;
+    i->pending = false;
+
+    if (setjmp(i->errorTarget))
+        return VM_ERROR;
+
+    return vm_run(i);
+}
+
+// suspend the vm from a trap handler, vm_run returns VM_PENDING when the trap returns
+void vm_suspend(vm_t *i) {
+    i->pending = true;
+}
+
+// resume a suspended vm with the trap result in tos
+uint8_t vm_resume(vm_t *i, VMVALUE result) {
+    if (!i->pending)
+        return VM_ERROR;
+
+    i->pending = false;
+    i->tos = result;
 
     if (setjmp(i->errorTarget))
-        return VMFALSE;
+        return VM_ERROR;
+
+    return vm_run(i);
+}
+
+// find an exported function by name
+vm_export_t* vm_find_function(vm_t *i, const char *fname) {
+    vm_export_t *entry;
+    VMVALUE cnt;
+
+    if (i->exports == 0)
+        return NULL;
+
+    // the table is a count followed by the entries
+    cnt = *(VMVALUE*) (i->code + i->exports);
+    entry = (vm_export_t*) (i->code + i->exports + sizeof(VMVALUE));
+    for (; --cnt >= 0; ++entry)
+        if (strcasecmp(fname, (char*) (i->code + entry->name)) == 0)
+            return entry;
+
+    return NULL;
+}
+
+// call an exported function, globals are preserved between calls
+uint8_t vm_call(vm_t *i, const char *fname, const VMVALUE *args, int argc, VMVALUE *result) {
+    vm_export_t *fcn;
+    VMVALUE cnt;
+    uint8_t status;
+    int n;
+
+    if (setjmp(i->errorTarget))
+        return VM_ERROR;
+
+    if (!(fcn = vm_find_function(i, fname)))
+        vm_abort(i, "undefined function '%s'", fname);
+    if (fcn->argc != argc)
+        vm_abort(i, "'%s' expects %d arguments", fname, fcn->argc);
+
+    // push the arguments so the first one ends up at fp[0]
+    i->sp = i->fp = i->stackTop;
+    for (n = argc; --n >= 0;)
+        vm_cpush(i, args[n]);
+
+    // return into the halt stub that follows the export table
+    cnt = *(VMVALUE*) (i->code + i->exports);
+    i->tos = i->exports + (1 + cnt * 3) * sizeof(VMVALUE);
+    i->pc = i->code + fcn->code;
+    i->pending = false;
+
+    // a suspended call leaves its result in tos when it halts after vm_resume
+    if ((status = vm_run(i)) != VM_HALTED)
+        return status;
+
+    if (result)
+        *result = i->tos;
+
+    return VM_HALTED;
+}
+
+// call an exported function once per row of arguments, argv holds rows * argc values
+uint8_t vm_call_batch(vm_t *i, const char *fname, const VMVALUE *argv, size_t rows, int argc, VMVALUE *results) {
+    vm_export_t *fcn;
+    uint8_t *code, *halt;
+    size_t row;
+    int cnt;
+
+    // one error target for the whole batch, the parameters are never changed after it
+    if (setjmp(i->errorTarget))
+        return VM_ERROR;
+
+    if (!(fcn = vm_find_function(i, fname)))
+        vm_abort(i, "undefined function '%s'", fname);
+    if (fcn->argc != argc)
+        vm_abort(i, "'%s' expects %d arguments", fname, fcn->argc);
+
+    code = i->code + fcn->code;
+    halt = i->code + i->exports + (1 + *(VMVALUE*) (i->code + i->exports) * 3) * sizeof(VMVALUE);
+    if (i->stack + argc > i->stackTop)
+        vm_stack_overflow(i);
+
+    for (row = 0; row < rows; ++row) {
+        // only the stack and frame pointers need resetting between rows
+        i->sp = i->fp = i->stackTop;
+        for (cnt = argc; --cnt >= 0;)
+            vm_push(i, argv[row * argc + cnt]);
+        i->tos = (VMVALUE) (halt - i->code);
+        i->pc = code;
+
+        // there is nowhere to continue the batch from after a suspension
+        switch (vm_run(i)) {
+            case VM_HALTED:
+                break;
+            case VM_PENDING:
+                i->pending = false;
+                vm_abort(i, "'%s' can't suspend in a batch call", fname);
+                break;
+            default:
+                return VM_ERROR;
+        }
+
+        results[row] = i->tos;
+    }
+
+    return VM_HALTED;
+}
+
+// run until HALT
+static uint8_t vm_run(vm_t *i) {
+    VMVALUE tmp;
+    int8_t tmpb;
+    int32_t cnt;
 
     for (;;) {
 #ifdef VM_DEBUG
@@ -102,7 +250,7 @@ uint8_t vm_execute(vm_t *i, VMVALUE mainCode) {
 #endif
         switch (VMCODEBYTE(i->pc++)) {
             case OP_HALT:
-                return VMTRUE;
+                return VM_HALTED;
             case OP_BRT:
                 for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0;)
                     tmp = (tmp << 8) | VMCODEBYTE(i->pc++);
@@ -290,13 +438,155 @@ uint8_t vm_execute(vm_t *i, VMVALUE mainCode) {
             case OP_TRAP:
 #ifdef VM_TRAP
                 vm_do_trap(i, VMCODEBYTE(i->pc++));
+                if (i->pending)
+                    return VM_PENDING;
 #endif
                 break;
+            case OP_RMOV:
+                vm_reg(i, 0) = vm_reg(i, 1);
+                i->pc += 2;
+                break;
+            case OP_RLIT:
+                for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0;)
+                    tmp = (tmp << 8) | VMCODEBYTE(i->pc + sizeof(VMUVALUE) - cnt);
+                vm_reg(i, 0) = tmp;
+                i->pc += 1 + sizeof(VMUVALUE);
+                break;
+            case OP_RSLIT:
+                vm_reg(i, 0) = (int8_t) VMCODEBYTE(i->pc + 1);
+                i->pc += 2;
+                break;
+            case OP_RNOT:
+                vm_reg(i, 0) = (vm_reg(i, 1) ? VMFALSE : VMTRUE);
+                i->pc += 2;
+                break;
+            case OP_RNEG:
+                vm_reg(i, 0) = -vm_reg(i, 1);
+                i->pc += 2;
+                break;
+            case OP_RBNOT:
+                vm_reg(i, 0) = ~vm_reg(i, 1);
+                i->pc += 2;
+                break;
+            case OP_RADD:
+                vm_reg(i, 0) = vm_reg(i, 1) + vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RSUB:
+                vm_reg(i, 0) = vm_reg(i, 1) - vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RMUL:
+                vm_reg(i, 0) = vm_reg(i, 1) * vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RDIV:
+                tmp = vm_reg(i, 2);
+                vm_reg(i, 0) = (tmp == 0 ? 0 : vm_reg(i, 1) / tmp);
+                i->pc += 3;
+                break;
+            case OP_RREM:
+                tmp = vm_reg(i, 2);
+                vm_reg(i, 0) = (tmp == 0 ? 0 : vm_reg(i, 1) % tmp);
+                i->pc += 3;
+                break;
+            case OP_RBAND:
+                vm_reg(i, 0) = vm_reg(i, 1) & vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RBOR:
+                vm_reg(i, 0) = vm_reg(i, 1) | vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RBXOR:
+                vm_reg(i, 0) = vm_reg(i, 1) ^ vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RSHL:
+                vm_reg(i, 0) = vm_reg(i, 1) << vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RSHR:
+                vm_reg(i, 0) = vm_reg(i, 1) >> vm_reg(i, 2);
+                i->pc += 3;
+                break;
+            case OP_RLT:
+                vm_reg(i, 0) = (vm_reg(i, 1) < vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_RLE:
+                vm_reg(i, 0) = (vm_reg(i, 1) <= vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_REQ:
+                vm_reg(i, 0) = (vm_reg(i, 1) == vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_RNE:
+                vm_reg(i, 0) = (vm_reg(i, 1) != vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_RGE:
+                vm_reg(i, 0) = (vm_reg(i, 1) >= vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_RGT:
+                vm_reg(i, 0) = (vm_reg(i, 1) > vm_reg(i, 2) ? VMTRUE : VMFALSE);
+                i->pc += 3;
+                break;
+            case OP_RADDI:
+                vm_reg(i, 0) = vm_reg(i, 1) + (int8_t) VMCODEBYTE(i->pc + 2);
+                i->pc += 3;
+                break;
+            case OP_RLOAD:
+                vm_reg(i, 0) = *(VMVALUE*) (i->code + vm_reg(i, 1));
+                i->pc += 2;
+                break;
+            case OP_RSTORE:
+                *(VMVALUE*) (i->code + vm_reg(i, 1)) = vm_reg(i, 0);
+                i->pc += 2;
+                break;
+            case OP_RINDEX:
+                vm_reg(i, 0) = vm_reg(i, 1) + vm_reg(i, 2) * sizeof(VMVALUE);
+                i->pc += 3;
+                break;
+            case OP_RBRT:
+                for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0;)
+                    tmp = (tmp << 8) | VMCODEBYTE(i->pc + sizeof(VMUVALUE) - cnt);
+                if (vm_reg(i, 0))
+                    i->pc += tmp;
+                i->pc += 1 + sizeof(VMUVALUE);
+                break;
+            case OP_RBRF:
+                for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0;)
+                    tmp = (tmp << 8) | VMCODEBYTE(i->pc + sizeof(VMUVALUE) - cnt);
+                if (!vm_reg(i, 0))
+                    i->pc += tmp;
+                i->pc += 1 + sizeof(VMUVALUE);
+                break;
+            case OP_RRET:
+                vm_cpush(i, i->tos);
+                i->tos = vm_reg(i, 0);
+                i->pc = (uint8_t*) i->code + vm_top(i);
+                i->sp = i->fp;
+                i->fp = (VMVALUE*) (i->stack + i->fp[F_FP]);
+                break;
+            case OP_FORNEXT:
+                // a negative step counts down to the limit
+                tmp = (int8_t) VMCODEBYTE(i->pc + 2);
+                vm_reg(i, 0) += tmp;
+                if (tmp < 0 ? vm_reg(i, 0) >= vm_reg(i, 1) : vm_reg(i, 0) <= vm_reg(i, 1)) {
+                    for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0;)
+                        tmp = (tmp << 8) | VMCODEBYTE(i->pc + 2 + sizeof(VMUVALUE) - cnt);
+                    i->pc += tmp;
+                }
+                i->pc += 3 + sizeof(VMUVALUE);
+                break;
             default:
                 vm_abort(i, "undefined opcode 0x%02x", VMCODEBYTE(i->pc - 1));
                 break;
         }
     }
 
-    return 0;
+    return VM_ERROR;
 }
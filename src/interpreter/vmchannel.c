@@ -0,0 +1,376 @@
+/*
+ * @vmchannel.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vm.h"
+#include "vmsystem.h"
+#include "vmchannel.h"
+
+// local function prototypes
+static vm_channel_t* chn_get(vm_t *i, VMVALUE chn, int mode);
+static bool chn_fill(vm_channel_t *ch);
+static bool chn_drain(vm_channel_t *ch);
+static void chn_write(vm_t *i, vm_channel_t *ch, const char *p, size_t n);
+
+// chn_avail - get the buffered input of a channel, NULL is the console, returns 0 at the end of the input
+static inline size_t chn_avail(vm_channel_t *ch, uint8_t **pPtr) {
+    if (!ch)
+        return vm_input_buffer(pPtr);
+
+    if (ch->ptr >= ch->end && !chn_fill(ch))
+        return 0;
+
+    *pPtr = ch->ptr;
+    return ch->end - ch->ptr;
+}
+
+// chn_consume - consume buffered channel input
+static inline void chn_consume(vm_channel_t *ch, size_t n) {
+    if (!ch)
+        vm_input_consume(n);
+    else
+        ch->ptr += n;
+}
+
+// chn_peek - get the next input byte from a channel without consuming it
+static inline int chn_peek(vm_channel_t *ch) {
+    uint8_t *p;
+
+    if (!chn_avail(ch, &p))
+        return EOF;
+
+    return *p;
+}
+
+// open a file on a channel
+void vm_channel_open(vm_t *i, VMVALUE chn, const char *name, VMVALUE mode) {
+    vm_channel_t *ch;
+    struct stat st;
+    int flags;
+
+    if (chn <= 0 || chn >= VM_MAXCHANNEL)
+        vm_abort(i, "invalid channel %d", chn);
+    if (i->channels[chn])
+        vm_abort(i, "channel %d is already open", chn);
+
+    switch (mode) {
+        case CHN_INPUT:
+            flags = O_RDONLY;
+            break;
+        case CHN_OUTPUT:
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        case CHN_APPEND:
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        default:
+            vm_abort(i, "invalid open mode %d", mode);
+            return;
+    }
+
+    if (!(ch = (vm_channel_t*) malloc(sizeof(vm_channel_t)))) {
+        vm_abort(i, "insufficient memory");
+        return;
+    }
+    if ((ch->fd = open(name, flags, 0644)) < 0) {
+        free(ch);
+        vm_abort(i, "can't open '%s'", name);
+        return;
+    }
+
+    ch->mode = mode;
+    ch->regular = fstat(ch->fd, &st) == 0 && S_ISREG(st.st_mode);
+    ch->map = NULL;
+    ch->mapLen = 0;
+    ch->bufCnt = 0;
+    ch->ptr = ch->end = ch->buf;
+
+    // large input files are read straight from a private mapping
+    if (mode == CHN_INPUT && ch->regular && st.st_size >= VM_CHANNEL_MMAP_MIN) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ch->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            ch->map = (uint8_t*) map;
+            ch->mapLen = st.st_size;
+            ch->ptr = ch->map;
+            ch->end = ch->map + ch->mapLen;
+        }
+    }
+
+    i->channels[chn] = ch;
+}
+
+// close a channel flushing any pending output
+void vm_channel_close(vm_t *i, VMVALUE chn) {
+    vm_channel_t *ch = chn_get(i, chn, -1);
+    bool ok = chn_drain(ch);
+
+    i->channels[chn] = NULL;
+    if (ch->map)
+        munmap(ch->map, ch->mapLen);
+    close(ch->fd);
+    free(ch);
+
+    if (!ok)
+        vm_abort(i, "write error on channel %d", chn);
+}
+
+// close all channels (without raising errors)
+void vm_channel_close_all(vm_t *i) {
+    int chn;
+
+    for (chn = 1; chn < VM_MAXCHANNEL; ++chn) {
+        vm_channel_t *ch;
+        if ((ch = i->channels[chn]) != NULL) {
+            i->channels[chn] = NULL;
+            chn_drain(ch);
+            if (ch->map)
+                munmap(ch->map, ch->mapLen);
+            close(ch->fd);
+            free(ch);
+        }
+    }
+}
+
+// write a string to a channel
+void vm_channel_puts(vm_t *i, VMVALUE chn, const char *str) {
+    if (chn == 0) {
+        while (*str != '\0')
+            vm_putchar(*str++);
+    } else
+        chn_write(i, chn_get(i, chn, CHN_OUTPUT), str, strlen(str));
+}
+
+// write a character to a channel
+void vm_channel_putc(vm_t *i, VMVALUE chn, int ch) {
+    char c = ch;
+
+    if (chn == 0)
+        vm_putchar(ch);
+    else
+        chn_write(i, chn_get(i, chn, CHN_OUTPUT), &c, 1);
+}
+
+// read an integer, leading blanks and commas are skipped
+VMVALUE vm_channel_input_int(vm_t *i, VMVALUE chn) {
+    vm_channel_t *ch = chn == 0 ? NULL : chn_get(i, chn, CHN_INPUT);
+    VMVALUE value = 0;
+    int c, neg = VMFALSE;
+
+    while ((c = chn_peek(ch)) != EOF && (isspace(c) || c == ','))
+        chn_consume(ch, 1);
+
+    if (c == '-' || c == '+') {
+        neg = (c == '-');
+        chn_consume(ch, 1);
+    }
+
+    // the character that ends the number is left for the next item or the end of the statement
+    while ((c = chn_peek(ch)) >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+        chn_consume(ch, 1);
+    }
+
+    return neg ? -value : value;
+}
+
+// discard the rest of the line after the last item of an input statement, a CRLF line end included
+void vm_channel_input_end(vm_t *i, VMVALUE chn) {
+    vm_channel_t *ch = chn == 0 ? NULL : chn_get(i, chn, CHN_INPUT);
+    uint8_t *start, *nl;
+    size_t avail;
+
+    while ((avail = chn_avail(ch, &start)) != 0) {
+        if ((nl = memchr(start, '\n', avail)) != NULL) {
+            chn_consume(ch, nl - start + 1);
+            break;
+        }
+        chn_consume(ch, avail);
+    }
+}
+
+// read a line into a vector of size values, one character per element followed by a zero
+VMVALUE vm_channel_line_input(vm_t *i, VMVALUE chn, VMVALUE addr, VMVALUE size) {
+    vm_channel_t *ch = chn == 0 ? NULL : chn_get(i, chn, CHN_INPUT);
+    VMVALUE *buf = (VMVALUE*) (i->code + addr);
+    VMVALUE len = 0;
+    int c = EOF;
+
+    if (size <= 0 || addr < 0 || addr + size * sizeof(VMVALUE) > i->codelen)
+        vm_abort(i, "invalid line buffer");
+
+    // copy whole runs out of the channel buffer
+    for (;;) {
+        uint8_t *start, *nl;
+        size_t avail;
+
+        if (!(avail = chn_avail(ch, &start))) {
+            c = EOF;
+            break;
+        }
+
+        if ((nl = memchr(start, '\n', avail)) != NULL)
+            avail = nl - start;
+
+        chn_consume(ch, nl ? avail + 1 : avail);
+        if (avail > (size_t) (size - 1 - len))
+            avail = size - 1 - len;
+        while (avail > 0) {
+            buf[len++] = *start++;
+            --avail;
+        }
+
+        if (nl) {
+            c = '\n';
+            break;
+        }
+    }
+
+    // drop the carriage return of a CRLF line end
+    if (len > 0 && buf[len - 1] == '\r')
+        --len;
+    buf[len] = 0;
+
+    return (c == EOF && len == 0) ? -1 : len;
+}
+
+// check for the end of an input channel
+VMVALUE vm_channel_eof(vm_t *i, VMVALUE chn) {
+    vm_channel_t *ch = chn == 0 ? NULL : chn_get(i, chn, CHN_INPUT);
+    uint8_t *p;
+
+    return chn_avail(ch, &p) ? VMFALSE : VMTRUE;
+}
+
+// get the descriptor to wait on before reading a channel, -1 if the next read will not block
+// a line read needs a whole line buffered, the input that is ready is gathered without blocking
+int vm_channel_wait_fd(vm_t *i, VMVALUE chn, bool line) {
+    vm_channel_t *ch;
+    struct pollfd pfd;
+    size_t cnt;
+    ssize_t n;
+
+    // the console is read through its own blocking buffer
+    if (chn == 0)
+        return -1;
+
+    ch = chn_get(i, chn, CHN_INPUT);
+    if (ch->regular)
+        return -1;
+
+    for (;;) {
+        cnt = ch->end - ch->ptr;
+        if (cnt > 0 && (!line || memchr(ch->ptr, '\n', cnt) || cnt == sizeof(ch->buf)))
+            return -1;
+
+        pfd.fd = ch->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0)
+            return ch->fd;
+
+        // poll said a read won't block, the end of the input is left for the read itself
+        memmove(ch->buf, ch->ptr, cnt);
+        ch->ptr = ch->buf;
+        ch->end = ch->buf + cnt;
+        do
+            n = read(ch->fd, ch->end, sizeof(ch->buf) - cnt);
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return -1;
+        ch->end += n;
+    }
+}
+
+// chn_get - get an open channel, mode -1 accepts any mode
+static vm_channel_t* chn_get(vm_t *i, VMVALUE chn, int mode) {
+    vm_channel_t *ch;
+
+    if (chn <= 0 || chn >= VM_MAXCHANNEL || !(ch = i->channels[chn]))
+        vm_abort(i, "channel %d is not open", chn);
+    else if (mode == CHN_INPUT && ch->mode != CHN_INPUT)
+        vm_abort(i, "channel %d is not open for input", chn);
+    else if (mode == CHN_OUTPUT && ch->mode == CHN_INPUT)
+        vm_abort(i, "channel %d is not open for output", chn);
+
+    return i->channels[chn];
+}
+
+// chn_fill - refill the read buffer, returns false at the end of the file
+static bool chn_fill(vm_channel_t *ch) {
+    ssize_t n;
+
+    if (ch->map)
+        return false;
+
+    do
+        n = read(ch->fd, ch->buf, sizeof(ch->buf));
+    while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return false;
+
+    ch->ptr = ch->buf;
+    ch->end = ch->buf + n;
+    return true;
+}
+
+// chn_drain - write out the output buffer, returns false on a write error
+static bool chn_drain(vm_channel_t *ch) {
+    uint8_t *p = ch->buf;
+    size_t cnt = ch->bufCnt;
+
+    ch->bufCnt = 0;
+    while (cnt > 0) {
+        ssize_t n = write(ch->fd, p, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        cnt -= n;
+    }
+
+    return true;
+}
+
+// chn_write - buffer output for a channel
+static void chn_write(vm_t *i, vm_channel_t *ch, const char *p, size_t n) {
+    while (n > 0) {
+        size_t room = sizeof(ch->buf) - ch->bufCnt;
+        if (room > n)
+            room = n;
+        memcpy(ch->buf + ch->bufCnt, p, room);
+        ch->bufCnt += room;
+        p += room;
+        n -= room;
+        if (ch->bufCnt == sizeof(ch->buf) && !chn_drain(ch))
+            vm_abort(i, "write error");
+    }
+}
@@ -70,6 +70,36 @@ otdef_t opcode_table[] = {
         { OP_NATIVE,  "NATIVE",  FMT_NATIVE },
         { OP_TRAP,    "TRAP",    FMT_BYTE   },
         { OP_RETURN,  "RETURNX", FMT_NONE   },  // RETURN is an basic keyword
+        { OP_RMOV,    "RMOV",    FMT_REG2   },
+        { OP_RLIT,    "RLIT",    FMT_REGW   },
+        { OP_RSLIT,   "RSLIT",   FMT_REGS   },
+        { OP_RNOT,    "RNOT",    FMT_REG2   },
+        { OP_RNEG,    "RNEG",    FMT_REG2   },
+        { OP_RBNOT,   "RBNOT",   FMT_REG2   },
+        { OP_RADD,    "RADD",    FMT_REG3   },
+        { OP_RSUB,    "RSUB",    FMT_REG3   },
+        { OP_RMUL,    "RMUL",    FMT_REG3   },
+        { OP_RDIV,    "RDIV",    FMT_REG3   },
+        { OP_RREM,    "RREM",    FMT_REG3   },
+        { OP_RBAND,   "RBAND",   FMT_REG3   },
+        { OP_RBOR,    "RBOR",    FMT_REG3   },
+        { OP_RBXOR,   "RBXOR",   FMT_REG3   },
+        { OP_RSHL,    "RSHL",    FMT_REG3   },
+        { OP_RSHR,    "RSHR",    FMT_REG3   },
+        { OP_RLT,     "RLT",     FMT_REG3   },
+        { OP_RLE,     "RLE",     FMT_REG3   },
+        { OP_REQ,     "REQ",     FMT_REG3   },
+        { OP_RNE,     "RNE",     FMT_REG3   },
+        { OP_RGE,     "RGE",     FMT_REG3   },
+        { OP_RGT,     "RGT",     FMT_REG3   },
+        { OP_RADDI,   "RADDI",   FMT_REGI   },
+        { OP_RLOAD,   "RLOAD",   FMT_REG2   },
+        { OP_RSTORE,  "RSTORE",  FMT_REG2   },
+        { OP_RINDEX,  "RINDEX",  FMT_REG3   },
+        { OP_RBRT,    "RBRT",    FMT_REGBR  },
+        { OP_RBRF,    "RBRF",    FMT_REGBR  },
+        { OP_RRET,    "RRET",    FMT_REG    },
+        { OP_FORNEXT, "FORNEXT", FMT_FORNEXT},
         { 0, NULL, 0 }
 };
 
@@ -120,7 +150,7 @@ int vmdebug_decode_instruction(VMUVALUE addr, const uint8_t *lc, char **str_code
     VMVALUE offset = 0;
     int8_t sbyte;
     otdef_t *op;
-    int n, i;
+    int n, i, cnt;
     char str[1024] = { 0 };
     char tmp[1024] = { 0 };
 
@@ -197,6 +227,63 @@ int vmdebug_decode_instruction(VMUVALUE addr, const uint8_t *lc, char **str_code
                         toStr(str, tmp, " # %04x\n", (int)(addr + 1 + sizeof(VMVALUE) + offset));
                     n += sizeof(VMVALUE);
                     break;
+                case FMT_REG:
+                case FMT_REG2:
+                case FMT_REG3:
+                case FMT_REGI:
+                case FMT_REGS:
+                    // one signed byte per operand
+                    cnt = op->fmt == FMT_REG ? 1 : op->fmt == FMT_REG2 || op->fmt == FMT_REGS ? 2 : 3;
+                    for (i = 0; i < sizeof(VMVALUE); ++i)
+                        if (!toCode)
+                            toStr(str, tmp, i < cnt ? "%02x " : "   ", VMCODEBYTE(lc + i + 1));
+                    toStr(str, tmp, "%s", op->name);
+                    for (i = 0; i < cnt; ++i)
+                        toStr(str, tmp, "%s%d", i == 0 ? " " : ", ", (int8_t) VMCODEBYTE(lc + i + 1));
+                    toStr(str, tmp, "\n");
+                    n += cnt;
+                    break;
+                case FMT_REGW:
+                case FMT_REGBR:
+                    // a register followed by a word
+                    sbyte = (int8_t) VMCODEBYTE(lc + 1);
+                    for (i = 0; i < sizeof(VMVALUE); ++i) {
+                        bytes[i] = VMCODEBYTE(lc + i + 2);
+                        offset = (offset << 8) | bytes[i];
+                    }
+                    if (!toCode) {
+                        toStr(str, tmp, "%02x ", (uint8_t ) sbyte);
+                        for (i = 0; i < sizeof(VMVALUE); ++i)
+                            toStr(str, tmp, "%02x ", bytes[i]);
+                    }
+                    toStr(str, tmp, "%s %d, ", op->name, sbyte);
+                    for (i = 0; i < sizeof(VMVALUE); ++i)
+                        toStr(str, tmp, "%02x", bytes[i]);
+                    if (!toCode && op->fmt == FMT_REGBR)
+                        toStr(str, tmp, " # %04x", (int)(addr + 2 + sizeof(VMVALUE) + offset));
+                    toStr(str, tmp, "\n");
+                    n += 1 + sizeof(VMVALUE);
+                    break;
+                case FMT_FORNEXT:
+                    // three signed bytes followed by a branch word
+                    for (i = 0; i < sizeof(VMVALUE); ++i) {
+                        bytes[i] = VMCODEBYTE(lc + i + 4);
+                        offset = (offset << 8) | bytes[i];
+                    }
+                    if (!toCode) {
+                        for (i = 0; i < 3; ++i)
+                            toStr(str, tmp, "%02x ", VMCODEBYTE(lc + i + 1));
+                        for (i = 0; i < sizeof(VMVALUE); ++i)
+                            toStr(str, tmp, "%02x ", bytes[i]);
+                    }
+                    toStr(str, tmp, "%s %d, %d, %d, ", op->name, (int8_t) VMCODEBYTE(lc + 1), (int8_t) VMCODEBYTE(lc + 2), (int8_t) VMCODEBYTE(lc + 3));
+                    for (i = 0; i < sizeof(VMVALUE); ++i)
+                        toStr(str, tmp, "%02x", bytes[i]);
+                    if (!toCode)
+                        toStr(str, tmp, " # %04x", (int)(addr + 4 + sizeof(VMVALUE) + offset));
+                    toStr(str, tmp, "\n");
+                    n += 3 + sizeof(VMVALUE);
+                    break;
             }
 
             *str_code = strdup(str);
@@ -0,0 +1,199 @@
+/*
+ * @vmloop.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "vmloop.h"
+
+#ifdef VM_LOOP_POLL
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+// local function prototypes
+static void loop_wake(vm_loop_t *loop, vm_t *i);
+
+// create an event loop
+vm_loop_t* vm_loop_init(vm_loop_done_t *done) {
+    vm_loop_t *loop;
+
+    if (!(loop = (vm_loop_t*) malloc(sizeof(vm_loop_t))))
+        return NULL;
+
+    loop->waiting = 0;
+    loop->done = done;
+
+#ifdef VM_LOOP_POLL
+    loop->fd = -1;
+    loop->fds = NULL;
+    loop->vms = NULL;
+    loop->max = 0;
+#else
+    if ((loop->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(loop);
+        return NULL;
+    }
+#endif
+
+    return loop;
+}
+
+// destroy an event loop, suspended vms are left suspended
+void vm_loop_deinit(vm_loop_t *loop) {
+    if (loop == NULL)
+        return;
+
+#ifdef VM_LOOP_POLL
+    free(loop->fds);
+    free(loop->vms);
+#else
+    close(loop->fd);
+#endif
+    free(loop);
+}
+
+// attach a vm to the loop and run its main code until it halts or suspends
+uint8_t vm_loop_start(vm_loop_t *loop, vm_t *i, VMVALUE mainCode) {
+    uint8_t status;
+
+    i->loop = loop;
+    if ((status = vm_execute(i, mainCode)) != VM_PENDING && loop->done)
+        (*loop->done)(i, status);
+
+    return status;
+}
+
+// suspend a vm until a descriptor is readable, called from a trap handler
+void vm_loop_wait(vm_t *i, int fd) {
+    vm_loop_t *loop = i->loop;
+
+#ifdef VM_LOOP_POLL
+    if (loop->waiting >= loop->max) {
+        int max = loop->max ? loop->max * 2 : VM_LOOP_EVENTS;
+        struct pollfd *fds;
+        vm_t **vms;
+
+        if (!(fds = (struct pollfd*) realloc(loop->fds, max * sizeof(struct pollfd))))
+            vm_abort(i, "insufficient memory");
+        loop->fds = fds;
+        if (!(vms = (vm_t**) realloc(loop->vms, max * sizeof(vm_t*))))
+            vm_abort(i, "insufficient memory");
+        loop->vms = vms;
+        loop->max = max;
+    }
+
+    loop->fds[loop->waiting].fd = fd;
+    loop->fds[loop->waiting].events = POLLIN;
+    loop->fds[loop->waiting].revents = 0;
+    loop->vms[loop->waiting] = i;
+#else
+    struct epoll_event ev;
+
+    // one shot so a descriptor shared over time never wakes a vm twice
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = i;
+    if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno == EEXIST)
+            vm_abort(i, "descriptor %d already has a waiting vm", fd);
+        vm_abort(i, "can't wait on descriptor %d", fd);
+    }
+#endif
+
+    i->waitFd = fd;
+    ++loop->waiting;
+    vm_suspend(i);
+}
+
+// resume a vm that a host trap suspended without waiting on a descriptor, the completion callback sees it end
+uint8_t vm_loop_resume(vm_t *i, VMVALUE result) {
+    uint8_t status;
+
+    if (!i->pending)
+        return VM_ERROR;
+
+    if ((status = vm_resume(i, result)) != VM_PENDING && i->loop && i->loop->done)
+        (*i->loop->done)(i, status);
+
+    return status;
+}
+
+// run until no vm is waiting on a descriptor, returns -1 on a loop error
+// vms suspended by host traps are not waited for, the host continues them with vm_loop_resume
+int vm_loop_run(vm_loop_t *loop) {
+#ifdef VM_LOOP_POLL
+    vm_t *ready[VM_LOOP_EVENTS];
+    int n, k, cnt;
+
+    while (loop->waiting > 0) {
+        if ((n = poll(loop->fds, loop->waiting, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // remove the ready vms before resuming any of them since they may wait again
+        for (k = cnt = 0; k < loop->waiting && cnt < VM_LOOP_EVENTS;) {
+            if (loop->fds[k].revents) {
+                ready[cnt++] = loop->vms[k];
+                --loop->waiting;
+                loop->fds[k] = loop->fds[loop->waiting];
+                loop->vms[k] = loop->vms[loop->waiting];
+            } else
+                ++k;
+        }
+
+        for (k = 0; k < cnt; ++k)
+            loop_wake(loop, ready[k]);
+    }
+#else
+    struct epoll_event ev[VM_LOOP_EVENTS];
+    int n, k;
+
+    while (loop->waiting > 0) {
+        if ((n = epoll_wait(loop->fd, ev, VM_LOOP_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (k = 0; k < n; ++k) {
+            vm_t *i = (vm_t*) ev[k].data.ptr;
+            epoll_ctl(loop->fd, EPOLL_CTL_DEL, i->waitFd, NULL);
+            --loop->waiting;
+            loop_wake(loop, i);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+// loop_wake - resume a vm whose descriptor is ready, the waiting trap runs again
+static void loop_wake(vm_loop_t *loop, vm_t *i) {
+    uint8_t status;
+
+    i->waitFd = -1;
+    if ((status = vm_resume(i, i->tos)) != VM_PENDING && loop->done)
+        (*loop->done)(i, status);
+}
@@ -18,6 +18,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "vmsystem.h"
 
@@ -33,8 +35,46 @@ void* vm_allocate_low_memory(vm_context_t *sys, size_t size) {
     return p;
 }
 
+// console input is read from stdin in blocks and shared by vm_getchar and channel 0
+static uint8_t inBuf[VM_INPUT_BUFSIZE];
+static uint8_t *inPtr = inBuf, *inEnd = inBuf;
+
+// get the buffered console input, refilling the buffer when it is empty, returns 0 at the end of the input
+size_t vm_input_buffer(uint8_t **pPtr) {
+    ssize_t n;
+
+    if (inPtr >= inEnd) {
+        // show any prompt before blocking
+        fflush(stdout);
+        do
+            n = read(STDIN_FILENO, inBuf, sizeof(inBuf));
+        while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+            return 0;
+
+        inPtr = inBuf;
+        inEnd = inBuf + n;
+    }
+
+    *pPtr = inPtr;
+    return inEnd - inPtr;
+}
+
+// consume buffered console input
+void vm_input_consume(size_t n) {
+    inPtr += n;
+}
+
 int vm_getchar(void) {
-    int ch = getchar();
+    uint8_t *p;
+    int ch;
+
+    if (!vm_input_buffer(&p))
+        return EOF;
+
+    ch = *p;
+    vm_input_consume(1);
     if (ch == '\r')
         ch = '\n';
 
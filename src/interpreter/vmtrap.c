@@ -16,12 +16,32 @@
  * @see https://github.com/hiperiondev/basic_lang
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "vm.h"
+#include "vmchannel.h"
+#include "vmloop.h"
 
+// wait_input - suspend until a channel is readable when running under an event loop, or until it holds a whole line
+//              the trap is executed again when the vm is resumed
+static bool wait_input(vm_t *i, VMVALUE chn, bool line) {
+    int fd;
+
+    if (!i->loop || (fd = vm_channel_wait_fd(i, chn, line)) < 0)
+        return false;
+
+    i->pc -= 2;
+    vm_loop_wait(i, fd);
+    return true;
+}
+
+// the print and file traps take the channel in tos
 void vm_do_trap(vm_t *i, uint8_t op) {
+    VMVALUE chn, tmp, tmp2;
+    char buf[16];
+
     switch (op) {
         case TRAP_GetChar:
             vm_push(i, i->tos);
@@ -32,24 +52,69 @@ void vm_do_trap(vm_t *i, uint8_t op) {
             i->tos = vm_pop(i);
             break;
         case TRAP_PrintStr:
-            vm_printf("%s", (char*) (i->code + i->tos));
-            i->tos = *i->sp++;
+            chn = i->tos;
+            tmp = vm_pop(i);
+            vm_channel_puts(i, chn, (char*) (i->code + tmp));
+            i->tos = vm_pop(i);
             break;
         case TRAP_PrintInt:
-            vm_printf("%d", i->tos);
-            i->tos = *i->sp++;
+            chn = i->tos;
+            tmp = vm_pop(i);
+            sprintf(buf, "%d", tmp);
+            vm_channel_puts(i, chn, buf);
+            i->tos = vm_pop(i);
             break;
         case TRAP_PrintTab:
-            vm_putchar('\t');
+            vm_channel_putc(i, i->tos, '\t');
+            i->tos = vm_pop(i);
             break;
         case TRAP_PrintNL:
-            vm_putchar('\n');
+            vm_channel_putc(i, i->tos, '\n');
+            i->tos = vm_pop(i);
             break;
         case TRAP_PrintFlush:
             vm_flush();
             break;
+        case TRAP_Open:
+            chn = i->tos;
+            tmp = vm_pop(i);
+            tmp2 = vm_pop(i);
+            vm_channel_open(i, chn, (char*) (i->code + tmp2), tmp);
+            i->tos = vm_pop(i);
+            break;
+        case TRAP_Close:
+            vm_channel_close(i, i->tos);
+            i->tos = vm_pop(i);
+            break;
+        case TRAP_InputInt:
+            if (wait_input(i, i->tos, true))
+                break;
+            i->tos = vm_channel_input_int(i, i->tos);
+            break;
+        case TRAP_LineInput:
+            if (wait_input(i, i->tos, true))
+                break;
+            chn = i->tos;
+            tmp = vm_pop(i);
+            tmp2 = vm_pop(i);
+            i->tos = vm_channel_line_input(i, chn, tmp2, tmp);
+            break;
+        case TRAP_Eof:
+            if (wait_input(i, i->tos, false))
+                break;
+            i->tos = vm_channel_eof(i, i->tos);
+            break;
+        case TRAP_InputEnd:
+            if (wait_input(i, i->tos, true))
+                break;
+            vm_channel_input_end(i, i->tos);
+            i->tos = vm_pop(i);
+            break;
         default:
-            vm_abort(i, "undefined print opcode 0x%02x", op);
+            if (i->hostTrap)
+                (*i->hostTrap)(i, op);
+            else
+                vm_abort(i, "undefined trap 0x%02x", op);
             break;
     }
 }
@@ -29,6 +29,7 @@
 #include "vmsystem.h"
 #include "vmdebug.h"
 #include "optimize.h"
+#include "mir.h"
 #include "vm.h"
 
 #define MAXTOKEN  32
@@ -46,6 +47,8 @@ typedef struct {
           uint8_t *buffer;
           uint8_t *bufferTop;
            Line_t *currentLine;
+     SourceMap_t *source;  // mapped program compiled instead of the buffer when set
+  FunctionCache_t *cache;  // code of the functions kept between the runs of the interactive editor
 } EditBuf_t;
 
 // command handlers
@@ -54,6 +57,7 @@ static void DoList(EditBuf_t *buf);
 static void DoRun(EditBuf_t *buf);
 static void DoRenum(EditBuf_t *buf);
 static void DoLoad(EditBuf_t *buf);
+static int LoadProgram(EditBuf_t *buf);
 static void DoSave(EditBuf_t *buf);
 static void DoSaveBin(EditBuf_t *buf);
 static void DoRunBin(EditBuf_t *buf);
@@ -87,12 +91,18 @@ System_line_t *sys_line;
 GetLineHandler *getLine;
 void *getLineCookie;
 vm_t *i;
+static FunctionCache_t functionCache;
+static int optLevel = MIR_LEVEL_DEFAULT;
+static int isa = VM_ISA_STACK;
+static const char *cacheDir = NULL;
+static int threads = 1;
 
 // prototypes
 static char* NextToken(System_line_t *sys);
 static int ParseNumber(char *token, int *pValue);
 static int IsBlank(char *p);
 static int SetProgramName(EditBuf_t *buf);
+static int RunProgram(EditBuf_t *buf);
 
 // edit buffer prototypes
 static EditBuf_t* BufInit(vm_context_t *sys);
@@ -110,6 +120,7 @@ void edit_workspace(vm_context_t *sys, System_line_t *sys_line) {
     
     if (!(editBuf = BufInit(sys)))
         vm_system_abort(sys, "insufficient memory for edit buffer");
+    editBuf->cache = &functionCache;
 
     while (system_get_line(sys_line, &lineNumber)) {
 
@@ -145,6 +156,50 @@ void edit_workspace(vm_context_t *sys, System_line_t *sys_line) {
     }
 }
 
+// edit_optimize - set the optimization level of the following compiles
+void edit_optimize(int level) {
+    optLevel = level < MIR_LEVEL_NONE ? MIR_LEVEL_NONE : level > MIR_LEVEL_MAX ? MIR_LEVEL_MAX : level;
+}
+
+// edit_isa - set the instruction set of the following compiles
+void edit_isa(int set) {
+    isa = set;
+}
+
+// edit_threads - set the number of threads that generate the functions of the following compiles
+void edit_threads(int cnt) {
+    threads = cnt < 1 ? 1 : cnt;
+}
+
+// edit_cache - set the directory that keeps the images of the programs run from files
+void edit_cache(const char *dir) {
+    cacheDir = *dir ? dir : NULL;
+}
+
+// edit_run - load and run a program without the interactive editor, false when it can't be loaded or compiled or aborts
+int edit_run(vm_context_t *sys, System_line_t *sys_line, const char *name) {
+    EditBuf_t *editBuf;
+    SourceMap_t map;
+    int ok = VMFALSE;
+
+    if (!(editBuf = BufInit(sys)))
+        vm_system_abort(sys, "insufficient memory for edit buffer");
+
+    snprintf(editBuf->programName, sizeof(editBuf->programName), "%s", name);
+    editBuf->sys_line = sys_line;
+
+    // a file that can be mapped is compiled in place without loading it into the edit buffer
+    if (system_fs_map(name, &map)) {
+        editBuf->source = &map;
+        ok = RunProgram(editBuf);
+        editBuf->source = NULL;
+        system_fs_unmap(&map);
+    } else if (LoadProgram(editBuf))
+        ok = RunProgram(editBuf);
+
+    return ok;
+}
+
 static void DoHelp(EditBuf_t *buf) {
     for (uint32_t i = 0; cmds[i].name != NULL; ++i)
         printf("%s: %s\n", cmds[i].name, cmds[i].help);
@@ -167,35 +222,81 @@ static char* EditGetLine(char *buf, int len, int *pLineNumber, void *cookie) {
     return BufGetLine(editBuf, pLineNumber, buf);
 }
 
-static void compileProgram(EditBuf_t *buf, bool debug) {
+static int compileProgram(EditBuf_t *buf, bool debug) {
+    int ok;
+
     sys = buf->sys;
     sys_line = buf->sys_line;
     
     sys->nextHigh = buf->buffer;
     sys->nextLow = sys->freeSpace;
+    system_arena_release(sys);
 
     if (!(c = InitCompileContext(sys)))
         vm_printf("insufficient memory");
     
     system_get_main_source(sys_line, &getLine, &getLineCookie);
     
-    system_set_main_source(sys_line, EditGetLine, buf);
-    BufSeekN(buf, 0);
+    if (buf->source) {
+        buf->source->next = buf->source->base;
+        buf->source->lineNumber = 0;
+        sys_line->map = buf->source;
+    } else {
+        system_set_main_source(sys_line, EditGetLine, buf);
+        BufSeekN(buf, 0);
+    }
 
     c->sys_line = buf->sys_line;
-    Compile(c, debug);
+    c->cache = buf->cache;
+    c->g->optLevel = optLevel;
+    c->g->isa = isa;
+    c->g->threads = threads;
+    ok = Compile(c, debug);
+    sys_line->map = NULL;
+    return ok;
 }
 
 static void DoRun(EditBuf_t *buf) {
-    compileProgram(buf, false);
-    if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false)))
-        vm_printf("insufficient memory");
-    else {
-        vm_execute(i, c->g->mainCode);
-        vm_deinit(i);
+    RunProgram(buf);
+}
+
+// RunProgram - compile and run the program, false when it doesn't compile or aborts
+static int RunProgram(EditBuf_t *buf) {
+    CachedImage_t image;
+    uint64_t key = 0;
+    int ok;
+
+    // a program file compiled before with the same includes and options runs from its stored image
+    if (cacheDir && buf->source) {
+        key = ImageKey(buf->source, optLevel, isa);
+        if (LoadCachedImage(cacheDir, key, &image)) {
+            ok = VMFALSE;
+            if (!(i = vm_init(image.code, image.codeLen, 1024, false)))
+                vm_printf("insufficient memory");
+            else {
+                ok = vm_execute(i, image.mainCode) != VM_ERROR;
+                vm_deinit(i);
+            }
+            free(image.code);
+            return ok;
+        }
+    }
+
+    if ((ok = compileProgram(buf, false)) != VMFALSE) {
+        optimize(c, false);
+        if (cacheDir && buf->source)
+            StoreCachedImage(cacheDir, key, c);
+        if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false))) {
+            vm_printf("insufficient memory");
+            ok = VMFALSE;
+        } else {
+            ok = vm_execute(i, c->g->mainCode) != VM_ERROR;
+            vm_deinit(i);
+        }
     }
 
     system_set_main_source(sys_line, getLine, getLineCookie);
+    return ok;
 }
 
 static void DoRenum(EditBuf_t *buf) {
@@ -223,11 +324,28 @@ static int SetProgramName(EditBuf_t *buf) {
     return buf->programName[0] != '\0';
 }
 
-static void DoLoad(EditBuf_t *buf) {
+static int LoadProgram(EditBuf_t *buf) {
     int lineNumber = 100;
     int lineNumberIncrement = 10;
+    System_line_t *sys_line = buf->sys_line;
     VMFILE *fp;
-    
+
+    if (!(fp = VM_fopen(buf->programName, "r"))) {
+        vm_printf("error loading '%s'\n", buf->programName);
+        return VMFALSE;
+    }
+
+    BufNew(buf);
+    while (system_fs_get_line(sys_line, fp)) {
+        BufAddLineN(buf, lineNumber, sys_line->lineBuf);
+        lineNumber += lineNumberIncrement;
+    }
+    VM_fclose(fp);
+
+    return VMTRUE;
+}
+
+static void DoLoad(EditBuf_t *buf) {
     // check for a program name on the command line
     if (!SetProgramName(buf)) {
         vm_printf("expecting a file name\n");
@@ -235,18 +353,8 @@ static void DoLoad(EditBuf_t *buf) {
     }
     
     // load the program
-    if (!(fp = VM_fopen(buf->programName, "r")))
-        vm_printf("error loading '%s'\n", buf->programName);
-    else {
-        System_line_t *sys_line = buf->sys_line;;
-        vm_printf("Loading '%s'\n", buf->programName);
-        BufNew(buf);
-        while (VM_fgets(sys_line->lineBuf, sizeof(sys_line->lineBuf), fp) != NULL) {
-            BufAddLineN(buf, lineNumber, sys_line->lineBuf);
-            lineNumber += lineNumberIncrement;
-        }
-        VM_fclose(fp);
-    }
+    vm_printf("Loading '%s'\n", buf->programName);
+    LoadProgram(buf);
 }
 
 static void DoSave(EditBuf_t *buf) {
@@ -281,20 +389,24 @@ static void DoSaveBin(EditBuf_t *buf) {
         return;
     }
 
-    // save compiled program
-    if (!(fp = VM_fopen(buf->programName, "w")))
-        vm_printf("error saving '%s'\n", buf->programName);
-    else {
-        compileProgram(buf, true);
-        if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false)))
-            vm_printf("insufficient memory");
+    // save compiled program, nothing is written for a program that doesn't compile
+    if (compileProgram(buf, true)) {
+        if (!(fp = VM_fopen(buf->programName, "w")))
+            vm_printf("error saving '%s'\n", buf->programName);
         else {
-            VM_fwrite(&c->g->mainCode, sizeof(uint32_t), 1, fp);
-            VM_fwrite(&i->codelen, sizeof(uint32_t), 1, fp);
-            VM_fwrite(&i->stack_size, sizeof(uint32_t), 1, fp);
-            VM_fwrite(i->code, i->codelen, 1, fp);
-            VM_fclose(fp);
-            vm_deinit(i);
+            optimize(c, false);
+            if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false)))
+                vm_printf("insufficient memory");
+            else {
+                uint32_t version = VM_IMAGE_VERSION;
+                VM_fwrite(&version, sizeof(uint32_t), 1, fp);
+                VM_fwrite(&c->g->mainCode, sizeof(uint32_t), 1, fp);
+                VM_fwrite(&i->codelen, sizeof(uint32_t), 1, fp);
+                VM_fwrite(&i->stack_size, sizeof(uint32_t), 1, fp);
+                VM_fwrite(i->code, i->codelen, 1, fp);
+                VM_fclose(fp);
+                vm_deinit(i);
+            }
         }
     }
 
@@ -303,7 +415,7 @@ static void DoSaveBin(EditBuf_t *buf) {
 
 static void DoRunBin(EditBuf_t *buf) {
     VMFILE *fp;
-    uint32_t mainCode, codeLen, stackSize;
+    uint32_t version, mainCode, codeLen, stackSize;
 
     // check for a program name on the command line
     if (!SetProgramName(buf)) {
@@ -314,7 +426,11 @@ static void DoRunBin(EditBuf_t *buf) {
     // load the program
     if (!(fp = VM_fopen(buf->programName, "r")))
         vm_printf("error loading '%s'\n", buf->programName);
-    else {
+    else if (VM_fread(&version, sizeof(uint32_t), 1, fp) != 1 || version != VM_IMAGE_VERSION) {
+        // an image saved by another version has a different layout
+        vm_printf("'%s' is not a compiled program of this version\n", buf->programName);
+        VM_fclose(fp);
+    } else {
         VM_fread(&mainCode, sizeof(uint32_t), 1, fp);
         VM_fread(&codeLen, sizeof(uint32_t), 1, fp);
         VM_fread(&stackSize, sizeof(uint32_t), 1, fp);
@@ -324,6 +440,7 @@ static void DoRunBin(EditBuf_t *buf) {
         else {
             VM_fread(i->code, codeLen * sizeof(uint8_t), 1, fp);
             VM_fclose(fp);
+            vm_image(i);
 
             vm_execute(i, mainCode);
             vm_deinit(i);
@@ -345,9 +462,8 @@ static void DoCat(EditBuf_t *buf) {
 }
 
 static void DoDump(EditBuf_t *buf) {
-    compileProgram(buf, false);
-
-    optimize(c, true);
+    if (compileProgram(buf, false))
+        optimize(c, true);
     //DumpStrings(c);
     //DumpSymbols(&c->globals, "Globals");
     //DumpFunctions(c->g);
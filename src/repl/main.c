@@ -35,14 +35,19 @@
 // that is "free" (as long as you don't need a deeper stack, of course).
 
 
+// the workspace holds the edit buffer and the program image, its size can be set with -w<kbytes>
 #define WORKSPACE_SIZE  (64 * 1024)
-uint8_t workspace[WORKSPACE_SIZE];
 
 static char *GetConsoleLine(char *buf, int size, int *pLineNumber, void *cookie) {
     int i = 0;
     while (i < size - 1) {
         int ch = vm_getchar();
-        if (ch == '\n') {
+        if (ch == EOF) {
+            if (i == 0)
+                return NULL;
+            break;
+        }
+        else if (ch == '\n') {
             buf[i++] = '\n';
             vm_putchar('\n');
             break;
@@ -67,11 +72,37 @@ static char *GetConsoleLine(char *buf, int size, int *pLineNumber, void *cookie)
 }
 
 int main(int argc, char *argv[]) {
-    vm_context_t *sys = system_init_context(workspace, sizeof(workspace));
+    size_t workspaceSize = WORKSPACE_SIZE;
+    uint8_t *workspace;
+    vm_context_t *sys;
     System_line_t sys_line;
 
-    if (sys) {
+    // -O0, -O1 and -O2 select the optimization level, -r the register instruction set, -w the workspace size,
+    // -c the directory of the images kept for program files, -j the number of threads that generate code
+    while (argc > 1 && argv[1][0] == '-' && (argv[1][1] == 'O' || argv[1][1] == 'w' || argv[1][1] == 'c' || argv[1][1] == 'j' || strcmp(argv[1], "-r") == 0)) {
+        if (argv[1][1] == 'O')
+            edit_optimize(atoi(&argv[1][2]));
+        else if (argv[1][1] == 'j')
+            edit_threads(atoi(&argv[1][2]));
+        else if (argv[1][1] == 'c')
+            edit_cache(&argv[1][2]);
+        else if (argv[1][1] == 'w')
+            workspaceSize = (size_t) atol(&argv[1][2]) * 1024;
+        else
+            edit_isa(VM_ISA_REGISTER);
+        --argc;
+        ++argv;
+    }
+
+    if ((workspace = (uint8_t*) malloc(workspaceSize)) != NULL
+            && (sys = system_init_context(workspace, workspaceSize)) != NULL
+            && system_init_line(&sys_line)) {
         sys_line.getLine = GetConsoleLine;
+
+        // run a program file directly for batch jobs, a program that can't be loaded or compiled or that aborts fails the job
+        if (argc > 1)
+            return edit_run(sys, &sys_line, argv[1]) ? 0 : 1;
+
         vm_printf("///////////////////////////////////////////\n");
         vm_printf("//////// BASIC                     ////////\n");
         vm_printf("////////     for commands use HELP ////////\n");
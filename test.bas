@@ -24,3 +24,41 @@ b = 2
 print "Hello, world!"
 print foo(12)
 print baz(4, 6)
+
+REM FOR loops with negative, large and variable STEP and one that never runs
+for i = 10 to 1 step -3
+ print "down", i
+next i
+
+for i = 0 to 1000000 step 250000
+ print "up", i
+next i
+
+d = -2
+n = 0
+for i = 5 to -5 step d
+ n = n + i
+next i
+print "variable", n
+
+for i = 1 to 0
+ print "never"
+next i
+print "zero trip", i
+
+REM expected output at every optimization level and instruction set:
+REM Hello, world!
+REM a=2
+REM 3
+REM 46
+REM down    10
+REM down    7
+REM down    4
+REM down    1
+REM up      0
+REM up      250000
+REM up      500000
+REM up      750000
+REM up      1000000
+REM variable        0
+REM zero trip       1
@@ -0,0 +1,26 @@
+REM functions the host calls through vm_call and vm_call_batch
+
+base = 100
+count = 0
+
+function add(a, b)
+ return a + b
+end function
+
+function scaled(x)
+ return base + x * 10
+end function
+
+function tick()
+ count = count + 1
+ return count
+end function
+
+function depth(n)
+ if n = 0 then
+  return 0
+ end if
+ return depth(n - 1) + 1
+end function
+
+base = 200
@@ -0,0 +1,116 @@
+/*
+ * @host_call.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "compile.h"
+#include "vm.h"
+
+#define WORKSPACE_SIZE (256 * 1024)
+
+static uint8_t workspace[WORKSPACE_SIZE];
+static int failures = 0;
+
+// check - report a failed expectation
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// compile the program named on the command line and call its functions from the host
+int main(int argc, char *argv[]) {
+    System_line_t sys_line;
+    SourceMap_t map;
+    vm_context_t *sys;
+    ParseContext_t *c;
+    VMVALUE args[2], result;
+    VMVALUE rows[6], results[3];
+    vm_t *i;
+
+    if (argc < 2) {
+        printf("usage: host_call file.bas\n");
+        return 1;
+    }
+
+    memset(&sys_line, 0, sizeof(sys_line));
+    if (!(sys = system_init_context(workspace, sizeof(workspace))) || !system_init_line(&sys_line) || !system_fs_map(argv[1], &map)) {
+        printf("can't load '%s'\n", argv[1]);
+        return 1;
+    }
+    map.next = map.base;
+    map.lineNumber = 0;
+    sys_line.map = &map;
+
+    if (!(c = InitCompileContext(sys)))
+        return 1;
+    c->sys_line = &sys_line;
+    if (!Compile(c, false))
+        return 1;
+
+    // vm_init finds the export table through the image header
+    if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false)))
+        return 1;
+    check(i->exports != 0, "export table found by vm_init");
+
+    // calls made before main see the globals main starts by assigning
+    args[0] = 4;
+    check(vm_call(i, "scaled", args, 1, &result) == VM_HALTED && result == 140, "scaled(4) before main");
+
+    check(vm_execute(i, c->g->mainCode) == VM_HALTED, "main runs");
+    check(vm_call(i, "scaled", args, 1, &result) == VM_HALTED && result == 240, "scaled(4) after main");
+
+    // arguments arrive in order and names are not case sensitive
+    args[0] = 7;
+    args[1] = -3;
+    check(vm_call(i, "ADD", args, 2, &result) == VM_HALTED && result == 4, "ADD(7, -3)");
+
+    // globals are preserved between calls
+    check(vm_call(i, "tick", NULL, 0, &result) == VM_HALTED && result == 1, "first tick");
+    check(vm_call(i, "tick", NULL, 0, &result) == VM_HALTED && result == 2, "second tick");
+
+    // errors leave the interpreter usable for the next call
+    check(vm_call(i, "nope", args, 1, &result) == VM_ERROR, "undefined function");
+    check(vm_call(i, "add", args, 1, &result) == VM_ERROR, "wrong argument count");
+    check(vm_call(i, "add", args, 2, &result) == VM_HALTED && result == 4, "call after an error");
+
+    // a batch runs one call per row and leaves the results in order
+    rows[0] = 1; rows[1] = 2;
+    rows[2] = 10; rows[3] = 20;
+    rows[4] = -5; rows[5] = 5;
+    check(vm_call_batch(i, "add", rows, 3, 2, results) == VM_HALTED && results[0] == 3 && results[1] == 30 && results[2] == 0, "add batch");
+    check(vm_call_batch(i, "tick", NULL, 3, 0, results) == VM_HALTED && results[0] == 3 && results[1] == 4 && results[2] == 5, "tick batch");
+    check(vm_call_batch(i, "add", rows, 0, 2, results) == VM_HALTED, "empty batch");
+
+    // an error in the middle of a batch stops it after the rows before it
+    memset(results, 0, sizeof(results));
+    rows[0] = 3;
+    rows[1] = 100000;
+    rows[2] = 4;
+    check(vm_call_batch(i, "depth", rows, 3, 1, results) == VM_ERROR && results[0] == 3 && results[2] == 0, "error in a batch");
+    check(vm_call_batch(i, "add", rows, 3, 1, results) == VM_ERROR, "batch with the wrong argument count");
+    check(vm_call_batch(i, "depth", rows, 1, 1, results) == VM_HALTED && results[0] == 3, "batch after an error");
+
+    vm_deinit(i);
+    system_fs_unmap(&map);
+
+    printf("host_call: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
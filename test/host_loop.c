@@ -0,0 +1,133 @@
+/*
+ * @host_loop.c
+ *
+ * @brief
+ * @details
+ * This is based on other projects:
+ *   junkbasic (David Michael Betz): https://github.com/dbetz/junkbasic/
+ *   Others (see individual files)
+ *
+ *   please contact their authors for more information.
+ *
+ * @author Emiliano Gonzalez (egonzalez . hiperion @ gmail . com))
+ * @version 0.1
+ * @date 2023
+ * @copyright MIT License
+ * @see https://github.com/hiperiondev/basic_lang
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "compile.h"
+#include "vm.h"
+#include "vmloop.h"
+
+#define WORKSPACE_SIZE (256 * 1024)
+
+// descriptor the program opens as /dev/fd/9
+#define INPUT_FD 9
+
+static uint8_t workspace[WORKSPACE_SIZE];
+static int failures = 0;
+static int finished = 0;
+static uint8_t finalStatus = VM_ERROR;
+
+// check - report a failed expectation
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// done - loop completion callback
+static void done(vm_t *i, uint8_t status) {
+    ++finished;
+    finalStatus = status;
+}
+
+// feed - write the input in pieces that split numbers and lines, so every read waits more than once
+static void feed(int fd) {
+    static const char *pieces[] = { "1", "2,", " 3", "0\n", "he", "llo", "\n" };
+    size_t n;
+
+    for (n = 0; n < sizeof(pieces) / sizeof(pieces[0]); ++n) {
+        usleep(20000);
+        if (write(fd, pieces[n], strlen(pieces[n])) < 0)
+            break;
+    }
+    close(fd);
+}
+
+// run the program named on the command line under the event loop while a child process feeds its input
+int main(int argc, char *argv[]) {
+    System_line_t sys_line;
+    SourceMap_t map;
+    vm_context_t *sys;
+    ParseContext_t *c;
+    vm_loop_t *loop;
+    VMVALUE args[1], result;
+    int fds[2], status;
+    pid_t pid;
+    vm_t *i;
+
+    if (argc < 2) {
+        printf("usage: host_loop file.bas\n");
+        return 1;
+    }
+
+    memset(&sys_line, 0, sizeof(sys_line));
+    if (!(sys = system_init_context(workspace, sizeof(workspace))) || !system_init_line(&sys_line) || !system_fs_map(argv[1], &map)) {
+        printf("can't load '%s'\n", argv[1]);
+        return 1;
+    }
+    map.next = map.base;
+    map.lineNumber = 0;
+    sys_line.map = &map;
+
+    if (!(c = InitCompileContext(sys)))
+        return 1;
+    c->sys_line = &sys_line;
+    if (!Compile(c, false))
+        return 1;
+
+    if (!(i = vm_init(c->g->codeBuf, c->g->code_len, 1024, false)) || !(loop = vm_loop_init(done)))
+        return 1;
+
+    // the pipe is empty when main starts, the child writes to it later
+    if (pipe(fds) < 0 || dup2(fds[0], INPUT_FD) < 0)
+        return 1;
+    close(fds[0]);
+    if ((pid = fork()) < 0)
+        return 1;
+    if (pid == 0) {
+        close(INPUT_FD);
+        feed(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    // the first INPUT finds nothing to read and suspends, the trap runs again on every wake up
+    check(vm_loop_start(loop, i, c->g->mainCode) == VM_PENDING, "main waits for input");
+    check(vm_loop_run(loop) == 0, "loop runs");
+    waitpid(pid, &status, 0);
+    check(finished == 1 && finalStatus == VM_HALTED, "main halts once");
+
+    check(vm_call(i, "sum", NULL, 0, &result) == VM_HALTED && result == 42, "numbers split across writes");
+    args[0] = 0;
+    check(vm_call(i, "letter", args, 1, &result) == VM_HALTED && result == 'h', "first letter of the line");
+    args[0] = 4;
+    check(vm_call(i, "letter", args, 1, &result) == VM_HALTED && result == 'o', "last letter of the line");
+    check(vm_call(i, "atEnd", NULL, 0, &result) == VM_HALTED && result != 0, "end of input after the writer closes");
+
+    vm_loop_deinit(loop);
+    vm_deinit(i);
+    close(INPUT_FD);
+    system_fs_unmap(&map);
+
+    printf("host_loop: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
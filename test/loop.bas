@@ -0,0 +1,23 @@
+REM channel input the host writes to a pipe a piece at a time, read under the event loop
+
+include "io.bas"
+
+dim s[40]
+
+open "/dev/fd/9" for input as #1
+input #1, a, b
+line input #1, s
+ended = eof(1)
+close #1
+
+function sum()
+ return a + b
+end function
+
+function letter(n)
+ return s[n]
+end function
+
+function atEnd()
+ return ended
+end function
@@ -0,0 +1,17 @@
+#! /bin/sh
+# build the host tests against the sources and run them, from the root of the repository
+CC=${CC:-cc}
+OUT=${OUT:-/tmp/basic_lang_tests}
+INC="-Isrc/include/compiler -Isrc/include/interpreter -Isrc/include/repl"
+LIB=$(ls src/compiler/*.c src/interpreter/*.c)
+fail=0
+
+mkdir -p "$OUT" || exit 1
+
+$CC -pthread $INC test/host_call.c $LIB -o "$OUT/host_call" && "$OUT/host_call" test/call.bas || fail=1
+
+# channel input under the poll() loop, the one used where epoll is not available
+$CC -pthread -DVM_LOOP_POLL $INC test/host_loop.c $LIB -o "$OUT/host_loop" && "$OUT/host_loop" test/loop.bas || fail=1
+
+[ $fail -eq 0 ] && echo "all tests passed"
+exit $fail